@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <grpcpp/support/message_allocator.h>
+
+namespace c3::kademlia {
+  /// A protobuf arena whose first block is part of the object itself
+  ///
+  /// Anything that fits in that block costs no allocations at all, which is most of our messages
+  /// bar the values themselves.
+  template<size_t BlockSize = 4096>
+  class inline_arena {
+  private:
+    alignas(8) std::array<char, BlockSize> block;
+    google::protobuf::Arena arena;
+
+  private:
+    inline google::protobuf::ArenaOptions options() {
+      google::protobuf::ArenaOptions ret;
+      ret.initial_block = block.data();
+      ret.initial_block_size = block.size();
+      return ret;
+    }
+
+  public:
+    template<typename T>
+    inline T* make() { return google::protobuf::Arena::CreateMessage<T>(&arena); }
+    /// Frees everything made so far, apart from the first block, which is reused
+    inline void reset() { arena.Reset(); }
+
+  public:
+    inline inline_arena() : arena{options()} {}
+
+    inline_arena(const inline_arena&) = delete;
+    inline_arena& operator=(const inline_arena&) = delete;
+  };
+
+  /// Hands gRPC's callback server its messages, from arenas that are kept around between calls
+  ///
+  /// Each call gets an arena of its own to put the request and response on, and gives it back
+  /// once the reply is sent, so a server under steady load stops allocating for its messages.
+  template<typename Req, typename Res>
+  class arena_allocator : public grpc::MessageAllocator<Req, Res> {
+  private:
+    class holder : public grpc::MessageHolder<Req, Res> {
+    private:
+      arena_allocator* owner;
+
+    public:
+      inline_arena<> arena;
+
+    public:
+      inline void Release() override { owner->give_back(this); }
+
+      inline void reset() {
+        arena.reset();
+        this->set_request(arena.template make<Req>());
+        this->set_response(arena.template make<Res>());
+      }
+
+    public:
+      inline holder(arena_allocator* owner) : owner{owner} { reset(); }
+    };
+
+  private:
+    // Past this, arenas given back are freed, so a burst doesn't pin its memory forever
+    size_t max_spare;
+
+    //
+    std::mutex spare_mutex;
+    std::vector<std::unique_ptr<holder>> spare;
+    //
+
+  private:
+    inline void give_back(holder* h) {
+      std::unique_ptr<holder> owned{h};
+      owned->reset();
+
+      std::unique_lock lock{spare_mutex};
+      if (spare.size() < max_spare)
+        spare.push_back(std::move(owned));
+    }
+
+  public:
+    inline grpc::MessageHolder<Req, Res>* AllocateMessages() override {
+      {
+        std::unique_lock lock{spare_mutex};
+        if (!spare.empty()) {
+          auto ret = spare.back().release();
+          spare.pop_back();
+          return ret;
+        }
+      }
+      return new holder{this};
+    }
+
+  public:
+    inline arena_allocator(size_t max_spare = 64) : max_spare{max_spare} {}
+  };
+}
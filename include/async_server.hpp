@@ -0,0 +1,215 @@
+#pragma once
+
+#include "arena.hpp"
+#include "base.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "format.pb.h"
+#include "format.grpc.pb.h"
+
+namespace c3::kademlia {
+  /// Completion queues of our own for a server, each with its own threads
+  ///
+  /// Each queue has a thread that takes calls off it, and a few workers that run them. Calls wait
+  /// between the two in a bounded backlog, and once that's full any more are turned away with
+  /// RESOURCE_EXHAUSTED, rather than left to time out after the client has given up on them.
+  ///
+  /// On Linux, each queue's threads are kept to a core of their own, for as long as the cores last.
+  class server_queues {
+  public:
+    /// Anything we put on a queue as a tag
+    class call {
+    public:
+      size_t queue;
+
+    public:
+      /// Called when the tag comes back off its queue. Returns true if run should be called
+      virtual bool arrived(bool ok) = 0;
+      /// Called on one of the queue's workers
+      virtual void run() = 0;
+      /// Called instead of run, when the backlog is full
+      virtual void shed() = 0;
+      virtual ~call() = default;
+    };
+
+    struct stats_t {
+      size_t queues = 0;
+      size_t threads = 0;
+      size_t served = 0;
+      size_t shed = 0;
+    };
+
+  private:
+    struct queue_t {
+      std::unique_ptr<grpc::ServerCompletionQueue> cq;
+      std::thread poller;
+      std::vector<std::thread> workers;
+
+      //
+      std::mutex backlog_mutex;
+      std::condition_variable backlog_condvar;
+      std::deque<call*> backlog;
+      bool stopping = false;
+      //
+    };
+
+  private:
+    std::vector<std::unique_ptr<queue_t>> queues;
+    size_t threads_per_queue;
+    size_t max_backlog;
+
+    std::atomic<size_t> served = 0;
+    std::atomic<size_t> shed = 0;
+    bool stopped = false;
+
+  private:
+    void poller_body(queue_t& q);
+    void worker_body(queue_t& q);
+
+  public:
+    inline size_t size() const { return queues.size(); }
+    inline grpc::ServerCompletionQueue* get(size_t index) { return queues[index]->cq.get(); }
+    stats_t get_stats() const;
+
+    /// Starts the threads, which must wait until the server has been built
+    void start();
+    /// Runs whatever is left in the backlogs, then shuts the queues down and drains them. The server
+    /// must be shut down already. Only the first call does anything
+    void stop();
+
+  public:
+    /// Zero queues means one for each core. The queues come from builder, so this has to happen
+    /// before the server is built
+    server_queues(grpc::ServerBuilder& builder, size_t queue_count, size_t threads_per_queue, size_t max_backlog);
+    ~server_queues();
+  };
+
+  using async_service_base =
+    proto::Kademlia::WithAsyncMethod_ping<
+    proto::Kademlia::WithAsyncMethod_store<
+    proto::Kademlia::WithAsyncMethod_find_node<
+    proto::Kademlia::WithAsyncMethod_find_value<
+    proto::Kademlia::WithAsyncMethod_store_batch<
+    proto::Kademlia::WithAsyncMethod_find_node_batch<
+    proto::Kademlia::WithAsyncMethod_find_value_batch<
+    proto::Kademlia::Service>>>>>>>;
+
+  /// Serves the unary RPCs from server_queues, handing each to Handler's handle_* methods
+  ///
+  /// The streams are passed to Handler's synchronous versions as they are, and so run on gRPC's
+  /// own threads.
+  template<typename Handler>
+  class async_service : public async_service_base {
+  private:
+    template<typename Req, typename Res>
+    using request_t = void (async_service::*)(grpc::ServerContext*, Req*, grpc::ServerAsyncResponseWriter<Res>*,
+                                              grpc::CompletionQueue*, grpc::ServerCompletionQueue*, void*);
+    template<typename Req, typename Res>
+    using handle_t = grpc::Status (Handler::*)(grpc::ServerContextBase*, const Req*, Res*);
+
+    template<typename Req, typename Res>
+    class unary_call : public server_queues::call {
+    private:
+      async_service* owner;
+      request_t<Req, Res> request;
+      handle_t<Req, Res> handle;
+
+      inline_arena<> arena;
+      grpc::ServerContext ctx;
+      Req* req = arena.make<Req>();
+      Res* res = arena.make<Res>();
+      grpc::ServerAsyncResponseWriter<Res> responder{&ctx};
+      bool finishing = false;
+
+    public:
+      inline bool arrived(bool ok) override {
+        // Either we've replied, or the server is going away and there'll never be a call
+        if (finishing || !ok) {
+          delete this;
+          return false;
+        }
+        // Someone has to be waiting for the next one before we get on with this
+        owner->arm(queue, request, handle);
+        return true;
+      }
+
+      inline void run() override {
+        grpc::Status status;
+        try { status = (owner->handler.*handle)(&ctx, req, res); }
+        catch (const std::exception& e) { status = {grpc::StatusCode::UNKNOWN, e.what()}; }
+        catch (...) { status = {grpc::StatusCode::UNKNOWN, ""}; }
+
+        finishing = true;
+        responder.Finish(*res, status, static_cast<server_queues::call*>(this));
+      }
+
+      inline void shed() override {
+        finishing = true;
+        responder.FinishWithError({grpc::StatusCode::RESOURCE_EXHAUSTED, "Too busy"},
+                                  static_cast<server_queues::call*>(this));
+      }
+
+    public:
+      inline unary_call(async_service* owner, size_t queue_index, request_t<Req, Res> request, handle_t<Req, Res> handle) :
+        owner{owner}, request{request}, handle{handle} {
+        queue = queue_index;
+        auto cq = owner->queues.get(queue);
+        (owner->*request)(&ctx, req, &responder, cq, cq, static_cast<server_queues::call*>(this));
+      }
+    };
+
+  private:
+    Handler& handler;
+    server_queues queues;
+
+  private:
+    template<typename Req, typename Res>
+    inline void arm(size_t queue, request_t<Req, Res> request, handle_t<Req, Res> handle) {
+      // This is owned by the queue from here, and deletes itself once it's done
+      new unary_call<Req, Res>{this, queue, request, handle};
+    }
+
+  public:
+    inline server_queues::stats_t get_stats() const { return queues.get_stats(); }
+
+    /// Gets every queue waiting for each RPC. The server must have been built
+    inline void start() {
+      queues.start();
+      for (size_t i = 0; i < queues.size(); ++i) {
+        arm<proto::PingRequest, proto::PingResponse>(i, &async_service::Requestping, &Handler::handle_ping);
+        arm<proto::StoreRequest, proto::StoreResponse>(i, &async_service::Requeststore, &Handler::handle_store);
+        arm<proto::FindNodeRequest, proto::FindNodeResponse>(i, &async_service::Requestfind_node, &Handler::handle_find_node);
+        arm<proto::FindValueRequest, proto::FindValueResponse>(i, &async_service::Requestfind_value, &Handler::handle_find_value);
+        arm<proto::StoreBatchRequest, proto::StoreBatchResponse>(i, &async_service::Requeststore_batch, &Handler::handle_store_batch);
+        arm<proto::FindBatchRequest, proto::FindNodeBatchResponse>(i, &async_service::Requestfind_node_batch, &Handler::handle_find_node_batch);
+        arm<proto::FindBatchRequest, proto::FindValueBatchResponse>(i, &async_service::Requestfind_value_batch, &Handler::handle_find_value_batch);
+      }
+    }
+    /// The server must be shut down first
+    inline void stop() { queues.stop(); }
+
+    inline grpc::Status store_stream(grpc::ServerContext* ctx, grpc::ServerReader<proto::StoreChunk>* reader,
+                                     proto::StoreResponse* res) override {
+      return handler.store_stream(ctx, reader, res);
+    }
+    inline grpc::Status find_value_stream(grpc::ServerContext* ctx, const proto::FindValueRequest* req,
+                                          grpc::ServerWriter<proto::FindValueChunk>* writer) override {
+      return handler.find_value_stream(ctx, req, writer);
+    }
+
+  public:
+    inline async_service(Handler& handler, grpc::ServerBuilder& builder,
+                         size_t queue_count, size_t threads_per_queue, size_t max_backlog) :
+      handler{handler},
+      queues{builder, queue_count, threads_per_queue, max_backlog} {}
+  };
+}
@@ -1,5 +1,9 @@
 #pragma once
 #include "base.hpp"
+#include "buffer.hpp"
+#include "eviction.hpp"
+#include "expiry_wheel.hpp"
+#include "path_cache.hpp"
 
 #include <shared_mutex>
 #include <vector>
@@ -7,14 +11,13 @@
 #include <map>
 
 #include <functional>
-#include <thread>
 #include <atomic>
 
 namespace c3::kademlia {
   class backing_store {
   public:
     struct value_t {
-      std::vector<uint8_t> dat;
+      buffer dat;
       age_t age;
     };
     struct stats_t {
@@ -22,37 +25,227 @@ namespace c3::kademlia {
       size_t bytes_max = 0;
       size_t keys_used = 0;
       size_t keys_max = 0;
+      size_t keys_expiring = 0;
+      size_t disk_bytes = 0;
+      size_t compaction_debt = 0;
+      eviction_policy::stats_t eviction = {};
+    };
+    /// Where a scan left off. A default constructed cursor starts from the beginning
+    ///
+    /// What the fields mean is up to the store. Keys that are present for a whole scan are returned
+    /// at least once, but a store that reorganises itself mid-scan may return some of them again.
+    struct cursor_t {
+      nid_t after = {};
+      uint64_t position = 0;
+      uint64_t generation = 0;
+      bool started = false;
+      bool done = false;
+    };
+    struct scan_t {
+      std::vector<std::pair<nid_t, value_t>> items;
+      cursor_t next;
+    };
+    /// What a scan asked for zero items returns at most, so that looping until done always ends
+    static constexpr size_t default_scan_batch = 64;
+
+    /// Takes a value a piece at a time, so that it never has to be in memory all at once
+    ///
+    /// Nothing is visible until it is committed, and a writer dropped before then throws away
+    /// whatever it was given.
+    class writer {
+    private:
+      nid_hasher hasher;
+      size_t expected;
+      size_t written = 0;
+
+    protected:
+      /// Called with each piece, in order
+      virtual bool put(span<const uint8_t> data) noexcept = 0;
+      /// Called once every byte is in and they hash to nid
+      virtual bool finish(const nid_t& nid) noexcept = 0;
+
+    public:
+      inline size_t size() const { return expected; }
+
+      inline bool write(span<const uint8_t> data) noexcept {
+        try {
+          if (static_cast<size_t>(data.size()) > expected - written)
+            return false;
+          hasher.update(data);
+          written += static_cast<size_t>(data.size());
+          return put(data);
+        }
+        catch (...) {
+          return false;
+        }
+      }
+
+      /// Fails unless we got exactly size() bytes, and they hash to nid
+      inline bool commit(const nid_t& nid) noexcept {
+        try {
+          return written == expected && hasher.finish() == nid && finish(nid);
+        }
+        catch (...) {
+          return false;
+        }
+      }
+
+    public:
+      inline writer(size_t size) : expected{size} {}
+      virtual ~writer() = default;
     };
 
   public:
-    virtual bool store(span<const uint8_t>, age_t age = age_t{0}) noexcept = 0;
+    /// Stores that keep values in memory hold on to the buffer itself, rather than copying it
+    virtual bool store(buffer, age_t age = age_t{0}) noexcept = 0;
+    /// The caller keeps the bytes, so by default we have to take our own copy
+    virtual bool store(span<const uint8_t> s, age_t age = age_t{0}) noexcept {
+      try { return store(buffer::copy(s), age); }
+      catch (...) { return false; }
+    }
+    /// Returns null if there's no way a value this big would fit
+    ///
+    /// By default this gathers the value up and stores it in one go, so only stores that can
+    /// write it out as it comes in save any memory. size comes from whoever is sending the value,
+    /// so stores must check it against their limits before anything is allocated.
+    virtual std::unique_ptr<writer> begin_store(size_t size, age_t age = age_t{0}) noexcept;
     virtual std::optional<value_t> retrieve(nid_t) noexcept = 0;
+    /// How big a value is, without reading it in
+    ///
+    /// By default this retrieves it, which is only cheap for stores that keep values in memory.
+    virtual std::optional<size_t> size_of(nid_t nid) noexcept {
+      if (auto val = retrieve(nid))
+        return val->dat.size();
+      return std::nullopt;
+    }
+    /// Up to length bytes of a value from offset on, so that a big one can be sent a piece at a
+    /// time. Nothing if we don't have it, or offset is past its end
+    ///
+    /// By default this retrieves the whole value and slices it, as above.
+    virtual std::optional<buffer> read(nid_t nid, size_t offset, size_t length) noexcept {
+      try {
+        if (auto val = retrieve(nid); val && offset <= val->dat.size())
+          return val->dat.slice(offset, std::min(length, val->dat.size() - offset));
+      }
+      catch (...) {}
+      return std::nullopt;
+    }
+    /// Stores many values at once. ret[i] says how values[i] went
+    ///
+    /// By default this stores them one by one, but a store can hash them all together and go
+    /// through its lock once.
+    virtual std::vector<bool> store_batch(std::vector<value_t> values) noexcept;
+    /// ret[i] is what retrieve(nids[i]) would have given
+    virtual std::vector<std::optional<value_t>> retrieve_batch(span<const nid_t> nids) noexcept;
     virtual std::vector<nid_t> get_all_keys() noexcept = 0;
+    /// Keeps a copy of a value that a lookup found on its way past us, until ttl is up
+    ///
+    /// These are kept apart from what is stored, so they never turn up in a scan, are never
+    /// replicated and don't count against the store's limits. By default they are kept in memory.
+    virtual bool cache(buffer b, std::chrono::seconds ttl) noexcept {
+      try { return cached.insert(compute_nid(b), std::move(b), ttl); }
+      catch (...) { return false; }
+    }
+    /// Only looks at what cache was given
+    virtual std::optional<value_t> retrieve_cached(nid_t nid) noexcept {
+      try {
+        if (auto found = cached.get(nid))
+          return value_t{std::move(found->first), found->second};
+      }
+      catch (...) {}
+      return std::nullopt;
+    }
+    inline path_cache::stats_t get_cache_stats() const { return cached.get_stats(); }
+    /// Returns up to max_items values from where the cursor left off, without holding anything
+    /// between calls, so that a whole store can be walked in bounded memory while others write.
+    /// Zero means default_scan_batch
+    virtual scan_t scan(cursor_t from, size_t max_items) noexcept = 0;
     virtual stats_t get_stats() noexcept = 0;
 
+  protected:
+    path_cache cached;
+
   public:
     virtual ~backing_store() = default;
 
   public:
+    class gather_writer;
     class simple;
+    class sharded;
+    class log;
   };
 
+  /// Holds a value in memory until it is all there, then stores it in one go
+  ///
+  /// This only grows as the value actually arrives, as the size it was promised may be a lie.
+  class backing_store::gather_writer : public backing_store::writer {
+  private:
+    backing_store* store;
+    age_t age;
+    std::vector<uint8_t> data;
+
+  protected:
+    inline bool put(span<const uint8_t> s) noexcept override final {
+      try {
+        data.insert(data.end(), s.begin(), s.end());
+        return true;
+      }
+      catch (...) {
+        return false;
+      }
+    }
+
+    inline bool finish(const nid_t&) noexcept override final {
+      try { return store->store(buffer::adopt(std::move(data)), age); }
+      catch (...) { return false; }
+    }
+
+  public:
+    inline gather_writer(backing_store* store, size_t size, age_t age) :
+      writer{size}, store{store}, age{age} {}
+  };
+
+  // If we can't even allocate the results, there is nothing better to give back than nothing
+  inline std::vector<bool> backing_store::store_batch(std::vector<value_t> values) noexcept {
+    std::vector<bool> ret;
+    try {
+      ret.resize(values.size(), false);
+      for (size_t i = 0; i < values.size(); ++i)
+        ret[i] = store(std::move(values[i].dat), values[i].age);
+    }
+    catch (...) {}
+    return ret;
+  }
+
+  inline std::vector<std::optional<backing_store::value_t>> backing_store::retrieve_batch(span<const nid_t> nids) noexcept {
+    std::vector<std::optional<value_t>> ret;
+    try {
+      ret.resize(static_cast<size_t>(nids.size()));
+      for (size_t i = 0; i < ret.size(); ++i)
+        ret[i] = retrieve(nids[fix_gsl_bs(i)]);
+    }
+    catch (...) {}
+    return ret;
+  }
+
+  inline std::unique_ptr<backing_store::writer> backing_store::begin_store(size_t size, age_t age) noexcept {
+    try { return std::make_unique<gather_writer>(this, size, age); }
+    catch (...) { return nullptr; }
+  }
+
   class backing_store::simple : public backing_store {
   private:
     struct value_data {
       std::chrono::steady_clock::time_point birth;
-      std::vector<uint8_t> data;
-      std::thread expire_thread;
-
-      value_data(decltype(birth) birth_, decltype(data) data_, decltype(expire_thread) expire_thread_) :
-        birth{std::move(birth_)},
-        data{std::move(data_)},
-        expire_thread{std::move(expire_thread_)} {}
+      // The wheel may still hold an older schedule for an evicted and restored key
+      std::chrono::steady_clock::time_point expires;
+      buffer data;
     };
 
   private:
     size_t max_size;
     size_t max_keys;
+    std::unique_ptr<eviction_policy> policy;
 
     //
     std::shared_mutex values_mutex;
@@ -60,71 +253,176 @@ namespace c3::kademlia {
     std::atomic<size_t> values_total_size = 0;
     //
 
-    //
-    std::mutex die_mutex;
-    std::condition_variable die_condvar;
-    std::atomic<bool> die_value = false;
-    //
+    // Must come after values, so that it stops before they are destroyed
+    expiry_wheel expiry{[this](auto& nids) { expire(nids); }};
 
   private:
-    void expire(nid_t nid) {
-      std::unique_lock lock{die_mutex};
-      // We don't really care if we time out, the process is basically the same
-      die_condvar.wait_for(lock, tExpire, [&]() -> bool { return die_value; });
-      std::unique_lock values_lock{values_mutex};
-      auto iter = values.find(nid);
-      // Sp00ky
-      if (iter == values.end())
-        abort();
+    void expire(std::vector<nid_t>& nids) {
+      auto now = std::chrono::steady_clock::now();
+      std::unique_lock lock{values_mutex};
+      for (auto& nid : nids) {
+        auto iter = values.find(nid);
+        if (iter == values.end() || iter->second.expires > now)
+          continue;
+        erase(iter);
+      }
+    }
+
+    void erase(decltype(values)::iterator iter) {
+      if (policy)
+        policy->removed(iter->first);
       values_total_size -= iter->second.data.size();
-      --max_keys;
-      iter->second.expire_thread.detach();
-      values.erase(nid);
+      values.erase(iter);
     }
 
-  public:
-    inline bool store(span<const uint8_t> s, age_t age) noexcept override final {
-      try {
-        // This is expensive and independent of obj state, so we do this outside the mutex
-        auto nid = compute_nid(s);
-        // This is also independent of obj state, and may be expensive (depending on implementation)
-        auto birth = std::chrono::steady_clock::now();
+    /// Must hold values_mutex uniquely
+    bool make_room(const nid_t& incoming, size_t size) {
+      if (size > max_size)
+        return false;
 
-        std::unique_lock lock{values_mutex};
+      while (values.size() >= max_keys || values_total_size + size > max_size) {
+        if (!policy)
+          return false;
 
-        if (values.size() == max_keys)
+        auto victim = policy->evict_for(incoming);
+        if (!victim)
           return false;
 
-        // Check to see if we already have it
-        if (values.find(nid) != values.end())
-          return true;
+        if (auto iter = values.find(*victim); iter != values.end())
+          erase(iter);
+        else
+          // Shouldn't happen, but make sure it can't come back round
+          policy->removed(*victim);
+      }
 
-        if (values_total_size + s.size() > max_size)
-          return false;
+      return true;
+    }
 
-        values_total_size += s.size();
-        ++max_keys;
+    /// Must hold values_mutex uniquely
+    bool insert(const nid_t& nid, std::chrono::steady_clock::time_point now, age_t age, buffer& b) {
+      // Check to see if we already have it
+      if (values.find(nid) != values.end())
+        return true;
+
+      if (!make_room(nid, b.size()))
+        return false;
 
-        values.emplace(nid, value_data{birth - age, {s.begin(), s.end()},
-                                       std::thread{&simple::expire, this, nid}});
+      values_total_size += b.size();
 
+      values.emplace(nid, value_data{now - age, now + tExpire, std::move(b)});
+      if (policy)
+        policy->inserted(nid);
+      expiry.schedule(nid, tExpire);
 
-        return true;
+      return true;
+    }
+
+  public:
+    using backing_store::store;
+
+    inline bool store(buffer b, age_t age) noexcept override final {
+      try {
+        // This is expensive and independent of obj state, so we do this outside the mutex
+        auto nid = compute_nid(b);
+        // This is also independent of obj state, and may be expensive (depending on implementation)
+        auto birth = std::chrono::steady_clock::now();
+
+        std::unique_lock lock{values_mutex};
+        return insert(nid, birth, age, b);
       }
       catch (...) {
         return false;
       }
     }
 
+    inline std::vector<bool> store_batch(std::vector<value_t> batch) noexcept override final {
+      std::vector<bool> ret(batch.size(), false);
+
+      try {
+        // Hashing them together lets big batches use a few cores
+        std::vector<span<const uint8_t>> data;
+        data.reserve(batch.size());
+        for (auto& i : batch)
+          data.push_back(i.dat.get());
+        auto nids = compute_nids(data);
+        auto now = std::chrono::steady_clock::now();
+
+        std::unique_lock lock{values_mutex};
+        for (size_t i = 0; i < batch.size(); ++i)
+          ret[i] = insert(nids[i], now, batch[i].age, batch[i].dat);
+      }
+      catch (...) {}
+
+      return ret;
+    }
+
     inline std::optional<value_t> retrieve(nid_t nid) noexcept override final {
       // This is also independent of obj state, and may be expensive (depending on implementation)
       auto now = std::chrono::steady_clock::now();
       std::shared_lock lock{values_mutex};
 
-      if (auto i = values.find(nid); i != values.end())
+      if (auto i = values.find(nid); i != values.end()) {
+        if (policy)
+          policy->hit(nid);
         return value_t{ i->second.data, std::chrono::duration_cast<age_t>(now - i->second.birth) };
-      else
+      }
+      else {
+        if (policy)
+          policy->miss(nid);
         return std::nullopt;
+      }
+    }
+
+    inline std::unique_ptr<writer> begin_store(size_t size, age_t age) noexcept override final {
+      if (size > max_size)
+        return nullptr;
+      return backing_store::begin_store(size, age);
+    }
+
+    // Streaming a value out reads it many times over, so only its first piece counts as a hit
+    inline std::optional<size_t> size_of(nid_t nid) noexcept override final {
+      std::shared_lock lock{values_mutex};
+      if (auto i = values.find(nid); i != values.end())
+        return i->second.data.size();
+      return std::nullopt;
+    }
+
+    inline std::optional<buffer> read(nid_t nid, size_t offset, size_t length) noexcept override final {
+      try {
+        std::shared_lock lock{values_mutex};
+        if (auto i = values.find(nid); i != values.end() && offset <= i->second.data.size()) {
+          if (policy && offset == 0)
+            policy->hit(nid);
+          return i->second.data.slice(offset, std::min(length, i->second.data.size() - offset));
+        }
+      }
+      catch (...) {}
+      return std::nullopt;
+    }
+
+    inline std::vector<std::optional<value_t>> retrieve_batch(span<const nid_t> nids) noexcept override final {
+      std::vector<std::optional<value_t>> ret;
+
+      try {
+        ret.resize(static_cast<size_t>(nids.size()));
+
+        auto now = std::chrono::steady_clock::now();
+        std::shared_lock lock{values_mutex};
+
+        for (size_t i = 0; i < ret.size(); ++i) {
+          auto& nid = nids[fix_gsl_bs(i)];
+          if (auto iter = values.find(nid); iter != values.end()) {
+            if (policy)
+              policy->hit(nid);
+            ret[i] = value_t{ iter->second.data, std::chrono::duration_cast<age_t>(now - iter->second.birth) };
+          }
+          else if (policy)
+            policy->miss(nid);
+        }
+      }
+      catch (...) {}
+
+      return ret;
     }
 
     inline std::vector<nid_t> get_all_keys() noexcept override final {
@@ -141,17 +439,49 @@ namespace c3::kademlia {
       return ret;
     }
 
+    inline scan_t scan(cursor_t from, size_t max_items) noexcept override final {
+      scan_t ret{{}, from};
+      if (!max_items)
+        max_items = default_scan_batch;
+
+      try {
+        auto now = std::chrono::steady_clock::now();
+        std::shared_lock lock{values_mutex};
+
+        // The map is ordered, so we can just pick up after the last key we gave out
+        auto iter = from.started ? values.upper_bound(from.after) : values.begin();
+        for (; iter != values.end() && ret.items.size() < max_items; ++iter)
+          ret.items.emplace_back(iter->first, value_t{ iter->second.data,
+                                                       std::chrono::duration_cast<age_t>(now - iter->second.birth) });
+
+        ret.next.started = true;
+        if (!ret.items.empty())
+          ret.next.after = ret.items.back().first;
+        ret.next.done = iter == values.end();
+      }
+      // Better to give up on this pass than to loop on the same failure forever
+      catch (...) {
+        ret.next.done = true;
+      }
+
+      return ret;
+    }
+
     inline stats_t get_stats() noexcept override final {
       return {
             .bytes_used = values_total_size,
             .bytes_max = max_size,
             .keys_used = values.size(),
-            .keys_max = max_keys
+            .keys_max = max_keys,
+            .keys_expiring = expiry.pending(),
+            .eviction = policy ? policy->get_stats() : eviction_policy::stats_t{}
       };
     }
 
   public:
-    inline simple(size_t max_size = 16 * 1024 * 1024, size_t max_keys = 1024) :
-      max_size{max_size}, max_keys{max_keys} {}
+    /// Without a policy, stores are turned away once we are full
+    inline simple(size_t max_size = 16 * 1024 * 1024, size_t max_keys = 1024,
+                  std::unique_ptr<eviction_policy> policy = nullptr) :
+      max_size{max_size}, max_keys{max_keys}, policy{std::move(policy)} {}
   };
 }
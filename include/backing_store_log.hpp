@@ -0,0 +1,158 @@
+#pragma once
+#include "backing_store.hpp"
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace c3::kademlia {
+  /// A backing store that survives restarts
+  ///
+  /// Values are appended to segment files in a directory, and an open addressing index of fixed
+  /// size slots lives in its own file, which we mmap. A clean shutdown marks the index as such, so
+  /// the next start only has to map it, rather than reading every segment back. Segments that are
+  /// mostly dead are copied forward and deleted by a background thread. Values that are streamed
+  /// in get a segment each, so that they go straight to disk.
+  class backing_store::log : public backing_store {
+  public:
+    using clock = std::chrono::system_clock;
+
+    struct options {
+      size_t max_size = size_t{1} << 30;
+      size_t max_keys = size_t{1} << 20;
+      /// The active segment is sealed once it grows past this
+      size_t segment_size = 64 * 1024 * 1024;
+      /// A sealed segment is compacted once this fraction of it is dead
+      double compact_ratio = 0.5;
+      std::chrono::seconds compact_interval{60};
+      /// How long a value is kept for once stored
+      age_t lifetime = tExpire;
+    };
+
+  private:
+    // Everything on disk is in host byte order; these files are not meant to move between machines
+    struct record_header {
+      uint32_t magic;
+      uint32_t size;
+      int64_t birth;
+      int64_t expiry;
+      nid_t nid;
+    };
+
+    struct index_header {
+      uint64_t magic;
+      uint32_t version;
+      uint32_t clean;
+      uint64_t capacity;
+      uint64_t count;
+      uint64_t occupied;
+      uint8_t padding[24];
+    };
+
+    struct index_slot {
+      nid_t nid;
+      int64_t birth;
+      int64_t expiry;
+      uint64_t offset;
+      uint32_t size;
+      // 0 for an empty slot, and tombstone_segment for a removed one
+      uint32_t segment;
+    };
+
+    static_assert(sizeof(index_header) == 64);
+    static_assert(sizeof(index_slot) == 64);
+
+    struct segment {
+      int fd = -1;
+      uint64_t size = 0;
+      uint64_t live = 0;
+    };
+
+    struct mapping {
+      int fd = -1;
+      size_t length = 0;
+      index_header* header = nullptr;
+      index_slot* slots = nullptr;
+    };
+
+    /// Streams a value into a segment of its own, and only writes the header once it's all there
+    ///
+    /// Until then the segment starts with zeros, which a rebuild after a crash reads as the end of
+    /// the segment, and throws away.
+    class segment_writer;
+
+  private:
+    static constexpr uint32_t record_magic = 0x564b3363;
+    static constexpr uint64_t index_magic = 0x7865646e49564b33;
+    static constexpr uint32_t index_version = 1;
+    static constexpr uint32_t tombstone_segment = UINT32_MAX;
+    static constexpr size_t initial_capacity = 1024;
+
+  private:
+    std::string dir;
+    options opts;
+
+    //
+    std::shared_mutex index_mutex;
+    mapping index;
+    std::map<uint32_t, segment> segments;
+    uint32_t active = 0;
+    size_t bytes_used = 0;
+    // Bumped whenever the index is rebuilt, so that a scan can tell its position no longer means anything
+    uint64_t index_generation = 0;
+    //
+
+    //
+    std::mutex compact_mutex;
+    std::condition_variable compact_condvar;
+    bool compact_looping = true;
+    bool compact_wanted = false;
+    //
+
+    std::optional<expiry_wheel> expiry;
+    std::thread compact_thread;
+
+  private:
+    std::string segment_path(uint32_t id) const;
+    std::string index_path() const;
+
+    static mapping map_index(const std::string& path, size_t capacity, bool create);
+    static void unmap_index(mapping& m);
+    static index_slot* find_slot(const mapping& m, const nid_t& nid);
+    static index_slot* insert_slot(mapping& m, const nid_t& nid);
+    /// Must hold index_mutex
+    std::optional<value_t> read_value(const index_slot& slot);
+
+    void open_segments();
+    void rebuild_index();
+    void grow_index();
+    uint32_t open_segment(uint32_t id);
+    bool should_compact(const segment& seg) const;
+    std::pair<uint32_t, uint64_t> append(const record_header& h, span<const uint8_t> data);
+    void compact(uint32_t id);
+    void compact_body();
+    void expire(std::vector<nid_t>& nids);
+    /// nid must be the hash of s
+    bool insert(const nid_t& nid, span<const uint8_t> s, age_t age) noexcept;
+
+  public:
+    // We write straight to disk, so there's nothing to gain from holding on to a buffer
+    inline bool store(buffer b, age_t age) noexcept override final { return store(b.get(), age); }
+    bool store(span<const uint8_t>, age_t age) noexcept override final;
+    std::unique_ptr<writer> begin_store(size_t size, age_t age) noexcept override final;
+    std::vector<bool> store_batch(std::vector<value_t> values) noexcept override final;
+    std::optional<value_t> retrieve(nid_t) noexcept override final;
+    std::optional<size_t> size_of(nid_t nid) noexcept override final;
+    std::optional<buffer> read(nid_t nid, size_t offset, size_t length) noexcept override final;
+    std::vector<nid_t> get_all_keys() noexcept override final;
+    scan_t scan(cursor_t from, size_t max_items) noexcept override final;
+    stats_t get_stats() noexcept override final;
+
+  public:
+    log(std::string dir, options opts);
+    inline log(std::string dir) : log(std::move(dir), options{}) {}
+    ~log();
+  };
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include "backing_store.hpp"
+#include "epoch.hpp"
+
+#include <memory>
+#include <mutex>
+
+namespace c3::kademlia {
+  /// A backing store that spreads keys over independently locked shards
+  ///
+  /// Nids are SHA-256 outputs, so their leading bits pick a shard and the next 64 bits are as good
+  /// a hash as any. Each shard is an open addressing table of pointers to immutable entries.
+  /// Writers take the shard's mutex, but readers only enter an epoch, so a retrieve never waits
+  /// on a store.
+  class backing_store::sharded : public backing_store {
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct entry {
+      nid_t nid;
+      clock::time_point birth;
+      buffer data;
+    };
+
+    struct table {
+      size_t mask;
+      // Bumped on every resize, so that a scan can tell its position no longer means anything
+      uint64_t generation;
+      std::unique_ptr<std::atomic<const entry*>[]> slots;
+
+      inline table(size_t capacity, uint64_t generation) :
+        mask{capacity - 1},
+        generation{generation},
+        slots{std::make_unique<std::atomic<const entry*>[]>(capacity)} {}
+    };
+
+    struct alignas(64) shard {
+      std::mutex write_mutex;
+      std::atomic<table*> current = nullptr;
+      // Live entries and tombstones, as both lengthen probes. Only touched under write_mutex
+      size_t occupied = 0;
+
+      std::atomic<size_t> keys = 0;
+      std::atomic<size_t> bytes = 0;
+
+      shard();
+      ~shard();
+    };
+
+  private:
+    static constexpr size_t initial_capacity = 16;
+    static constexpr size_t reclaim_threshold = 64;
+    // Marks a slot that used to hold something. Only its address matters
+    static const entry tombstone;
+
+  private:
+    size_t max_size;
+    size_t max_keys;
+
+    size_t shard_bits;
+    std::unique_ptr<shard[]> shards;
+
+    // Reserved up front, so concurrent stores on different shards can't overshoot the limits
+    std::atomic<size_t> keys_reserved = 0;
+    std::atomic<size_t> bytes_reserved = 0;
+
+    epoch_domain epoch;
+
+    // Must come after the shards, so that it stops before they are destroyed
+    expiry_wheel expiry{[this](auto& nids) { expire(nids); }};
+
+  private:
+    shard& shard_of(const nid_t& nid) const;
+    static size_t hash_of(const nid_t& nid);
+    static const entry* find(const table& t, const nid_t& nid);
+    bool reserve(size_t size);
+    void release(size_t size);
+    void resize(shard& s);
+    void expire(std::vector<nid_t>& nids);
+    /// nid must be the hash of b
+    bool insert(const nid_t& nid, buffer b, age_t age) noexcept;
+
+  public:
+    using backing_store::store;
+
+    bool store(buffer, age_t age) noexcept override final;
+    std::vector<bool> store_batch(std::vector<value_t> values) noexcept override final;
+    std::unique_ptr<writer> begin_store(size_t size, age_t age) noexcept override final;
+    std::optional<value_t> retrieve(nid_t) noexcept override final;
+    std::vector<nid_t> get_all_keys() noexcept override final;
+    scan_t scan(cursor_t from, size_t max_items) noexcept override final;
+    stats_t get_stats() noexcept override final;
+
+  public:
+    /// shard_bits of 6 gives 64 shards, which is plenty for any sensible number of cores
+    sharded(size_t max_size = 16 * 1024 * 1024, size_t max_keys = 1024, size_t shard_bits = 6);
+  };
+}
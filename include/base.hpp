@@ -5,6 +5,11 @@
 #include <tuple>
 #include <gsl/span>
 #include <chrono>
+#include <memory>
+#include <vector>
+
+// OpenSSL's EVP_MD_CTX, which nid_hasher keeps out of this header
+struct evp_md_ctx_st;
 
 namespace c3::kademlia {
   // Seconds
@@ -24,6 +29,10 @@ namespace c3::kademlia {
   constexpr age_t tRepublish{86400};
   // ================[ CONSTANTS ]================
 
+  /// Values bigger than this go over the streaming RPCs, in pieces of chunk_size
+  constexpr size_t stream_threshold = 1024 * 1024;
+  constexpr size_t chunk_size = 256 * 1024;
+
   using nid_t = std::array<uint8_t, B / 8>;
   struct contact {
     nid_t nid;
@@ -52,14 +61,74 @@ namespace c3::kademlia {
   }
 
   nid_t compute_nid(span<const uint8_t> data);
+  /// Hashes a whole batch at once, spreading large batches over a few worker threads
+  std::vector<nid_t> compute_nids(span<const span<const uint8_t>> data);
+
+  /// Works a nid out a piece at a time, for values we never hold all at once
+  class nid_hasher {
+  private:
+    std::unique_ptr<::evp_md_ctx_st, void(*)(::evp_md_ctx_st*)> ctx;
+
+  public:
+    void update(span<const uint8_t> data);
+    /// Gives the same as compute_nid of everything passed to update. Only call this once
+    nid_t finish();
+
+  public:
+    nid_hasher();
+  };
 
   class timed_out : public std::runtime_error {
   public:
     inline timed_out() : std::runtime_error("An RPC timed out") {};
   };
 
+  /// They turned the RPC away without looking at it, as they had too much to do already
+  class overloaded : public std::runtime_error {
+  public:
+    inline overloaded() : std::runtime_error("Remote node is overloaded") {};
+  };
+
+  /// Whoever sent the RPC stopped wanting its answer before it came
+  class cancelled : public std::runtime_error {
+  public:
+    inline cancelled() : std::runtime_error("RPC was cancelled") {};
+  };
+
+  /// The index of the bucket that b falls into from a; that is, the highest set bit of a ^ b
   size_t distance(nid_t a, nid_t b);
 
+  /// The XOR distance as native words, most significant first
+  ///
+  /// This orders the same way as xor_distance, but compares four words at a time rather than
+  /// 32 bytes, so it is what to sort by when ranking lots of contacts.
+  using distance_key = std::array<uint64_t, 4>;
+
+  /// Fills out with the distance of each nid from target, using the widest vector unit the CPU has
+  void distance_keys(const nid_t& target, span<const nid_t> nids, distance_key* out);
+  /// The same a byte at a time, which is what distance_keys falls back to without a vector unit
+  void distance_keys_scalar(const nid_t& target, span<const nid_t> nids, distance_key* out);
+  /// Which of "avx2", "ssse3" or "scalar" distance_keys uses on this CPU
+  const char* distance_keys_kernel();
+
+  /// The full XOR metric. nid_t compares lexicographically, so smaller results are closer
+  inline nid_t xor_distance(const nid_t& a, const nid_t& b) {
+    nid_t ret;
+    for (size_t i = 0; i < ret.size(); ++i)
+      ret[i] = a[i] ^ b[i];
+    return ret;
+  }
+
+  /// Nids are already uniformly distributed, so any 8 bytes make a good hash
+  struct nid_hash {
+    inline size_t operator()(const nid_t& nid) const noexcept {
+      size_t ret = 0;
+      for (size_t i = 0; i < sizeof(ret); ++i)
+        ret = (ret << 8) | nid[nid.size() - 1 - i];
+      return ret;
+    }
+  };
+
   nid_t generate_nid();
 
   std::string nid_to_string(nid_t nid);
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "remote.hpp"
+
+#include <atomic>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace c3::kademlia {
+  /// Coalesces calls to the same peer into the batch RPCs
+  ///
+  /// A peer with nothing of that kind in flight is sent a request straight away, so a lone call
+  /// waits no longer than it would have. Whatever comes in for them while that is out goes in one
+  /// call as soon as it returns, so the busier a peer is, the bigger their batches get.
+  ///
+  /// Finds can be called off. Those still waiting are dropped before they're sent, but a call
+  /// that has gone out is only cancelled once nobody sharing it wants it. They can also be told
+  /// when their call goes out, so that whoever is timing them can leave out the wait for it.
+  ///
+  /// Stores too big to batch are streamed on a thread of their own, so they don't hold up their
+  /// caller either, and any still going are waited for when we are destroyed.
+  class remote_node::batcher {
+  public:
+    static constexpr size_t max_batch = 64;
+    /// The most data one batch of stores carries. Anything bigger goes over store_stream alone
+    static constexpr size_t max_batch_bytes = stream_threshold;
+
+    struct stats_t {
+      size_t calls = 0;
+      size_t requests = 0;
+    };
+
+  private:
+    struct store_item_t {
+      proto::StoreRequest req;
+      callback_t<bool> cb;
+    };
+    struct find_node_item_t {
+      nid_t nid;
+      callback_t<std::vector<contact>> cb;
+      std::shared_ptr<cancellation> cancel;
+      std::function<void()> sent;
+    };
+    struct find_value_item_t {
+      nid_t nid;
+      callback_t<value_result_t> cb;
+      std::shared_ptr<cancellation> cancel;
+      std::function<void()> sent;
+    };
+
+    template<typename Item>
+    struct lane_t {
+      std::vector<Item> waiting;
+      bool in_flight = false;
+    };
+
+    struct peer_t {
+      // What we send each batch through
+      remote_node via;
+      lane_t<store_item_t> stores;
+      lane_t<find_node_item_t> node_finds;
+      lane_t<find_value_item_t> value_finds;
+
+      inline bool idle() const {
+        return !stores.in_flight && !node_finds.in_flight && !value_finds.in_flight;
+      }
+    };
+
+    // Each call is checked against one nid, so someone new at an old location is someone else
+    using key_t = std::pair<std::string, nid_t>;
+
+    template<typename Item>
+    using lane_ptr_t = lane_t<Item> peer_t::*;
+
+  private:
+    rpc_engine& engine;
+
+    //
+    std::mutex peers_mutex;
+    // Only those with something in flight
+    std::map<key_t, peer_t> peers;
+    //
+
+    std::atomic<size_t> calls = 0;
+    std::atomic<size_t> requests = 0;
+
+    //
+    std::mutex streams_mutex;
+    // Last, so that anything still streaming is done before the rest of us goes
+    std::vector<std::future<void>> streams;
+    //
+
+  private:
+    /// Must hold peers_mutex
+    static std::vector<store_item_t> take(lane_t<store_item_t>& lane);
+    /// Must hold peers_mutex
+    template<typename Item>
+    static std::vector<Item> take(lane_t<Item>& lane);
+
+    template<typename Item>
+    void enqueue(const remote_node& peer, lane_ptr_t<Item> lane, Item item);
+    /// Called once a batch is done with, to send whatever has queued up behind it
+    template<typename Item>
+    void next(const key_t& key, lane_ptr_t<Item> lane);
+
+    void send(const key_t& key, remote_node& via, std::vector<store_item_t> batch);
+    void send(const key_t& key, remote_node& via, std::vector<find_node_item_t> batch);
+    void send(const key_t& key, remote_node& via, std::vector<find_value_item_t> batch);
+
+  public:
+    /// data has to stay alive until cb has been called
+    void store(const remote_node& peer, span<const uint8_t> data, age_t age, callback_t<bool> cb);
+    /// Asks them to keep a copy of data for ttl, which only goes for values that fit in a batch
+    void cache(const remote_node& peer, span<const uint8_t> data, std::chrono::seconds ttl, callback_t<bool> cb);
+    /// sent is called just before the call carrying the request goes out
+    void find_node(const remote_node& peer, nid_t nid, callback_t<std::vector<contact>> cb,
+                   std::shared_ptr<cancellation> cancel = nullptr, std::function<void()> sent = {});
+    void find_value(const remote_node& peer, nid_t nid, callback_t<value_result_t> cb,
+                    std::shared_ptr<cancellation> cancel = nullptr, std::function<void()> sent = {});
+
+    stats_t get_stats() const;
+
+  public:
+    /// engine has to be destroyed before we are, as what we send through it calls back into us
+    batcher(rpc_engine& engine);
+  };
+}
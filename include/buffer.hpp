@@ -0,0 +1,62 @@
+#pragma once
+
+#include "base.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace c3::kademlia {
+  /// An immutable, reference counted slice of bytes
+  ///
+  /// Copying one only touches the reference count, so values can be handed out of a backing store
+  /// and on to the network without the bytes themselves moving.
+  class buffer {
+  public:
+    // So that gsl::span will take us like any other container
+    using value_type = const uint8_t;
+    using pointer = const uint8_t*;
+    using const_pointer = const uint8_t*;
+    using iterator = const uint8_t*;
+    using const_iterator = const uint8_t*;
+
+  private:
+    std::shared_ptr<const void> owner;
+    const uint8_t* ptr = nullptr;
+    size_t len = 0;
+
+  public:
+    inline const uint8_t* data() const noexcept { return ptr; }
+    inline size_t size() const noexcept { return len; }
+    inline bool empty() const noexcept { return len == 0; }
+    inline const uint8_t* begin() const noexcept { return ptr; }
+    inline const uint8_t* end() const noexcept { return ptr + len; }
+    inline span<const uint8_t> get() const noexcept { return {ptr, fix_gsl_bs(len)}; }
+
+    /// Shares our storage, so this keeps all of it alive, not just the slice
+    inline buffer slice(size_t offset, size_t length) const {
+      if (offset > len || length > len - offset)
+        throw std::out_of_range("Slice out of buffer");
+      return {owner, ptr + offset, length};
+    }
+
+  public:
+    static inline buffer copy(span<const uint8_t> s) {
+      return adopt(std::vector<uint8_t>{s.begin(), s.end()});
+    }
+    static inline buffer adopt(std::vector<uint8_t>&& v) {
+      auto owner = std::make_shared<const std::vector<uint8_t>>(std::move(v));
+      return {owner, owner->data(), owner->size()};
+    }
+    /// Protobuf hands over bytes fields as strings, so this lets us keep them without a copy
+    static inline buffer adopt(std::unique_ptr<std::string> s) {
+      std::shared_ptr<const std::string> owner = std::move(s);
+      return {owner, reinterpret_cast<const uint8_t*>(owner->data()), owner->size()};
+    }
+
+  public:
+    buffer() = default;
+    inline buffer(std::shared_ptr<const void> owner, const uint8_t* ptr, size_t len) :
+      owner{std::move(owner)}, ptr{ptr}, len{len} {}
+  };
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace c3::kademlia {
+  /// Lets whoever sent some requests call off any of them that are still going
+  ///
+  /// Whatever can withdraw a request says how with on_cancel. Each hook runs once, on the thread that
+  /// calls cancel, or straight away if that has already happened.
+  class cancellation {
+  private:
+    //
+    mutable std::mutex cancel_mutex;
+    bool done = false;
+    std::vector<std::function<void()>> hooks;
+    //
+
+  public:
+    inline void on_cancel(std::function<void()> hook) {
+      {
+        std::unique_lock lock{cancel_mutex};
+        if (!done) {
+          hooks.push_back(std::move(hook));
+          return;
+        }
+      }
+      hook();
+    }
+    inline void cancel() {
+      std::vector<std::function<void()>> run;
+      {
+        std::unique_lock lock{cancel_mutex};
+        if (done)
+          return;
+        done = true;
+        run.swap(hooks);
+      }
+      for (auto& i : run)
+        i();
+    }
+    inline bool cancelled() const {
+      std::unique_lock lock{cancel_mutex};
+      return done;
+    }
+  };
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "base.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
+
+#include "format.grpc.pb.h"
+
+namespace c3::kademlia {
+  /// Keeps a channel open to each location we talk to, so that RPCs share one HTTP/2 connection
+  ///
+  /// It also remembers when each location last answered anything, so that a peer we heard from a
+  /// moment ago doesn't have to be pinged before we use it. Channels nobody has used for a while,
+  /// or the least recently used ones once there are too many, are closed.
+  class channel_pool {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    struct entry_t {
+      std::shared_ptr<grpc::Channel> channel;
+      std::shared_ptr<proto::Kademlia::Stub> stub;
+    };
+
+    struct stats_t {
+      size_t open = 0;
+      size_t hits = 0;
+      size_t misses = 0;
+      size_t evictions = 0;
+    };
+
+  private:
+    struct slot_t {
+      entry_t entry;
+      clock::time_point last_used;
+      // Default constructed until the first success
+      clock::time_point last_success;
+      std::list<std::string>::iterator lru_pos;
+    };
+
+  private:
+    size_t max_channels;
+    clock::duration idle_timeout;
+    clock::duration liveness_window;
+
+    //
+    mutable std::mutex channels_mutex;
+    std::unordered_map<std::string, slot_t> channels;
+    // Most recently used first
+    std::list<std::string> lru;
+    //
+
+    std::atomic<size_t> hits = 0;
+    std::atomic<size_t> misses = 0;
+    std::atomic<size_t> evictions = 0;
+
+  private:
+    /// Must hold channels_mutex
+    void evict(clock::time_point now);
+
+  public:
+    /// Hands out the channel for location, opening one if need be
+    entry_t get(const std::string& location);
+    void succeeded(const std::string& location);
+    /// Forgets that location was alive, but keeps the channel, as gRPC reconnects by itself
+    void failed(const std::string& location);
+    /// Whether location has answered anything recently enough to skip checking
+    bool alive(const std::string& location) const;
+
+    stats_t get_stats() const;
+
+  public:
+    channel_pool(size_t max_channels = 256,
+                 clock::duration idle_timeout = std::chrono::minutes(5),
+                 clock::duration liveness_window = std::chrono::seconds(30));
+  };
+}
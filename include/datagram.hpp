@@ -0,0 +1,208 @@
+#pragma once
+
+#include "base.hpp"
+#include "buffer.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace c3::kademlia {
+  /// Just enough of a UDP socket for datagram_transport, which is all of it that differs between
+  /// platforms
+  class udp_socket {
+  public:
+    struct address_t {
+      std::array<uint8_t, 128> storage = {};
+      uint32_t length = 0;
+
+      inline bool operator==(const address_t& other) const {
+        return length == other.length && std::equal(storage.begin(), storage.begin() + length, other.storage.begin());
+      }
+    };
+
+  private:
+    intptr_t fd = -1;
+
+  public:
+    /// Takes anything we'd give gRPC: host:port, ipv4:host:port or ipv6:[host]:port
+    static address_t resolve(std::string_view location);
+    /// In the same form as gRPC's peer strings
+    static std::string describe(const address_t& addr);
+
+    void send(const address_t& to, span<const uint8_t> data);
+    /// Waits up to timeout for a datagram, and returns how much of buf it filled, if one came
+    std::optional<size_t> receive(span<uint8_t> buf, address_t& from, std::chrono::milliseconds timeout);
+
+  public:
+    /// Binds to host:port, where host is as in location
+    udp_socket(std::string_view host, uint16_t port);
+    ~udp_socket();
+
+    udp_socket(const udp_socket&) = delete;
+    udp_socket& operator=(const udp_socket&) = delete;
+  };
+
+  /// Ping, find_node and small find_value over UDP, for lookups that don't want to set up a
+  /// connection for every peer they ask
+  ///
+  /// It listens on the same port number as the node's gRPC server, so contacts need no second
+  /// address. Each message has a fixed binary layout, big endian:
+  ///
+  ///     magic "KD" | version | kind | request id (4) | cookie (8) | sender nid (32) |
+  ///     sender port (2) | body
+  ///
+  /// where the body is a target nid for find_node and find_value, a count then (nid, length,
+  /// location) for each contact in a reply, the value itself, or the size of one too big to send.
+  /// Replies are matched to requests by a random id and source address. A request is sent again if
+  /// there's no reply in a third of its timeout, and fails with timed_out after the third go.
+  ///
+  /// Anyone can put any address on a UDP packet, so a request only counts as verified once it
+  /// carries the cookie we last gave its source address, which only whoever can hear us there
+  /// could know. Until then, nobody is told more than a pong or a retry, neither bigger than what
+  /// they sent, so we can't be used to flood someone else, and the handler is told not to trust
+  /// who they say they are. Every reply carries the cookie for whoever it goes to, and a retry is
+  /// answered by sending the request again with it.
+  ///
+  /// Anything too big for one datagram is for gRPC, so bulk transfer stays there.
+  class datagram_transport {
+  public:
+    enum class kind_t : uint8_t {
+      ping = 1,
+      find_node = 2,
+      find_value = 3,
+      pong = 4,
+      nodes = 5,
+      value = 6,
+      /// They have it, but it has to be fetched over gRPC
+      large_value = 7,
+      /// Ask again with the cookie on this, as they don't know we're really where we say
+      retry = 8
+    };
+
+    struct message_t {
+      kind_t kind = kind_t::ping;
+      uint32_t id = 0;
+      nid_t sender = {};
+      uint16_t port = 0;
+      nid_t target = {};
+      std::vector<contact> contacts;
+      buffer value;
+      uint64_t size = 0;
+      /// On a request, what its destination last gave us; on a reply, what to send them next time
+      uint64_t cookie = 0;
+      /// Where it came from, as in udp_socket::describe. Not sent
+      std::string from;
+      /// For a request, whether its cookie shows it came from where it says. Not sent
+      bool verified = false;
+    };
+
+    /// Fills reply in for a request, and returns false if there should be none
+    using handler_t = std::function<bool(const message_t& req, message_t& reply)>;
+    using callback_t = std::function<void(std::exception_ptr, message_t)>;
+
+    struct stats_t {
+      size_t requests = 0;
+      size_t retransmits = 0;
+      size_t timeouts = 0;
+      size_t served = 0;
+      /// Requests we sent back for a cookie
+      size_t retries = 0;
+    };
+
+    /// Keeps us clear of fragmentation on anything with the minimum IPv6 MTU
+    static constexpr size_t max_datagram = 1200;
+    static constexpr size_t header_size = 50;
+    static constexpr size_t attempts = 3;
+    /// How long a cookie we hand out stays good for, give or take one more lifetime
+    static constexpr std::chrono::minutes cookie_lifetime{2};
+
+  private:
+    struct pending_t {
+      udp_socket::address_t to;
+      std::vector<uint8_t> packet;
+      std::chrono::steady_clock::time_point next_send;
+      std::chrono::milliseconds interval;
+      size_t sends = 1;
+      std::string location;
+      bool retried = false;
+      callback_t cb;
+    };
+
+  private:
+    udp_socket socket;
+    nid_t our_nid;
+    uint16_t our_port;
+    handler_t handler;
+    // How long someone who never answers is left alone before we try them again
+    std::chrono::steady_clock::duration unreachable_for;
+
+    //
+    std::mutex pending_mutex;
+    std::unordered_map<uint32_t, pending_t> pending;
+    std::mt19937 id_rng;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> unreachable;
+    // What each location we've asked wants sent back
+    std::unordered_map<std::string, uint64_t> cookies;
+    //
+
+    // Only the receive thread makes and checks cookies, so these need no lock. The last secret
+    // still counts, so that a cookie handed out just before we change them isn't wasted
+    nid_t secret;
+    nid_t old_secret;
+    std::chrono::steady_clock::time_point secret_changed;
+
+    std::atomic<size_t> requests = 0;
+    std::atomic<size_t> retransmits = 0;
+    std::atomic<size_t> timeouts = 0;
+    std::atomic<size_t> served = 0;
+    std::atomic<size_t> retries = 0;
+
+    std::atomic<bool> die = false;
+    std::thread receive_thread;
+
+  private:
+    void receive_body();
+    /// Answers a request of request_size bytes
+    void serve(message_t& req, const udp_socket::address_t& from, size_t request_size);
+    /// Hands a reply to whoever is waiting on it, if it came from who they asked
+    void take_reply(message_t reply, const udp_socket::address_t& from);
+    uint64_t make_cookie(const nid_t& key, const udp_socket::address_t& addr) const;
+    /// Resends anything that is due, and fails whatever has had all its goes
+    std::chrono::milliseconds tick();
+
+  public:
+    static std::vector<uint8_t> encode(const message_t& msg);
+    /// Throws std::invalid_argument on anything malformed
+    static message_t decode(span<const uint8_t> packet);
+
+    /// Sends a ping, find_node or find_value. cb is called once, on our thread, with the reply or
+    /// with why there isn't one, and must not block for long
+    void request(const std::string& location, message_t msg, std::chrono::milliseconds timeout, callback_t cb);
+    /// Waits for the reply
+    message_t request(const std::string& location, message_t msg, std::chrono::milliseconds timeout);
+
+    /// Whether we should bother trying location at all, as opposed to going straight to gRPC
+    bool reachable(const std::string& location);
+    void mark_unreachable(const std::string& location);
+
+    stats_t get_stats() const;
+
+  public:
+    /// host is that of the address the node's gRPC server listens on
+    datagram_transport(std::string_view host, uint16_t port, nid_t our_nid, handler_t handler,
+                       std::chrono::steady_clock::duration unreachable_for = std::chrono::minutes(5));
+    ~datagram_transport();
+  };
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace c3::kademlia {
+  /// Epoch based reclamation, so that readers can walk shared structures without taking a lock
+  ///
+  /// Readers register in a counter for the current epoch's parity. Writers unlink things, hand
+  /// them to retire(), and reclaim() flips the epoch and waits for the old parity to drain before
+  /// freeing them. Counters are striped over cache lines so that readers on different cores don't
+  /// fight over one.
+  class epoch_domain {
+  private:
+    static constexpr size_t stripe_count = 64;
+
+    struct alignas(64) stripe {
+      std::array<std::atomic<size_t>, 2> readers = {0, 0};
+    };
+
+    struct retired_t {
+      void* ptr;
+      void (*deleter)(void*);
+    };
+
+  private:
+    std::array<stripe, stripe_count> stripes;
+    std::atomic<uint64_t> current = 0;
+
+    //
+    std::mutex retired_mutex;
+    std::vector<retired_t> retired;
+    //
+    std::atomic<size_t> retired_count = 0;
+
+    std::mutex synchronize_mutex;
+
+  private:
+    static size_t this_stripe();
+    void synchronize();
+
+  public:
+    class guard {
+    private:
+      std::atomic<size_t>* counter;
+
+    public:
+      inline guard(const guard&) = delete;
+      inline guard& operator=(const guard&) = delete;
+
+      inline guard(std::atomic<size_t>* counter) : counter{counter} {}
+      inline ~guard() { counter->fetch_sub(1, std::memory_order_release); }
+    };
+
+  public:
+    /// Anything that has not been retired when this returns stays alive until the guard dies
+    [[nodiscard]] guard read();
+
+    template<typename T>
+    inline void retire(const T* ptr) {
+      retire_raw(const_cast<T*>(ptr), [](void* p) { delete static_cast<T*>(p); });
+    }
+    void retire_raw(void* ptr, void (*deleter)(void*));
+    /// Frees everything retired before the call, once no reader can still see it
+    void reclaim();
+    inline size_t backlog() const noexcept { return retired_count; }
+
+  public:
+    epoch_domain() = default;
+    /// Nothing may be reading when we die, so this frees the backlog immediately
+    ~epoch_domain();
+  };
+}
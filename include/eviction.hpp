@@ -0,0 +1,150 @@
+#pragma once
+
+#include "base.hpp"
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+namespace c3::kademlia {
+  /// Decides what a full backing store should give up to make room
+  ///
+  /// The store tells us about everything that comes and goes, and when it runs out of space asks
+  /// for a victim. A policy may also decide that the incoming value is worth less than anything we
+  /// hold, in which case the store turns it away as it used to.
+  class eviction_policy {
+  public:
+    struct stats_t {
+      size_t hits = 0;
+      size_t misses = 0;
+      size_t evictions = 0;
+      size_t rejections = 0;
+    };
+
+  private:
+    std::atomic<size_t> hits = 0;
+    std::atomic<size_t> misses = 0;
+    std::atomic<size_t> evictions = 0;
+    std::atomic<size_t> rejections = 0;
+
+  protected:
+    // These may be called concurrently, so implementations must do their own locking
+    virtual void on_insert(const nid_t&) = 0;
+    virtual void on_remove(const nid_t&) = 0;
+    virtual void on_hit(const nid_t&) = 0;
+    virtual void on_miss(const nid_t&) {}
+    virtual std::optional<nid_t> pick_victim(const nid_t& incoming) = 0;
+
+  public:
+    inline void inserted(const nid_t& nid) { on_insert(nid); }
+    inline void removed(const nid_t& nid) { on_remove(nid); }
+    inline void hit(const nid_t& nid) { ++hits; on_hit(nid); }
+    inline void miss(const nid_t& nid) { ++misses; on_miss(nid); }
+    /// Gives the key to drop to make room for incoming, or nothing if incoming should be rejected
+    inline std::optional<nid_t> evict_for(const nid_t& incoming) {
+      auto ret = pick_victim(incoming);
+      ++(ret ? evictions : rejections);
+      return ret;
+    }
+
+    inline stats_t get_stats() const noexcept {
+      return { hits, misses, evictions, rejections };
+    }
+
+  public:
+    virtual ~eviction_policy() = default;
+
+  public:
+    class lru;
+    class tiny_lfu;
+    class furthest;
+  };
+
+  /// Evicts whatever was least recently stored or retrieved
+  class eviction_policy::lru : public eviction_policy {
+  private:
+    std::mutex order_mutex;
+    std::list<nid_t> order;
+    std::unordered_map<nid_t, std::list<nid_t>::iterator, nid_hash> positions;
+
+  protected:
+    void on_insert(const nid_t&) override;
+    void on_remove(const nid_t&) override;
+    void on_hit(const nid_t&) override;
+    std::optional<nid_t> pick_victim(const nid_t& incoming) override;
+  };
+
+  /// Segmented LRU behind a TinyLFU admission filter
+  ///
+  /// Access frequencies (including misses and turned away stores) are kept approximately in a
+  /// count-min sketch of 4 bit counters, which halves itself every so often so that old
+  /// popularity fades. New keys go into a probationary segment and are promoted to a protected one
+  /// when hit again. A new key only displaces the coldest probationary key if it has been asked
+  /// for more often, so a scan of one-off keys can't flush the hot set.
+  class eviction_policy::tiny_lfu : public eviction_policy {
+  private:
+    static constexpr size_t sketch_depth = 4;
+    static constexpr uint8_t counter_max = 15;
+
+    enum class segment_t { probation, protect };
+
+    struct position_t {
+      segment_t segment;
+      std::list<nid_t>::iterator iter;
+    };
+
+  private:
+    std::mutex policy_mutex;
+
+    std::vector<uint8_t> sketch;
+    size_t sketch_mask;
+    size_t additions = 0;
+    size_t sample_size;
+
+    std::list<nid_t> probation;
+    std::list<nid_t> protect;
+    std::unordered_map<nid_t, position_t, nid_hash> positions;
+
+  private:
+    size_t sketch_index(const nid_t& nid, size_t row) const;
+    uint8_t frequency(const nid_t& nid) const;
+    void record(const nid_t& nid);
+
+  protected:
+    void on_insert(const nid_t&) override;
+    void on_remove(const nid_t&) override;
+    void on_hit(const nid_t&) override;
+    void on_miss(const nid_t&) override;
+    std::optional<nid_t> pick_victim(const nid_t& incoming) override;
+
+  public:
+    /// expected_keys sizes the sketch; it should be about the number of keys the store can hold
+    tiny_lfu(size_t expected_keys = 1024);
+  };
+
+  /// Evicts whatever is furthest from us in XOR distance
+  ///
+  /// Those are the keys that we are least likely to be responsible for, and that other nodes are
+  /// most likely to hold as well. A key further than anything we hold is turned away.
+  class eviction_policy::furthest : public eviction_policy {
+  private:
+    nid_t our_nid;
+
+    std::mutex distances_mutex;
+    // Kept as distances rather than nids, so the set orders itself for us
+    std::set<nid_t> distances;
+
+  protected:
+    void on_insert(const nid_t&) override;
+    void on_remove(const nid_t&) override;
+    void on_hit(const nid_t&) override;
+    std::optional<nid_t> pick_victim(const nid_t& incoming) override;
+
+  public:
+    inline furthest(nid_t our_nid) : our_nid{our_nid} {}
+  };
+}
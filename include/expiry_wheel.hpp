@@ -0,0 +1,75 @@
+#pragma once
+
+#include "base.hpp"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace c3::kademlia {
+  /// A hierarchical timer wheel that expires nids from a single thread
+  ///
+  /// Each level has 64 slots, and each slot of level n covers 64^n ticks of one second. An entry
+  /// lives in the lowest level whose slots can still tell it apart from the current tick, and is
+  /// cascaded downwards as that level rolls over. Everything that lands in the current level 0
+  /// slot is handed to the callback in one batch.
+  class expiry_wheel {
+  public:
+    using callback_t = std::function<void(std::vector<nid_t>&)>;
+    using clock = std::chrono::steady_clock;
+    /// Where the wheel gets the time from, which is only ever not clock::now in tests
+    using time_source_t = std::function<clock::time_point()>;
+
+  private:
+    static constexpr size_t slot_bits = 6;
+    static constexpr size_t slot_count = size_t{1} << slot_bits;
+    // 64^5 seconds is a bit over 34 years, so nothing sensible will fall off the top
+    static constexpr size_t level_count = 5;
+
+    struct entry {
+      nid_t nid;
+      uint64_t deadline;
+    };
+
+  private:
+    callback_t on_expire;
+    time_source_t now;
+    clock::time_point epoch;
+
+    //
+    std::mutex wheel_mutex;
+    std::condition_variable wheel_condvar;
+    std::array<std::array<std::vector<entry>, slot_count>, level_count> wheel;
+    uint64_t current_tick = 0;
+    bool die = false;
+    //
+
+    std::atomic<size_t> pending_count = 0;
+
+    std::thread tick_thread;
+
+  private:
+    uint64_t tick_of(clock::time_point t) const;
+    void place(entry e, std::vector<nid_t>& due);
+    void advance(uint64_t to, std::vector<nid_t>& due);
+    void tick_body();
+
+  public:
+    /// Arranges for on_expire to be given nid once ttl has passed
+    void schedule(nid_t nid, clock::duration ttl);
+    /// The number of nids that have been scheduled, but not yet handed to the callback
+    inline size_t pending() const noexcept { return pending_count; }
+    /// Hands the callback everything due by now. Only for a wheel without a thread of its own
+    void poll();
+
+  public:
+    expiry_wheel(callback_t on_expire);
+    /// Has no thread, so nothing expires but through poll
+    expiry_wheel(callback_t on_expire, time_source_t now);
+    ~expiry_wheel();
+  };
+}
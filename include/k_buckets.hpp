@@ -2,43 +2,179 @@
 
 #include "base.hpp"
 #include "remote.hpp"
+#include "epoch.hpp"
+#include "latency.hpp"
 
-#include <shared_mutex>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
-#include <list>
 #include <functional>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 
 #include "node.hpp"
 
 namespace c3::kademlia {
+  /// The routing table
+  ///
+  /// Every RPC we get updates it and every lookup reads it, so readers never lock. They take the
+  /// current snapshot inside an epoch and read it as is. Writers change private copies of the
+  /// buckets they touch, and a background thread publishes those as a new snapshot every so often.
+  ///
+  /// Someone new who finds their bucket full goes into that bucket's replacement cache, and the
+  /// bucket's oldest contact is pinged in the background. Only if it doesn't answer is it evicted
+  /// for the newest replacement.
+  ///
+  /// Each contact has a round trip time estimate, which sets how long we wait on them and breaks
+  /// ties between contacts that are about as close as each other. Those change with every reply, so
+  /// they're kept in a table of their own rather than in the buckets, which would need copying.
   class k_buckets {
+  public:
+    /// Says whether a contact is still there. Called without holding any of our locks
+    using pinger_t = std::function<bool(const contact&)>;
+    /// Told of everyone who joins or leaves the table. Called holding our lock, so it mustn't call
+    /// back into us
+    using watcher_t = std::function<void(const nid_t&, bool joined)>;
+
+  private:
+    /// Up to k contacts at one distance, most recently seen first
+    ///
+    /// The nids sit together so that scanning a bucket only touches a few cache lines, and the
+    /// locations are packed end to end in one string rather than each getting an allocation.
+    struct bucket_t {
+      size_t size = 0;
+      std::array<nid_t, k> nids;
+      // Offset and length of each contact's location in locations
+      std::array<std::pair<uint32_t, uint32_t>, k> location_spans;
+      std::string locations;
+
+      size_t find(const nid_t& nid) const;
+      inline std::string_view location(size_t i) const {
+        return std::string_view{locations}.substr(location_spans[i].first, location_spans[i].second);
+      }
+      inline contact get(size_t i) const { return { nids[i], std::string{location(i)} }; }
+      inline bool full() const { return size == k; }
+
+      /// Must not be full
+      void push_front(const contact& c);
+      void move_to_front(size_t i);
+      void erase(size_t i);
+    };
+
+    /// What we've timed of someone in the table
+    struct timing_t {
+      rtt_estimate rtt;
+      latency_histogram histogram;
+    };
+
+    /// What readers see. Neither this nor its buckets change once published
+    struct snapshot_t {
+      std::array<const bucket_t*, B> buckets = {};
+    };
+
+  private:
+    // How long writes may wait before readers see them
+    static constexpr auto publish_interval = std::chrono::milliseconds{100};
+    static constexpr size_t replacement_max = k;
+
   private:
     node* parent;
-    // The webernet says that this is OK for sharing, so don't blame me
-    mutable std::array<std::pair<std::shared_mutex, std::list<contact>>, B> base;
+    pinger_t ping;
+    watcher_t watch;
+
+    // Reading registers us in here, which isn't a change anyone else can see
+    mutable epoch_domain epoch;
+    std::atomic<const snapshot_t*> current;
+
+    //
+    mutable std::mutex write_mutex;
+    std::condition_variable write_condvar;
+    // Our own copies of the buckets that have changed since the last publish
+    std::array<std::unique_ptr<bucket_t>, B> pending;
+    // Those we've heard from while their bucket was full, newest first
+    std::array<std::vector<contact>, B> replacements;
+    // Buckets whose oldest contact is waiting for, or undergoing, a ping
+    std::array<bool, B> probing = {};
+    std::vector<size_t> probes;
+    bool dirty = false;
+    bool die = false;
+    //
+
+    //
+    // Taken inside write_mutex, if at all. Only for those in the table, so that it can't grow
+    // without bound
+    mutable std::mutex timing_mutex;
+    std::unordered_map<nid_t, timing_t, nid_hash> timings;
+    //
+
+    std::atomic<size_t> replacements_cached = 0;
+    std::atomic<size_t> replacements_used = 0;
+    std::atomic<size_t> evictions = 0;
+
+    std::thread publish_thread;
+    std::thread probe_thread;
 
   public:
     inline node* get_parent() const { return parent; }
 
   private:
-    inline decltype(base)::reference get_bucket(nid_t nid) {
-      return base[distance(parent->get_nid(), nid)];
-    }
-    inline decltype(base)::const_reference get_bucket(nid_t nid) const {
-      return base[distance(parent->get_nid(), nid)];
+    inline size_t bucket_of(const nid_t& nid) const {
+      return distance(parent->get_nid(), nid);
     }
 
+    /// Must hold write_mutex. Gives the newest version of a bucket, which may be null
+    const bucket_t* latest(size_t index) const;
+    /// Must hold write_mutex
+    bucket_t& writable(size_t index);
+
+    /// Must hold write_mutex. Returns false if c only made it into the replacement cache
+    bool insert(size_t index, const contact& c);
+    /// Must hold write_mutex
+    void remember(size_t index, const contact& c);
+    /// Must hold write_mutex. Fills a gap in a bucket from its replacement cache
+    void promote(size_t index);
+    /// Must hold write_mutex
+    void joined(const nid_t& nid);
+    /// Must hold write_mutex
+    void left(const nid_t& nid);
+
+    /// The count contacts closest to target by the full XOR metric, closest first
+    std::vector<contact> closest(const nid_t& target, const nid_t& exclude, size_t count) const;
+
+    void publish_body();
+    void probe_body();
+
   public:
     std::vector<contact> find_node(nid_t sender, nid_t nid) const;
     /// We don't use a string_view, because gRPC's peer returns a string, not a reference to one
+    ///
+    /// Returns false if this is someone new and their bucket is already full
     bool update(contact c);
+    /// Marks someone already in the table as just seen, which doesn't need their location. Returns
+    /// false if they aren't in the table, in which case they need an update
+    bool touch(const nid_t& nid);
+    /// Anyone dropped is replaced by the newest contact from their bucket's replacement cache
     bool drop(nid_t nid);
     void add(contact location);
     size_t count() const;
     std::vector<contact> get_alpha(nid_t nid) const;
     std::vector<contact> get_all() const;
+    node::routing_stats_t get_stats() const;
+
+    /// Feeds a round trip time into the contact's estimate, if they're in the table
+    void observe_rtt(const nid_t& nid, std::chrono::microseconds rtt);
+    /// What we know of the contact's round trip time, which is nothing if they're not in the table
+    rtt_estimate rtt_of(const nid_t& nid) const;
+    inline std::chrono::milliseconds rpc_timeout(const nid_t& nid) const { return rtt_of(nid).timeout(); }
+    std::vector<node::peer_latency_t> get_peer_latencies() const;
+
+    /// Makes every write so far visible to readers, rather than waiting for the next batch
+    void publish();
 
   public:
-    inline k_buckets(node* parent) : parent{parent} {}
+    k_buckets(node* parent, pinger_t ping, watcher_t watch = {});
+    ~k_buckets();
   };
 }
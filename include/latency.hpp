@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace c3::kademlia {
+  /// A round trip time estimate, kept the way TCP keeps its own (RFC 6298)
+  ///
+  /// Small enough to sit next to every contact in the routing table.
+  struct rtt_estimate {
+    /// What we give peers we know nothing about, and the most we ever give anyone
+    static constexpr std::chrono::milliseconds max_timeout{3000};
+    /// Replies include the remote's work, and find_value may carry a large value, so don't cut too fine
+    static constexpr std::chrono::milliseconds min_timeout{500};
+
+    // Both zero until the first sample
+    uint32_t srtt_us = 0;
+    uint32_t rttvar_us = 0;
+
+    inline bool known() const noexcept { return srtt_us != 0; }
+    void observe(std::chrono::microseconds sample) noexcept;
+    /// How long to wait for an RPC before giving up on the peer
+    std::chrono::milliseconds timeout() const noexcept;
+    /// For ranking; unknown peers are assumed to be as slow as we'd wait for
+    inline std::chrono::microseconds expected() const noexcept {
+      return known() ? std::chrono::microseconds{srtt_us} : max_timeout;
+    }
+    /// What about 95% of replies come in under. rttvar is a mean deviation, which for a normal
+    /// distribution is about 0.8 of a standard deviation. Unknown peers get min_timeout
+    inline std::chrono::microseconds p95() const noexcept {
+      return known() ? std::chrono::microseconds{uint64_t{srtt_us} + 2 * uint64_t{rttvar_us}} : min_timeout;
+    }
+  };
+
+  /// Counts latencies into logarithmic buckets, two to each power of two
+  ///
+  /// Recording is a single relaxed increment, so this can be shared freely. Percentiles are only
+  /// as precise as the buckets, which is to say within about 40%.
+  class latency_histogram {
+  public:
+    struct bucket_t {
+      std::chrono::microseconds upper;
+      size_t count;
+    };
+
+  private:
+    // Anything below 2^min_bits us goes into the first bucket
+    static constexpr size_t min_bits = 6;
+    static constexpr size_t bucket_count = 2 * (32 - min_bits);
+
+  private:
+    std::array<std::atomic<uint32_t>, bucket_count> counts = {};
+
+  private:
+    static size_t index_of(std::chrono::microseconds latency) noexcept;
+    static std::chrono::microseconds upper_of(size_t index) noexcept;
+
+  public:
+    void record(std::chrono::microseconds latency) noexcept;
+    size_t count() const noexcept;
+    /// The latency that a fraction p of samples came in under, rounded up to its bucket
+    std::chrono::microseconds percentile(double p) const noexcept;
+    /// Every bucket that has something in it, fastest first
+    std::vector<bucket_t> buckets() const;
+
+  public:
+    latency_histogram() = default;
+    latency_histogram(const latency_histogram& other) noexcept;
+    latency_histogram& operator=(const latency_histogram& other) noexcept;
+  };
+}
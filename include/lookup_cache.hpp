@@ -0,0 +1,97 @@
+#pragma once
+
+#include "base.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace c3::kademlia {
+  /// The results of recent node lookups, for anything that wants the k closest to a key without
+  /// going over the network for them again
+  ///
+  /// A lookup's result holds everyone closer to its key than its furthest contact, so it also holds
+  /// everyone whose distance from the key has a lower top bit than that contact's does. Any key in
+  /// that region shares the same prefix with the lookup's key, and is given the same contacts,
+  /// closest to it first. A region is only used when all of the result but its furthest lies in it,
+  /// as then the k-1 closest to a nearby key are exactly what a lookup of its own would have found,
+  /// and only the last is our best guess from what we have.
+  ///
+  /// Entries are kept in key order, so the one covering a key, if any, is usually one of its two
+  /// neighbours. An entry goes once the routing table drops any of its contacts, or learns of
+  /// someone closer to its key than its furthest, and in any case after max_age.
+  class lookup_cache {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    struct stats_t {
+      size_t hits = 0;
+      size_t misses = 0;
+      /// Requests the lookups we didn't have to do would have sent
+      size_t requests_saved = 0;
+      size_t invalidations = 0;
+      size_t entries = 0;
+    };
+
+  private:
+    struct entry_t {
+      /// Closest to the key first
+      std::vector<contact> contacts;
+      /// How far the furthest of them is. Anyone we learn of who is closer makes this out of date
+      nid_t furthest;
+      /// Keys whose distance from ours has a lower top bit than this are covered. Zero only covers
+      /// the key itself
+      size_t region;
+      /// What the lookup cost, which is what each hit saves
+      size_t requests;
+      clock::time_point expiry;
+      std::list<nid_t>::iterator lru_pos;
+    };
+
+  private:
+    size_t max_entries;
+    clock::duration max_age;
+
+    //
+    mutable std::mutex cache_mutex;
+    std::map<nid_t, entry_t> entries;
+    // Most recently used first
+    std::list<nid_t> lru;
+    // The keys of every entry each contact is in
+    std::unordered_multimap<nid_t, nid_t, nid_hash> holders;
+    //
+
+    std::atomic<size_t> hits = 0;
+    std::atomic<size_t> misses = 0;
+    std::atomic<size_t> requests_saved = 0;
+    std::atomic<size_t> invalidations = 0;
+
+  private:
+    /// Must hold cache_mutex
+    void erase(std::map<nid_t, entry_t>::iterator iter);
+    /// Must hold cache_mutex. Whether iter is still good for key
+    bool covers(std::map<nid_t, entry_t>::iterator iter, const nid_t& key, clock::time_point now);
+
+  public:
+    /// The k closest to key we know of, closest first, if a recent lookup found them
+    std::optional<std::vector<contact>> get(const nid_t& key);
+    /// contacts must be a lookup's result, closest first, and requests what it took to get
+    void put(const nid_t& key, std::vector<contact> contacts, size_t requests);
+
+    /// Someone is new to the routing table
+    void learned(const nid_t& nid);
+    /// Someone has left the routing table
+    void dropped(const nid_t& nid);
+    void clear();
+
+    stats_t get_stats() const;
+
+  public:
+    lookup_cache(size_t max_entries = 1024, clock::duration max_age = std::chrono::minutes(1));
+  };
+}
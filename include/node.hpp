@@ -1,33 +1,163 @@
 #pragma once
 
+#include "async_server.hpp"
 #include "base.hpp"
 #include "backing_store.hpp"
+#include "batcher.hpp"
+#include "channel_pool.hpp"
+#include "latency.hpp"
+#include "lookup_cache.hpp"
 #include "remote.hpp"
 
 namespace c3::kademlia {
   class node {
+  public:
+    struct routing_stats_t {
+      size_t contacts = 0;
+      size_t buckets_used = 0;
+      size_t buckets_full = 0;
+      size_t replacements_cached = 0;
+      /// Replacements that have since made it into their bucket
+      size_t replacements_used = 0;
+      /// Contacts that failed to answer a ping when someone new wanted their place
+      size_t evictions = 0;
+    };
+
+    struct lookup_stats_t {
+      size_t lookups = 0;
+      size_t failures = 0;
+      std::chrono::microseconds mean_latency{0};
+      std::chrono::microseconds p50_latency{0};
+      std::chrono::microseconds p99_latency{0};
+      /// Requests deep, counting the first ones we send as one
+      double mean_hops = 0;
+      size_t max_hops = 0;
+      /// Callers who shared a lookup someone else was already running, rather than starting their own
+      size_t coalesced = 0;
+      /// Callers answered from a lookup that had only just finished
+      size_t cached = 0;
+      /// Values found that we left a copy of with the closest node that didn't have them
+      size_t path_caches = 0;
+      /// Requests sent because someone already asked was slower than they usually are
+      size_t hedges = 0;
+      /// Requests still going when their lookup finished, which we called off
+      size_t cancelled = 0;
+      /// Lookups that ran out of budget, and made do with whoever they'd heard from
+      size_t out_of_time = 0;
+    };
+
+    struct store_stats_t {
+      /// Values, counting each once however many replicas it went to
+      size_t stores = 0;
+      /// Values that fell short of the write quorum
+      size_t failures = 0;
+      /// Replica stores sent that haven't come back yet
+      size_t in_flight = 0;
+      /// Until the quorum had it, which is when store returned
+      std::chrono::microseconds p50_quorum_latency{0};
+      std::chrono::microseconds p99_quorum_latency{0};
+      /// Until every replica had answered
+      std::chrono::microseconds p50_replicated_latency{0};
+      std::chrono::microseconds p99_replicated_latency{0};
+    };
+
+    struct peer_latency_t {
+      contact peer;
+      /// Zero if we've never timed them
+      std::chrono::microseconds srtt{0};
+      std::chrono::microseconds rttvar{0};
+      std::chrono::milliseconds timeout{0};
+      latency_histogram histogram;
+    };
+
+    /// How we serve RPCs
+    struct server_options_t {
+      enum class mode_t {
+        /// gRPC's callback API, which runs everything on gRPC's own threads
+        callback,
+        /// Completion queues of our own, as in server_queues
+        async
+      };
+      mode_t mode = mode_t::callback;
+      /// Only for async. Zero means one for each core
+      size_t queues = 0;
+      /// Only for async. Threads running each queue's calls
+      size_t threads_per_queue = 1;
+      /// Only for async. Calls each queue may have waiting before it turns more away
+      size_t max_backlog = 256;
+      /// Memory gRPC may use on the server's behalf. Zero means no limit
+      size_t memory_quota = 0;
+      /// Threads gRPC may use for synchronous calls, which are only ever the streams. Zero means no
+      /// limit
+      size_t max_threads = 0;
+      /// Also answer ping, find_node and find_value over UDP on our port, and send ours that way to
+      /// anyone who answers them
+      bool datagrams = false;
+    };
+
   private:
     class impl;
 
+    struct store_item_t {
+      nid_t nid;
+      span<const uint8_t> data;
+      age_t age;
+    };
+
   private:
     nid_t our_nid;
     std::string our_port;
+    // Outlives service, so that nothing in there is left holding a dangling pool
+    mutable channel_pool channels;
 
     std::unique_ptr<impl> service;
     std::unique_ptr<grpc::Server> server;
 
+    std::atomic<size_t> write_quorum = 1;
+    std::atomic<std::chrono::milliseconds> lookup_budget{std::chrono::seconds{10}};
+
   public:
     constexpr nid_t get_nid() const { return our_nid; }
     inline std::string get_port() const { return our_port; }
     void add_peer(std::string location);
     size_t count_peers() const;
+    routing_stats_t get_routing_stats() const;
+    lookup_stats_t get_lookup_stats() const;
+    /// How often stores and replication found where to go without a lookup
+    lookup_cache::stats_t get_lookup_cache_stats() const;
+    store_stats_t get_store_stats() const;
+    std::vector<peer_latency_t> get_peer_latencies() const;
+    inline channel_pool::stats_t get_channel_stats() const { return channels.get_stats(); }
+    remote_node::batcher::stats_t get_batch_stats() const;
+    /// Only the unary RPCs are counted. Nothing is ever shed in callback mode
+    server_queues::stats_t get_server_stats() const;
+    /// Null unless we were built with datagrams
+    datagram_transport* get_datagrams() const;
+    /// All zero unless we were built with datagrams
+    datagram_transport::stats_t get_datagram_stats() const;
+    /// Where every remote_node of ours gets its channel
+    inline channel_pool& get_channels() const { return channels; }
+    /// How many replicas have to have a value before store returns, or all of them if there are
+    /// fewer. The rest carry on in the background
+    inline size_t get_write_quorum() const { return write_quorum; }
+    inline void set_write_quorum(size_t n) { write_quorum = std::max<size_t>(n, 1); }
+    /// How long a finished lookup's result is handed to anyone else after the same target. Zero, the
+    /// default, only shares lookups that are still going
+    void set_lookup_ttl(std::chrono::steady_clock::duration ttl);
+    /// How long a lookup may take before it gives up and goes with the closest it has heard from,
+    /// or throws timed_out if that's nobody. Zero means no limit
+    inline std::chrono::milliseconds get_lookup_budget() const { return lookup_budget; }
+    inline void set_lookup_budget(std::chrono::milliseconds d) { lookup_budget = d; }
 
    private:
     remote_node connect(std::string location);
     remote_node connect(contact c);
-    void iterative_store(nid_t key, span<const uint8_t> data, age_t age);
+    /// Looks up where each item goes, then sends them all at once, so that those headed for the
+    /// same node share calls. Returns once quorum of each item's replicas have it, and throws if
+    /// any of them couldn't get that many
+    void iterative_store(span<const store_item_t> items, size_t quorum);
     std::vector<contact> iterative_find_node(nid_t nid);
-    std::variant<std::vector<uint8_t>, std::vector<contact>> iterative_find_value(nid_t nid);
+    std::variant<buffer, std::vector<contact>> iterative_find_value(nid_t nid);
 
   public:
     std::shared_ptr<backing_store> back() const;
@@ -38,10 +168,13 @@ namespace c3::kademlia {
       store(nid, b);
       return nid;
     }
-    std::optional<std::vector<uint8_t>> find(nid_t);
+    /// Many values in one go, which is a lot cheaper than one at a time when they are small
+    std::vector<nid_t> store_all(span<const span<const uint8_t>> values, age_t age = age_t{0});
+    std::optional<buffer> find(nid_t);
     void ping_all();
 
   public:
+    node(std::string addr, nid_t nid, std::shared_ptr<backing_store> store, server_options_t options);
     node(std::string addr, nid_t nid, std::shared_ptr<backing_store> store);
     // To allow us to have a unique_ptr of a (currently) incomplete type
     ~node();
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "base.hpp"
+#include "buffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+namespace c3::kademlia {
+  /// Copies of values that lookups found on their way past us, kept apart from what we store
+  ///
+  /// Each copy only lasts as long as whoever cached it asked, which is less the further we are from
+  /// where the value lives. Once we're full, the copies closest to expiring go first.
+  class path_cache {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    struct stats_t {
+      size_t keys = 0;
+      size_t bytes = 0;
+      size_t cached = 0;
+      size_t hits = 0;
+      size_t expired = 0;
+    };
+
+  private:
+    struct entry_t {
+      buffer data;
+      clock::time_point birth;
+      std::multimap<clock::time_point, nid_t>::iterator expiry_pos;
+    };
+
+  private:
+    size_t max_bytes;
+    size_t max_keys;
+
+    //
+    mutable std::mutex cache_mutex;
+    std::unordered_map<nid_t, entry_t, nid_hash> entries;
+    // Soonest first
+    std::multimap<clock::time_point, nid_t> expiries;
+    size_t bytes = 0;
+    //
+
+    std::atomic<size_t> cached = 0;
+    std::atomic<size_t> hits = 0;
+    std::atomic<size_t> expired = 0;
+
+  private:
+    /// Must hold cache_mutex
+    inline void erase(std::unordered_map<nid_t, entry_t, nid_hash>::iterator iter) {
+      bytes -= iter->second.data.size();
+      expiries.erase(iter->second.expiry_pos);
+      entries.erase(iter);
+    }
+    /// Must hold cache_mutex
+    inline bool insert_locked(const nid_t& nid, buffer data, clock::time_point now, clock::time_point birth,
+                              clock::duration ttl) {
+      // Whatever has run out goes before anything that hasn't
+      while (!expiries.empty() && expiries.begin()->first <= now) {
+        erase(entries.find(expiries.begin()->second));
+        ++expired;
+      }
+      while (!expiries.empty() && (entries.size() >= max_keys || bytes + data.size() > max_bytes))
+        erase(entries.find(expiries.begin()->second));
+      if (entries.size() >= max_keys)
+        return false;
+
+      bytes += data.size();
+      auto expiry_pos = expiries.emplace(now + ttl, nid);
+      entries.emplace(nid, entry_t{std::move(data), birth, expiry_pos});
+      ++cached;
+      return true;
+    }
+
+  public:
+    /// Keeps data, which must hash to nid, until ttl is up
+    inline bool insert(const nid_t& nid, buffer data, clock::duration ttl) {
+      if (data.size() > max_bytes || ttl <= clock::duration::zero())
+        return false;
+
+      auto now = clock::now();
+      std::unique_lock lock{cache_mutex};
+      // A second copy only says how long to keep the first one
+      if (auto iter = entries.find(nid); iter != entries.end()) {
+        if (iter->second.expiry_pos->first >= now + ttl)
+          return true;
+        auto birth = iter->second.birth;
+        erase(iter);
+        return insert_locked(nid, std::move(data), now, birth, ttl);
+      }
+      return insert_locked(nid, std::move(data), now, now, ttl);
+    }
+
+    inline std::optional<std::pair<buffer, age_t>> get(const nid_t& nid) {
+      auto now = clock::now();
+      std::unique_lock lock{cache_mutex};
+      auto iter = entries.find(nid);
+      if (iter == entries.end())
+        return std::nullopt;
+      if (iter->second.expiry_pos->first <= now) {
+        erase(iter);
+        ++expired;
+        return std::nullopt;
+      }
+
+      ++hits;
+      return std::pair{iter->second.data, std::chrono::duration_cast<age_t>(now - iter->second.birth)};
+    }
+
+    inline stats_t get_stats() const {
+      std::unique_lock lock{cache_mutex};
+      return { entries.size(), bytes, cached, hits, expired };
+    }
+
+  public:
+    inline path_cache(size_t max_bytes = 16 * 1024 * 1024, size_t max_keys = 1024) :
+      max_bytes{max_bytes}, max_keys{max_keys} {}
+  };
+}
@@ -1,6 +1,12 @@
 #pragma once
 #include "base.hpp"
+#include "buffer.hpp"
+#include "cancellation.hpp"
+#include "datagram.hpp"
+#include "rpc_engine.hpp"
 
+#include <exception>
+#include <functional>
 #include <variant>
 
 #include <grpcpp/grpcpp.h>
@@ -14,18 +20,49 @@ namespace c3::kademlia {
   class node;
 
   class remote_node {
+  public:
+    /// Asynchronous results come with the exception the synchronous version would have thrown
+    template<typename T>
+    using callback_t = std::function<void(std::exception_ptr, T)>;
+
+    /// They have the value, but it has to be fetched with find_value_stream
+    struct large_value_t {
+      size_t size;
+    };
+    using value_result_t = std::variant<buffer, std::vector<contact>, large_value_t>;
+
+    class batcher;
+
+  private:
+    struct unchecked_t {};
+
   private:
     node* parent;
     contact details;
+    // Both come from the parent's channel_pool
     std::shared_ptr<grpc::Channel> channel;
-    std::unique_ptr<proto::Kademlia::Stub> stub = proto::Kademlia::NewStub(channel);
+    // Shared with any asynchronous calls, as they may outlive us
+    std::shared_ptr<proto::Kademlia::Stub> stub;
     std::chrono::milliseconds timeout;
 
+    // Streams get longer than the usual timeout, as they might be moving a lot
+    static constexpr size_t min_stream_rate = 1024 * 1024;
+
   private:
     void first_ping();
-    void init_ctx(grpc::ClientContext& ctx);
+    /// transfer is how many bytes the call moves, if that's a lot
+    void init_ctx(grpc::ClientContext& ctx, size_t transfer = 0);
     void check_ctx(grpc::ClientContext& ctx);
-    void handle_status(grpc::Status s);
+    /// Checks a finished call, and tells the channel pool how it went
+    void finish(grpc::ClientContext& ctx, const grpc::Status& status);
+    static void check_server_nid(grpc::ClientContext& ctx, const nid_t& expected);
+    static void handle_status(grpc::Status s);
+    /// Checks a datagram reply came from who we asked, and is the kind we were expecting
+    static void check_datagram(const datagram_transport::message_t& reply, const nid_t& expected,
+                               datagram_transport::kind_t kind);
+    static std::vector<contact> parse_contacts(const proto::FindNodeResponse& res, const nid_t& our_nid);
+    /// Takes the value out of res, if there is one
+    static value_result_t parse_value(proto::FindValueResponse& res, const nid_t& our_nid);
 
   public:
     nid_t get_nid() const { return details.nid; }
@@ -33,37 +70,53 @@ namespace c3::kademlia {
     contact get_contact() const { return details; }
     operator contact() const { return details; }
 
+    /// Over datagrams if our node uses them, unless they haven't answered one lately
     void ping();
+    /// Anything over stream_threshold goes through store_stream
     bool store(span<const uint8_t> data, age_t age = age_t{0});
     std::vector<contact> find_node(nid_t nid);
-    std::variant<std::vector<uint8_t>, std::vector<contact>> find_value(nid_t nid);
+    /// Fetches large values with find_value_stream
+    std::variant<buffer, std::vector<contact>> find_value(nid_t nid);
+    /// Sends data in chunks of chunk_size, working out its nid as it goes
+    bool store_stream(span<const uint8_t> data, age_t age = age_t{0});
+    /// Reads the value in chunks, checking it against nid as it goes. size is what find_value said
+    /// it was, which sets how long we'll wait, and the stream must agree with it
+    std::variant<buffer, std::vector<contact>> find_value_stream(nid_t nid, size_t size);
     void republish(span<const uint8_t> data, age_t age);
 
-  public:
-    template<typename Duration>
-    inline remote_node(node* parent, contact c, Duration net_timeout) :
-      parent{parent},
-      details{c},
-      channel{grpc::CreateChannel(c.location, grpc::InsecureChannelCredentials())},
-      timeout{std::chrono::duration_cast<decltype(timeout)>(net_timeout)} {
-      ping();
-    }
+    /// These return straight away, and call back on one of engine's threads
+    void find_node(rpc_engine& engine, nid_t nid, callback_t<std::vector<contact>> cb);
+    void find_value(rpc_engine& engine, nid_t nid, callback_t<value_result_t> cb);
+    /// The same, but sharing a call with anything else waiting for the same peer
+    void store(batcher& via, span<const uint8_t> data, age_t age, callback_t<bool> cb);
+    /// Asks them to keep a copy for ttl, rather than store it for good
+    void cache(batcher& via, span<const uint8_t> data, std::chrono::seconds ttl, callback_t<bool> cb);
+    /// Once cancel goes, these are dropped if they haven't been sent, and their call is cancelled
+    /// if nobody else sharing it still wants it. sent is called as their call goes out
+    void find_node(batcher& via, nid_t nid, callback_t<std::vector<contact>> cb,
+                   std::shared_ptr<cancellation> cancel = nullptr, std::function<void()> sent = {});
+    void find_value(batcher& via, nid_t nid, callback_t<value_result_t> cb,
+                    std::shared_ptr<cancellation> cancel = nullptr, std::function<void()> sent = {});
+    /// The same again over UDP, for peers that answer it. Values too big for a datagram come back
+    /// as large_value_t
+    void ping(datagram_transport& via);
+    void find_node(datagram_transport& via, nid_t nid, callback_t<std::vector<contact>> cb);
+    void find_value(datagram_transport& via, nid_t nid, callback_t<value_result_t> cb);
 
+  private:
+    remote_node(node* parent, contact c, std::chrono::milliseconds net_timeout, unchecked_t);
+
+  public:
+    /// Pings c first, unless they've answered something recently
+    remote_node(node* parent, contact c, std::chrono::milliseconds net_timeout = std::chrono::seconds(3));
     /// XXX: Please be very afraid of using this in k_buckets: it WILL deadlock any parent mutex
-    template<typename Duration>
-    inline remote_node(node* parent, std::string location, Duration net_timeout) :
-      parent{parent},
-      // We set the nid in first_ping()
-      details{{}, location},
-      channel(grpc::CreateChannel(location, grpc::InsecureChannelCredentials())),
-      timeout{std::chrono::duration_cast<decltype(timeout)>(net_timeout)} {
-      first_ping();
-    }
-    /// XXX: Please be very afraid of using this in k_buckets: it WILL deadlock any parent mutex
-    inline remote_node(node* parent, std::string location) :
-      remote_node{parent, location, std::chrono::seconds(3)} {}
+    remote_node(node* parent, std::string location, std::chrono::milliseconds net_timeout = std::chrono::seconds(3));
 
-    inline remote_node(node* parent, contact c) :
-      remote_node{parent, c, std::chrono::seconds(3)} {}
+    /// Skips the ping. Every reply is checked against c's nid anyway, so this is all we need
+    /// before sending a one off RPC
+    static inline remote_node unchecked(node* parent, contact c,
+                                        std::chrono::milliseconds net_timeout = std::chrono::seconds(3)) {
+      return {parent, std::move(c), net_timeout, unchecked_t{}};
+    }
   };
 }
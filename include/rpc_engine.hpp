@@ -0,0 +1,97 @@
+#pragma once
+
+#include "arena.hpp"
+#include "base.hpp"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/completion_queue.h>
+
+namespace c3::kademlia {
+  /// Runs asynchronous client RPCs on a few completion queues, each with its own thread
+  ///
+  /// Callers start a call and carry on; the callback runs on one of our threads once the reply
+  /// (or an error) arrives. However many lookups are in flight, the same few threads serve them
+  /// all.
+  class rpc_engine {
+  private:
+    /// Anything we put on a queue as a tag
+    class pending_call {
+    public:
+      virtual void complete(bool ok) = 0;
+      virtual ~pending_call() = default;
+    };
+
+    template<typename Res>
+    class unary_call : public pending_call {
+    public:
+      // The reply is parsed into here, so it shares the call's allocation unless it's big
+      inline_arena<> arena;
+      grpc::ClientContext ctx;
+      Res* res = arena.make<Res>();
+      grpc::Status status;
+      std::unique_ptr<grpc::ClientAsyncResponseReader<Res>> reader;
+      std::function<void(grpc::Status&, grpc::ClientContext&, Res&)> on_done;
+
+    public:
+      inline void complete(bool) override { on_done(status, ctx, *res); }
+    };
+
+  private:
+    std::vector<std::unique_ptr<grpc::CompletionQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_queue = 0;
+
+    //
+    // Held shared while starting a call, so that nothing goes onto a queue after it's shut down
+    std::shared_mutex closing_mutex;
+    bool closing = false;
+    //
+
+  private:
+    void queue_body(grpc::CompletionQueue* queue);
+
+  public:
+    /// Starts a unary call
+    ///
+    /// prepare is given the context to set up and the queue to use, and should hand back the
+    /// reader from the stub's PrepareAsync method. on_done is then called exactly once, on one of
+    /// our threads (or straight away, if we're shutting down), and must not block for long.
+    /// Anything it throws is lost.
+    template<typename Res, typename Prepare>
+    void unary(Prepare&& prepare, std::function<void(grpc::Status&, grpc::ClientContext&, Res&)> on_done) {
+      std::shared_lock lock{closing_mutex};
+      // A callback may start another call while we shut down, which has to fail rather than hang
+      if (closing) {
+        lock.unlock();
+        grpc::ClientContext ctx;
+        grpc::Status status{grpc::StatusCode::CANCELLED, "Shutting down"};
+        Res res;
+        on_done(status, ctx, res);
+        return;
+      }
+
+      auto queue = queues[next_queue++ % queues.size()].get();
+
+      auto call = std::make_unique<unary_call<Res>>();
+      call->on_done = std::move(on_done);
+      call->reader = prepare(call->ctx, queue);
+      call->reader->StartCall();
+      // The queue owns the call from here, until queue_body deletes it
+      auto tag = call.release();
+      tag->reader->Finish(tag->res, &tag->status, static_cast<pending_call*>(tag));
+    }
+
+  public:
+    /// Zero threads means one for each core, up to a handful
+    rpc_engine(size_t thread_count = 0);
+    /// Waits for everything in flight to finish
+    ~rpc_engine();
+  };
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "base.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+namespace c3::kademlia {
+  /// Runs one lookup at a time for each nid, however many want it
+  ///
+  /// Whoever asks for a nid nobody is already looking up runs the lookup, and anyone who asks while
+  /// it's going waits for the same result, exceptions included. Results can also be kept for a short
+  /// while afterwards, for callers that can live with one a little out of date.
+  template<typename Value>
+  class single_flight {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    struct stats_t {
+      size_t runs = 0;
+      /// Joined a lookup someone else was running
+      size_t coalesced = 0;
+      /// Answered from a result we'd kept
+      size_t cached = 0;
+    };
+
+  private:
+    struct recent_t {
+      Value value;
+      clock::time_point expiry;
+    };
+
+  private:
+    size_t max_recent;
+
+    //
+    mutable std::mutex flights_mutex;
+    std::unordered_map<nid_t, std::shared_future<Value>, nid_hash> in_flight;
+    std::unordered_map<nid_t, recent_t, nid_hash> recent;
+    clock::duration ttl = clock::duration::zero();
+    //
+
+    std::atomic<size_t> runs = 0;
+    std::atomic<size_t> coalesced = 0;
+    std::atomic<size_t> cached = 0;
+
+  private:
+    /// Must hold flights_mutex
+    inline void keep(const nid_t& nid, const Value& value, clock::time_point now) {
+      if (recent.size() >= max_recent) {
+        for (auto i = recent.begin(); i != recent.end();)
+          i = i->second.expiry > now ? std::next(i) : recent.erase(i);
+        // Everything is still fresh, so it'll all just have to be looked up again
+        if (recent.size() >= max_recent)
+          recent.clear();
+      }
+      recent.insert_or_assign(nid, recent_t{value, now + ttl});
+    }
+
+  public:
+    /// Returns what run gives for nid, unless someone else is already running it, or did so less
+    /// than the ttl ago
+    template<typename Func>
+    Value get(const nid_t& nid, Func&& run) {
+      std::promise<Value> result;
+      {
+        std::unique_lock lock{flights_mutex};
+        if (auto iter = recent.find(nid); iter != recent.end()) {
+          if (iter->second.expiry > clock::now()) {
+            ++cached;
+            return iter->second.value;
+          }
+          recent.erase(iter);
+        }
+
+        if (auto iter = in_flight.find(nid); iter != in_flight.end()) {
+          ++coalesced;
+          auto shared = iter->second;
+          lock.unlock();
+          return shared.get();
+        }
+
+        in_flight.emplace(nid, result.get_future().share());
+      }
+
+      ++runs;
+      try {
+        Value ret = run();
+        result.set_value(ret);
+
+        std::unique_lock lock{flights_mutex};
+        in_flight.erase(nid);
+        if (ttl > clock::duration::zero())
+          keep(nid, ret, clock::now());
+        return ret;
+      }
+      catch (...) {
+        result.set_exception(std::current_exception());
+
+        std::unique_lock lock{flights_mutex};
+        in_flight.erase(nid);
+        throw;
+      }
+    }
+
+    /// Zero, the default, keeps nothing once its lookup is done
+    inline void set_ttl(clock::duration d) {
+      std::unique_lock lock{flights_mutex};
+      ttl = d;
+      if (ttl <= clock::duration::zero())
+        recent.clear();
+    }
+    inline clock::duration get_ttl() const {
+      std::unique_lock lock{flights_mutex};
+      return ttl;
+    }
+
+    inline stats_t get_stats() const { return { runs, coalesced, cached }; }
+
+  public:
+    inline single_flight(size_t max_recent = 1024) : max_recent{max_recent} {}
+  };
+}
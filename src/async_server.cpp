@@ -0,0 +1,133 @@
+#include "async_server.hpp"
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace c3::kademlia {
+  namespace {
+    /// Best effort, as there's nothing to be done about it if we can't
+    void pin_to_core(std::thread& thread, size_t core) {
+#if defined(__linux__)
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(core, &set);
+      pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+      (void)thread;
+      (void)core;
+#endif
+    }
+  }
+
+  void server_queues::poller_body(queue_t& q) {
+    void* tag;
+    bool ok;
+    while (q.cq->Next(&tag, &ok)) {
+      auto c = static_cast<call*>(tag);
+      if (!c->arrived(ok))
+        continue;
+
+      {
+        std::unique_lock lock{q.backlog_mutex};
+        if (!q.stopping && q.backlog.size() < max_backlog) {
+          q.backlog.push_back(c);
+          q.backlog_condvar.notify_one();
+          continue;
+        }
+      }
+      ++shed;
+      c->shed();
+    }
+  }
+
+  void server_queues::worker_body(queue_t& q) {
+    while (true) {
+      call* c;
+      {
+        std::unique_lock lock{q.backlog_mutex};
+        q.backlog_condvar.wait(lock, [&]() { return q.stopping || !q.backlog.empty(); });
+        // Whatever is already waiting still gets an answer
+        if (q.backlog.empty())
+          return;
+        c = q.backlog.front();
+        q.backlog.pop_front();
+      }
+      c->run();
+      ++served;
+    }
+  }
+
+  server_queues::stats_t server_queues::get_stats() const {
+    return { queues.size(), queues.size() * (threads_per_queue + 1), served, shed };
+  }
+
+  void server_queues::start() {
+    size_t cores = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    for (size_t i = 0; i < queues.size(); ++i) {
+      auto& q = *queues[i];
+      q.poller = std::thread{&server_queues::poller_body, this, std::ref(q)};
+      for (size_t j = 0; j < threads_per_queue; ++j)
+        q.workers.emplace_back(&server_queues::worker_body, this, std::ref(q));
+
+      // Sharing cores would only have them fight over the one
+      if (queues.size() <= cores) {
+        pin_to_core(q.poller, i);
+        for (auto& j : q.workers)
+          pin_to_core(j, i);
+      }
+    }
+  }
+
+  void server_queues::stop() {
+    if (stopped)
+      return;
+    stopped = true;
+
+    // Workers may still be replying, which can't happen once their queue is shut down
+    for (auto& i : queues) {
+      std::unique_lock lock{i->backlog_mutex};
+      i->stopping = true;
+      i->backlog_condvar.notify_all();
+    }
+    for (auto& i : queues)
+      for (auto& j : i->workers)
+        if (j.joinable())
+          j.join();
+
+    for (auto& i : queues)
+      i->cq->Shutdown();
+    for (auto& i : queues) {
+      if (i->poller.joinable())
+        i->poller.join();
+      else {
+        // We never started, but whatever is on there still has to come off
+        void* tag;
+        bool ok;
+        while (i->cq->Next(&tag, &ok))
+          static_cast<call*>(tag)->arrived(false);
+      }
+    }
+  }
+
+  server_queues::server_queues(grpc::ServerBuilder& builder, size_t queue_count,
+                               size_t threads_per_queue, size_t max_backlog) :
+    threads_per_queue{std::max<size_t>(threads_per_queue, 1)},
+    max_backlog{max_backlog} {
+    if (queue_count == 0)
+      queue_count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+    for (size_t i = 0; i < queue_count; ++i) {
+      auto q = std::make_unique<queue_t>();
+      q->cq = builder.AddCompletionQueue();
+      queues.push_back(std::move(q));
+    }
+  }
+
+  server_queues::~server_queues() {
+    stop();
+  }
+}
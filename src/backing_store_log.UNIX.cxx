@@ -0,0 +1,802 @@
+#include "backing_store_log.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+
+namespace c3::kademlia {
+  namespace {
+    [[noreturn]] void throw_errno(const char* what) {
+      throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void write_all(int fd, const void* buf, size_t len, uint64_t off) {
+      auto p = static_cast<const uint8_t*>(buf);
+      while (len) {
+        auto n = ::pwrite(fd, p, len, static_cast<off_t>(off));
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          throw_errno("Could not write segment");
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+        off += static_cast<uint64_t>(n);
+      }
+    }
+
+    /// Returns false if we hit the end of the file first
+    bool read_all(int fd, void* buf, size_t len, uint64_t off) {
+      auto p = static_cast<uint8_t*>(buf);
+      while (len) {
+        auto n = ::pread(fd, p, len, static_cast<off_t>(off));
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          throw_errno("Could not read segment");
+        }
+        if (n == 0)
+          return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+        off += static_cast<uint64_t>(n);
+      }
+      return true;
+    }
+
+    uint64_t file_size(int fd) {
+      struct stat st;
+      if (::fstat(fd, &st) != 0)
+        throw_errno("Could not stat file");
+      return static_cast<uint64_t>(st.st_size);
+    }
+
+    int64_t to_seconds(backing_store::log::clock::time_point t) {
+      return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+    }
+
+    size_t hash_of(const nid_t& nid) {
+      uint64_t ret;
+      std::memcpy(&ret, nid.data(), sizeof(ret));
+      return ret;
+    }
+  }
+
+  std::string backing_store::log::segment_path(uint32_t id) const {
+    char name[16];
+    std::snprintf(name, sizeof(name), "%08x.seg", id);
+    return dir + "/" + name;
+  }
+
+  std::string backing_store::log::index_path() const {
+    return dir + "/index";
+  }
+
+  backing_store::log::mapping backing_store::log::map_index(const std::string& path, size_t capacity,
+                                                           bool create) {
+    mapping ret;
+
+    ret.fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (ret.fd < 0)
+      throw_errno("Could not open index");
+
+    try {
+      if (create) {
+        ret.length = sizeof(index_header) + capacity * sizeof(index_slot);
+        // This zero fills, which is exactly an empty table
+        if (::ftruncate(ret.fd, static_cast<off_t>(ret.length)) != 0)
+          throw_errno("Could not size index");
+      }
+      else {
+        ret.length = file_size(ret.fd);
+        if (ret.length < sizeof(index_header))
+          throw std::runtime_error("Index is truncated");
+      }
+
+      void* ptr = ::mmap(nullptr, ret.length, PROT_READ | PROT_WRITE, MAP_SHARED, ret.fd, 0);
+      if (ptr == MAP_FAILED)
+        throw_errno("Could not map index");
+      ret.header = static_cast<index_header*>(ptr);
+      ret.slots = reinterpret_cast<index_slot*>(ret.header + 1);
+    }
+    catch (...) {
+      ::close(ret.fd);
+      throw;
+    }
+
+    if (create) {
+      *ret.header = {};
+      ret.header->magic = index_magic;
+      ret.header->version = index_version;
+      ret.header->capacity = capacity;
+      return ret;
+    }
+
+    auto& h = *ret.header;
+    if (h.magic != index_magic || h.version != index_version ||
+        h.capacity == 0 || (h.capacity & (h.capacity - 1)) != 0 ||
+        ret.length != sizeof(index_header) + h.capacity * sizeof(index_slot)) {
+      unmap_index(ret);
+      throw std::runtime_error("Index is corrupt");
+    }
+
+    return ret;
+  }
+
+  void backing_store::log::unmap_index(mapping& m) {
+    if (m.header)
+      ::munmap(m.header, m.length);
+    if (m.fd >= 0)
+      ::close(m.fd);
+    m = {};
+  }
+
+  backing_store::log::index_slot* backing_store::log::find_slot(const mapping& m, const nid_t& nid) {
+    size_t mask = m.header->capacity - 1;
+    // We never fill the table, so this terminates
+    for (size_t i = hash_of(nid) & mask;; i = (i + 1) & mask) {
+      auto& slot = m.slots[i];
+      if (slot.segment == 0)
+        return nullptr;
+      if (slot.segment != tombstone_segment && slot.nid == nid)
+        return &slot;
+    }
+  }
+
+  backing_store::log::index_slot* backing_store::log::insert_slot(mapping& m, const nid_t& nid) {
+    size_t mask = m.header->capacity - 1;
+    for (size_t i = hash_of(nid) & mask;; i = (i + 1) & mask) {
+      auto& slot = m.slots[i];
+      if (slot.segment == 0)
+        ++m.header->occupied;
+      else if (slot.segment != tombstone_segment)
+        continue;
+
+      slot.nid = nid;
+      ++m.header->count;
+      return &slot;
+    }
+  }
+
+  uint32_t backing_store::log::open_segment(uint32_t id) {
+    int fd = ::open(segment_path(id).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      throw_errno("Could not open segment");
+
+    try { segments[id] = {fd, file_size(fd), 0}; }
+    catch (...) {
+      ::close(fd);
+      throw;
+    }
+
+    return id;
+  }
+
+  void backing_store::log::open_segments() {
+    DIR* d = ::opendir(dir.c_str());
+    if (!d)
+      throw_errno("Could not open store directory");
+
+    try {
+      while (auto ent = ::readdir(d)) {
+        unsigned int id;
+        char tail;
+        // Anything else in the directory isn't ours, so leave it alone
+        if (std::strlen(ent->d_name) != 12 || std::sscanf(ent->d_name, "%08x.se%c", &id, &tail) != 2 ||
+            tail != 'g' || id == 0 || id == tombstone_segment)
+          continue;
+        open_segment(id);
+      }
+    }
+    catch (...) {
+      ::closedir(d);
+      throw;
+    }
+
+    ::closedir(d);
+  }
+
+  void backing_store::log::rebuild_index() {
+    unmap_index(index);
+    index = map_index(index_path(), initial_capacity, true);
+
+    auto now = to_seconds(clock::now());
+
+    for (auto& [id, seg] : segments) {
+      uint64_t off = 0;
+
+      while (off < seg.size) {
+        record_header h;
+        if (!read_all(seg.fd, &h, sizeof(h), off) || h.magic != record_magic ||
+            off + sizeof(h) + h.size > seg.size)
+          break;
+
+        if (h.expiry > now) {
+          auto slot = find_slot(index, h.nid);
+          if (!slot) {
+            if ((index.header->occupied + 1) * 2 > index.header->capacity)
+              grow_index();
+            slot = insert_slot(index, h.nid);
+          }
+          // Compaction copies forward, so later records always win
+          slot->birth = h.birth;
+          slot->expiry = h.expiry;
+          slot->offset = off;
+          slot->size = h.size;
+          slot->segment = id;
+        }
+
+        off += sizeof(h) + h.size;
+      }
+
+      // Whatever is past the last good record was torn by a crash
+      if (off != seg.size) {
+        if (::ftruncate(seg.fd, static_cast<off_t>(off)) != 0)
+          throw_errno("Could not truncate segment");
+        seg.size = off;
+      }
+    }
+  }
+
+  void backing_store::log::grow_index() {
+    size_t capacity = index.header->capacity;
+    // If it's mostly tombstones, a rebuild at the same size is enough
+    if ((index.header->count + 1) * 4 > capacity)
+      capacity *= 2;
+
+    auto new_path = index_path() + ".new";
+    auto grown = map_index(new_path, capacity, true);
+
+    for (size_t i = 0; i < index.header->capacity; ++i) {
+      auto& slot = index.slots[i];
+      if (slot.segment == 0 || slot.segment == tombstone_segment)
+        continue;
+      *insert_slot(grown, slot.nid) = slot;
+    }
+
+    if (::rename(new_path.c_str(), index_path().c_str()) != 0) {
+      unmap_index(grown);
+      throw_errno("Could not replace index");
+    }
+
+    unmap_index(index);
+    index = grown;
+    ++index_generation;
+  }
+
+  bool backing_store::log::should_compact(const segment& seg) const {
+    return seg.size != 0 && static_cast<double>(seg.size - seg.live) >= seg.size * opts.compact_ratio;
+  }
+
+  std::pair<uint32_t, uint64_t> backing_store::log::append(const record_header& h, span<const uint8_t> data) {
+    // A streamed value may have taken the next id already
+    if (auto& seg = segments.at(active); seg.size != 0 && seg.size + sizeof(h) + h.size > opts.segment_size)
+      active = open_segment(segments.rbegin()->first + 1);
+
+    auto& seg = segments.at(active);
+    // If either of these fail, we haven't moved size on, so the garbage gets overwritten next time
+    write_all(seg.fd, &h, sizeof(h), seg.size);
+    write_all(seg.fd, data.data(), data.size(), seg.size + sizeof(h));
+
+    auto off = seg.size;
+    seg.size += sizeof(h) + h.size;
+    seg.live += sizeof(h) + h.size;
+
+    return {active, off};
+  }
+
+  bool backing_store::log::insert(const nid_t& nid, span<const uint8_t> s, age_t age) noexcept {
+    try {
+      if (static_cast<size_t>(s.size()) > UINT32_MAX)
+        return false;
+
+      auto now = to_seconds(clock::now());
+
+      record_header h{
+        record_magic,
+        static_cast<uint32_t>(s.size()),
+        now - static_cast<int64_t>(age.count()),
+        now + static_cast<int64_t>(opts.lifetime.count()),
+        nid
+      };
+
+      {
+        std::unique_lock lock{index_mutex};
+
+        // Check to see if we already have it
+        if (find_slot(index, nid))
+          return true;
+
+        if (index.header->count >= opts.max_keys || bytes_used + h.size > opts.max_size)
+          return false;
+
+        if ((index.header->occupied + 1) * 2 > index.header->capacity)
+          grow_index();
+
+        // Write the record first, so that a failure leaves the index alone
+        auto [id, off] = append(h, s);
+
+        auto slot = insert_slot(index, nid);
+        slot->birth = h.birth;
+        slot->expiry = h.expiry;
+        slot->offset = off;
+        slot->size = h.size;
+        slot->segment = id;
+
+        bytes_used += h.size;
+      }
+
+      expiry->schedule(nid, opts.lifetime);
+
+      return true;
+    }
+    catch (...) {
+      return false;
+    }
+  }
+
+  bool backing_store::log::store(span<const uint8_t> s, age_t age) noexcept {
+    // This is expensive and independent of obj state, so we do this outside the mutex
+    try { return insert(compute_nid(s), s, age); }
+    catch (...) { return false; }
+  }
+
+  std::vector<bool> backing_store::log::store_batch(std::vector<value_t> values) noexcept {
+    std::vector<bool> ret;
+    try {
+      ret.resize(values.size(), false);
+      // Hashing them together lets big batches use a few cores
+      std::vector<span<const uint8_t>> data;
+      data.reserve(values.size());
+      for (auto& i : values)
+        data.push_back(i.dat.get());
+      auto nids = compute_nids(data);
+
+      for (size_t i = 0; i < values.size(); ++i)
+        ret[i] = insert(nids[i], data[i], values[i].age);
+    }
+    catch (...) {}
+    return ret;
+  }
+
+  class backing_store::log::segment_writer : public backing_store::writer {
+  private:
+    log* store;
+    uint32_t id;
+    int fd;
+    uint64_t off = sizeof(record_header);
+    record_header h;
+    bool committed = false;
+
+  protected:
+    bool put(span<const uint8_t> data) noexcept override final {
+      try {
+        // Nobody else touches a segment that has nothing in it yet, so we don't need the lock
+        write_all(fd, data.data(), static_cast<size_t>(data.size()), off);
+        off += static_cast<uint64_t>(data.size());
+        return true;
+      }
+      catch (...) {
+        return false;
+      }
+    }
+
+    bool finish(const nid_t& nid) noexcept override final {
+      try {
+        h.nid = nid;
+
+        {
+          std::unique_lock lock{store->index_mutex};
+
+          // Someone beat us to it, which is just as good
+          if (find_slot(store->index, nid))
+            return true;
+
+          if (store->index.header->count >= store->opts.max_keys || store->bytes_used + h.size > store->opts.max_size)
+            return false;
+
+          if ((store->index.header->occupied + 1) * 2 > store->index.header->capacity)
+            store->grow_index();
+
+          // With the header written, the record is there for anyone who reads the segment
+          write_all(fd, &h, sizeof(h), 0);
+          auto& seg = store->segments.at(id);
+          seg.size = seg.live = sizeof(h) + h.size;
+          committed = true;
+
+          auto slot = insert_slot(store->index, nid);
+          slot->birth = h.birth;
+          slot->expiry = h.expiry;
+          slot->offset = 0;
+          slot->size = h.size;
+          slot->segment = id;
+
+          store->bytes_used += h.size;
+        }
+
+        store->expiry->schedule(nid, store->opts.lifetime);
+
+        return true;
+      }
+      catch (...) {
+        return false;
+      }
+    }
+
+  public:
+    segment_writer(log* store, size_t size, age_t age) : writer{size}, store{store} {
+      auto now = to_seconds(clock::now());
+      h = {
+        record_magic,
+        static_cast<uint32_t>(size),
+        now - static_cast<int64_t>(age.count()),
+        now + static_cast<int64_t>(store->opts.lifetime.count()),
+        {}
+      };
+
+      std::unique_lock lock{store->index_mutex};
+      id = store->open_segment(store->segments.rbegin()->first + 1);
+      fd = store->segments.at(id).fd;
+    }
+
+    ~segment_writer() {
+      if (committed)
+        return;
+
+      std::unique_lock lock{store->index_mutex};
+      ::close(fd);
+      ::unlink(store->segment_path(id).c_str());
+      store->segments.erase(id);
+    }
+  };
+
+  std::unique_ptr<backing_store::writer> backing_store::log::begin_store(size_t size, age_t age) noexcept {
+    try {
+      if (size > UINT32_MAX || size > opts.max_size)
+        return nullptr;
+      return std::make_unique<segment_writer>(this, size, age);
+    }
+    catch (...) {
+      return nullptr;
+    }
+  }
+
+  std::optional<backing_store::value_t> backing_store::log::read_value(const index_slot& slot) {
+    auto& seg = segments.at(slot.segment);
+
+    record_header h;
+    if (!read_all(seg.fd, &h, sizeof(h), slot.offset) || h.magic != record_magic ||
+        h.nid != slot.nid || h.size != slot.size)
+      return std::nullopt;
+
+    std::vector<uint8_t> data(h.size);
+    if (!read_all(seg.fd, data.data(), data.size(), slot.offset + sizeof(h)))
+      return std::nullopt;
+
+    auto age = std::max<int64_t>(0, to_seconds(clock::now()) - slot.birth);
+    return value_t{ buffer::adopt(std::move(data)), age_t(static_cast<uint64_t>(age)) };
+  }
+
+  std::optional<backing_store::value_t> backing_store::log::retrieve(nid_t nid) noexcept {
+    try {
+      std::shared_lock lock{index_mutex};
+
+      auto slot = find_slot(index, nid);
+      if (!slot)
+        return std::nullopt;
+
+      return read_value(*slot);
+    }
+    catch (...) {
+      return std::nullopt;
+    }
+  }
+
+  std::optional<size_t> backing_store::log::size_of(nid_t nid) noexcept {
+    try {
+      std::shared_lock lock{index_mutex};
+
+      if (auto slot = find_slot(index, nid))
+        return slot->size;
+    }
+    catch (...) {}
+    return std::nullopt;
+  }
+
+  std::optional<buffer> backing_store::log::read(nid_t nid, size_t offset, size_t length) noexcept {
+    try {
+      // Only the one piece is read under the lock, so compaction never waits on a whole value
+      std::shared_lock lock{index_mutex};
+
+      auto slot = find_slot(index, nid);
+      if (!slot || offset > slot->size)
+        return std::nullopt;
+
+      std::vector<uint8_t> data(std::min<size_t>(length, slot->size - offset));
+      auto start = slot->offset + sizeof(record_header) + offset;
+      if (!read_all(segments.at(slot->segment).fd, data.data(), data.size(), start))
+        return std::nullopt;
+      return buffer::adopt(std::move(data));
+    }
+    catch (...) {
+      return std::nullopt;
+    }
+  }
+
+  backing_store::scan_t backing_store::log::scan(cursor_t from, size_t max_items) noexcept {
+    scan_t ret{{}, from};
+    if (!max_items)
+      max_items = default_scan_batch;
+
+    try {
+      std::shared_lock lock{index_mutex};
+
+      // The index was regrown under us, so start again
+      size_t pos = from.generation == index_generation ? from.position : 0;
+
+      for (; pos < index.header->capacity; ++pos) {
+        if (ret.items.size() == max_items) {
+          ret.next.position = pos;
+          ret.next.generation = index_generation;
+          return ret;
+        }
+
+        auto& slot = index.slots[pos];
+        if (slot.segment == 0 || slot.segment == tombstone_segment)
+          continue;
+        if (auto val = read_value(slot))
+          ret.items.emplace_back(slot.nid, std::move(*val));
+      }
+
+      ret.next.done = true;
+    }
+    // Better to give up on this pass than to loop on the same failure forever
+    catch (...) {
+      ret.next.done = true;
+    }
+
+    return ret;
+  }
+
+  std::vector<nid_t> backing_store::log::get_all_keys() noexcept {
+    std::vector<nid_t> ret;
+
+    try {
+      std::shared_lock lock{index_mutex};
+
+      for (size_t i = 0; i < index.header->capacity; ++i)
+        if (auto& slot = index.slots[i]; slot.segment != 0 && slot.segment != tombstone_segment)
+          ret.push_back(slot.nid);
+    }
+    catch (...) {}
+
+    return ret;
+  }
+
+  backing_store::stats_t backing_store::log::get_stats() noexcept {
+    std::shared_lock lock{index_mutex};
+
+    stats_t ret{
+      .bytes_used = bytes_used,
+      .bytes_max = opts.max_size,
+      .keys_used = index.header->count,
+      .keys_max = opts.max_keys,
+      .keys_expiring = expiry->pending(),
+      .disk_bytes = index.length,
+      .compaction_debt = 0
+    };
+
+    for (auto& [id, seg] : segments) {
+      ret.disk_bytes += seg.size;
+      ret.compaction_debt += seg.size - seg.live;
+    }
+
+    return ret;
+  }
+
+  void backing_store::log::expire(std::vector<nid_t>& nids) {
+    bool wanted = false;
+
+    {
+      std::unique_lock lock{index_mutex};
+
+      for (auto& nid : nids) {
+        auto slot = find_slot(index, nid);
+        if (!slot)
+          continue;
+
+        auto& seg = segments.at(slot->segment);
+        seg.live -= sizeof(record_header) + slot->size;
+        wanted |= slot->segment != active && should_compact(seg);
+
+        bytes_used -= slot->size;
+        slot->segment = tombstone_segment;
+        --index.header->count;
+      }
+    }
+
+    if (wanted) {
+      std::unique_lock lock{compact_mutex};
+      compact_wanted = true;
+      compact_condvar.notify_all();
+    }
+  }
+
+  void backing_store::log::compact(uint32_t id) {
+    struct moving_t {
+      nid_t nid;
+      uint64_t offset;
+    };
+    std::vector<moving_t> moving;
+    int fd;
+
+    {
+      std::shared_lock lock{index_mutex};
+      fd = segments.at(id).fd;
+      for (size_t i = 0; i < index.header->capacity; ++i)
+        if (auto& slot = index.slots[i]; slot.segment == id)
+          moving.push_back({slot.nid, slot.offset});
+    }
+
+    std::vector<uint8_t> data;
+
+    for (auto& i : moving) {
+      // Only we remove segments, so the fd stays good without the lock
+      record_header h;
+      if (!read_all(fd, &h, sizeof(h), i.offset) || h.magic != record_magic || h.nid != i.nid)
+        continue;
+      data.resize(h.size);
+      if (!read_all(fd, data.data(), data.size(), i.offset + sizeof(h)))
+        continue;
+
+      std::unique_lock lock{index_mutex};
+
+      // It may have expired while we weren't looking
+      auto slot = find_slot(index, i.nid);
+      if (!slot || slot->segment != id || slot->offset != i.offset)
+        continue;
+
+      auto [new_id, new_off] = append(h, data);
+      segments.at(id).live -= sizeof(h) + h.size;
+      slot->offset = new_off;
+      slot->segment = new_id;
+    }
+
+    std::unique_lock lock{index_mutex};
+    auto& seg = segments.at(id);
+    if (seg.live != 0)
+      return;
+
+    ::close(seg.fd);
+    ::unlink(segment_path(id).c_str());
+    segments.erase(id);
+  }
+
+  void backing_store::log::compact_body() {
+    std::unique_lock lock{compact_mutex};
+
+    while (compact_looping) {
+      if (compact_condvar.wait_for(lock, opts.compact_interval,
+                                   [&]() { return !compact_looping || compact_wanted; }) && !compact_looping)
+        return;
+      compact_wanted = false;
+      lock.unlock();
+
+      std::vector<uint32_t> victims;
+      {
+        std::shared_lock index_lock{index_mutex};
+        for (auto& [id, seg] : segments)
+          if (id != active && should_compact(seg))
+            victims.push_back(id);
+      }
+
+      for (auto id : victims) {
+        // A failure leaves both copies in place, so we can just try again next time
+        try { compact(id); }
+        catch (...) {}
+      }
+
+      lock.lock();
+    }
+  }
+
+  backing_store::log::log(std::string dir_, options opts_) :
+    dir{std::move(dir_)},
+    opts{opts_} {
+    if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+      throw_errno("Could not create store directory");
+
+    try {
+      open_segments();
+
+      bool clean = false;
+      try {
+        index = map_index(index_path(), 0, false);
+        clean = index.header->clean;
+      }
+      catch (...) {}
+
+      // A dirty index may point at records that never made it to disk, so we have to read them all
+      if (!clean)
+        rebuild_index();
+
+      index.header->clean = 0;
+      ::msync(index.header, sizeof(index_header), MS_SYNC);
+
+      expiry.emplace([this](auto& nids) { expire(nids); });
+
+      std::unique_lock lock{index_mutex};
+      auto now = to_seconds(clock::now());
+
+      // Work out what is still live, and pick up where expiry left off
+      for (size_t i = 0; i < index.header->capacity; ++i) {
+        auto& slot = index.slots[i];
+        if (slot.segment == 0 || slot.segment == tombstone_segment)
+          continue;
+
+        auto seg = segments.find(slot.segment);
+        if (seg == segments.end() || slot.offset + sizeof(record_header) + slot.size > seg->second.size ||
+            slot.expiry <= now) {
+          slot.segment = tombstone_segment;
+          --index.header->count;
+          continue;
+        }
+
+        seg->second.live += sizeof(record_header) + slot.size;
+        bytes_used += slot.size;
+        expiry->schedule(slot.nid, std::chrono::seconds(slot.expiry - now));
+      }
+
+      // Carry on appending to the newest segment if it has room
+      if (segments.empty() || segments.rbegin()->second.size >= opts.segment_size)
+        active = open_segment(segments.empty() ? 1 : segments.rbegin()->first + 1);
+      else
+        active = segments.rbegin()->first;
+    }
+    catch (...) {
+      expiry.reset();
+      for (auto& [id, seg] : segments)
+        ::close(seg.fd);
+      unmap_index(index);
+      throw;
+    }
+
+    compact_thread = std::thread{&log::compact_body, this};
+  }
+
+  backing_store::log::~log() {
+    {
+      std::unique_lock lock{compact_mutex};
+      compact_looping = false;
+      compact_condvar.notify_all();
+    }
+    if (compact_thread.joinable())
+      compact_thread.join();
+
+    expiry.reset();
+
+    std::unique_lock lock{index_mutex};
+
+    bool synced = true;
+    for (auto& [id, seg] : segments) {
+      synced &= ::fsync(seg.fd) == 0;
+      ::close(seg.fd);
+    }
+
+    // Only claim to be clean if everything the index points at really is on disk
+    if (synced) {
+      ::msync(index.header, index.length, MS_SYNC);
+      index.header->clean = 1;
+      ::msync(index.header, sizeof(index_header), MS_SYNC);
+    }
+
+    unmap_index(index);
+  }
+}
@@ -0,0 +1,296 @@
+#include "backing_store_sharded.hpp"
+
+#include <cstring>
+
+namespace c3::kademlia {
+  const backing_store::sharded::entry backing_store::sharded::tombstone{};
+
+  backing_store::sharded::shard::shard() :
+    current{new table{initial_capacity, 0}} {}
+
+  backing_store::sharded::shard::~shard() {
+    auto t = current.load();
+    for (size_t i = 0; i <= t->mask; ++i)
+      if (auto e = t->slots[i].load(); e && e != &tombstone)
+        delete e;
+    delete t;
+  }
+
+  backing_store::sharded::shard& backing_store::sharded::shard_of(const nid_t& nid) const {
+    size_t prefix = (size_t{nid[0]} << 8) | nid[1];
+    return shards[prefix >> (16 - shard_bits)];
+  }
+
+  size_t backing_store::sharded::hash_of(const nid_t& nid) {
+    // The first bytes pick the shard, so skip past them
+    uint64_t ret;
+    std::memcpy(&ret, nid.data() + 8, sizeof(ret));
+    return ret;
+  }
+
+  const backing_store::sharded::entry* backing_store::sharded::find(const table& t, const nid_t& nid) {
+    // There is always at least one empty slot, so this terminates
+    for (size_t i = hash_of(nid) & t.mask;; i = (i + 1) & t.mask) {
+      auto e = t.slots[i].load(std::memory_order_acquire);
+      if (!e)
+        return nullptr;
+      if (e != &tombstone && e->nid == nid)
+        return e;
+    }
+  }
+
+  bool backing_store::sharded::reserve(size_t size) {
+    if (keys_reserved.fetch_add(1) >= max_keys) {
+      --keys_reserved;
+      return false;
+    }
+    if (bytes_reserved.fetch_add(size) + size > max_size) {
+      bytes_reserved -= size;
+      --keys_reserved;
+      return false;
+    }
+    return true;
+  }
+
+  void backing_store::sharded::release(size_t size) {
+    bytes_reserved -= size;
+    --keys_reserved;
+  }
+
+  void backing_store::sharded::resize(shard& s) {
+    auto old = s.current.load(std::memory_order_relaxed);
+    size_t live = s.keys;
+    size_t capacity = old->mask + 1;
+    // If it's mostly tombstones, a rebuild at the same size is enough
+    if (live * 2 >= capacity)
+      capacity *= 2;
+
+    auto t = std::make_unique<table>(capacity, old->generation + 1);
+    for (size_t i = 0; i <= old->mask; ++i) {
+      auto e = old->slots[i].load(std::memory_order_relaxed);
+      if (!e || e == &tombstone)
+        continue;
+      size_t j = hash_of(e->nid) & t->mask;
+      while (t->slots[j].load(std::memory_order_relaxed))
+        j = (j + 1) & t->mask;
+      t->slots[j].store(e, std::memory_order_relaxed);
+    }
+
+    s.occupied = live;
+    s.current.store(t.release(), std::memory_order_release);
+    // Readers may still be probing the old table, but the entries themselves carry on living
+    epoch.retire(old);
+  }
+
+  bool backing_store::sharded::insert(const nid_t& nid, buffer b, age_t age) noexcept {
+    try {
+      // This doesn't need the shard, so we keep it out of the lock
+      auto e = std::make_unique<entry>(entry{nid, clock::now() - age, std::move(b)});
+
+      auto& sh = shard_of(nid);
+      {
+        std::unique_lock lock{sh.write_mutex};
+        auto t = sh.current.load(std::memory_order_relaxed);
+
+        // Check to see if we already have it
+        if (find(*t, nid))
+          return true;
+
+        if (!reserve(e->data.size()))
+          return false;
+
+        if ((sh.occupied + 1) * 4 > (t->mask + 1) * 3) {
+          try { resize(sh); }
+          catch (...) {
+            release(e->data.size());
+            throw;
+          }
+          t = sh.current.load(std::memory_order_relaxed);
+        }
+
+        size_t i = hash_of(nid) & t->mask;
+        while (true) {
+          auto cur = t->slots[i].load(std::memory_order_relaxed);
+          if (!cur) {
+            ++sh.occupied;
+            break;
+          }
+          if (cur == &tombstone)
+            break;
+          i = (i + 1) & t->mask;
+        }
+
+        ++sh.keys;
+        sh.bytes += e->data.size();
+        t->slots[i].store(e.release(), std::memory_order_release);
+      }
+
+      expiry.schedule(nid, tExpire);
+
+      if (epoch.backlog() > reclaim_threshold)
+        epoch.reclaim();
+
+      return true;
+    }
+    catch (...) {
+      return false;
+    }
+  }
+
+  bool backing_store::sharded::store(buffer b, age_t age) noexcept {
+    // Hashing doesn't need the shard either
+    try { return insert(compute_nid(b), std::move(b), age); }
+    catch (...) { return false; }
+  }
+
+  std::vector<bool> backing_store::sharded::store_batch(std::vector<value_t> values) noexcept {
+    std::vector<bool> ret;
+    try {
+      ret.resize(values.size(), false);
+      // Hashing them together lets big batches use a few cores
+      std::vector<span<const uint8_t>> data;
+      data.reserve(values.size());
+      for (auto& i : values)
+        data.push_back(i.dat.get());
+      auto nids = compute_nids(data);
+
+      for (size_t i = 0; i < values.size(); ++i)
+        ret[i] = insert(nids[i], std::move(values[i].dat), values[i].age);
+    }
+    catch (...) {}
+    return ret;
+  }
+
+  std::unique_ptr<backing_store::writer> backing_store::sharded::begin_store(size_t size, age_t age) noexcept {
+    if (size > max_size)
+      return nullptr;
+    return backing_store::begin_store(size, age);
+  }
+
+  std::optional<backing_store::value_t> backing_store::sharded::retrieve(nid_t nid) noexcept {
+    try {
+      auto& sh = shard_of(nid);
+      auto guard = epoch.read();
+
+      auto e = find(*sh.current.load(std::memory_order_acquire), nid);
+      if (!e)
+        return std::nullopt;
+
+      auto now = clock::now();
+      return value_t{ e->data, std::chrono::duration_cast<age_t>(now - e->birth) };
+    }
+    catch (...) {
+      return std::nullopt;
+    }
+  }
+
+  std::vector<nid_t> backing_store::sharded::get_all_keys() noexcept {
+    std::vector<nid_t> ret;
+
+    try {
+      auto guard = epoch.read();
+
+      for (size_t i = 0; i < (size_t{1} << shard_bits); ++i) {
+        auto t = shards[i].current.load(std::memory_order_acquire);
+        for (size_t j = 0; j <= t->mask; ++j)
+          if (auto e = t->slots[j].load(std::memory_order_acquire); e && e != &tombstone)
+            ret.push_back(e->nid);
+      }
+    }
+    catch (...) {}
+
+    return ret;
+  }
+
+  backing_store::scan_t backing_store::sharded::scan(cursor_t from, size_t max_items) noexcept {
+    scan_t ret{{}, from};
+    if (!max_items)
+      max_items = default_scan_batch;
+
+    try {
+      auto guard = epoch.read();
+      auto now = clock::now();
+
+      // The position is the shard in the top half, and the slot within it in the bottom
+      size_t shard_index = from.position >> 32;
+      size_t slot = from.position & UINT32_MAX;
+
+      for (; shard_index < (size_t{1} << shard_bits); ++shard_index, slot = 0) {
+        auto t = shards[shard_index].current.load(std::memory_order_acquire);
+        // The shard was resized under us, so start it again
+        if (t->generation != from.generation)
+          slot = 0;
+
+        for (; slot <= t->mask; ++slot) {
+          if (ret.items.size() == max_items) {
+            ret.next.position = (uint64_t{shard_index} << 32) | slot;
+            ret.next.generation = t->generation;
+            return ret;
+          }
+
+          auto e = t->slots[slot].load(std::memory_order_acquire);
+          if (!e || e == &tombstone)
+            continue;
+          ret.items.emplace_back(e->nid, value_t{ e->data, std::chrono::duration_cast<age_t>(now - e->birth) });
+        }
+      }
+
+      ret.next.done = true;
+    }
+    // Better to give up on this pass than to loop on the same failure forever
+    catch (...) {
+      ret.next.done = true;
+    }
+
+    return ret;
+  }
+
+  backing_store::stats_t backing_store::sharded::get_stats() noexcept {
+    stats_t ret{
+      .bytes_used = 0,
+      .bytes_max = max_size,
+      .keys_used = 0,
+      .keys_max = max_keys,
+      .keys_expiring = expiry.pending()
+    };
+
+    for (size_t i = 0; i < (size_t{1} << shard_bits); ++i) {
+      ret.bytes_used += shards[i].bytes;
+      ret.keys_used += shards[i].keys;
+    }
+
+    return ret;
+  }
+
+  void backing_store::sharded::expire(std::vector<nid_t>& nids) {
+    for (auto& nid : nids) {
+      auto& sh = shard_of(nid);
+      std::unique_lock lock{sh.write_mutex};
+      auto t = sh.current.load(std::memory_order_relaxed);
+
+      for (size_t i = hash_of(nid) & t->mask;; i = (i + 1) & t->mask) {
+        auto e = t->slots[i].load(std::memory_order_relaxed);
+        if (!e)
+          break;
+        if (e == &tombstone || e->nid != nid)
+          continue;
+
+        t->slots[i].store(&tombstone, std::memory_order_release);
+        --sh.keys;
+        sh.bytes -= e->data.size();
+        release(e->data.size());
+        epoch.retire(e);
+        break;
+      }
+    }
+
+    epoch.reclaim();
+  }
+
+  backing_store::sharded::sharded(size_t max_size, size_t max_keys, size_t shard_bits) :
+    max_size{max_size},
+    max_keys{max_keys},
+    // We only look at the first two bytes to pick a shard
+    shard_bits{shard_bits <= 16 ? shard_bits : throw std::invalid_argument("Too many shards")},
+    shards{std::make_unique<shard[]>(size_t{1} << shard_bits)} {}
+}
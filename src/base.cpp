@@ -1,42 +1,46 @@
 #include "base.hpp"
 
 #include <random>
-#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include <sstream>
 #include <iomanip>
 
 namespace c3::kademlia {
-  nid_t compute_nid(span<const uint8_t> data) {
+  void nid_hasher::update(span<const uint8_t> data) {
+    if (!::EVP_DigestUpdate(ctx.get(), data.data(), static_cast<size_t>(data.size())))
+      throw std::runtime_error("Could not hash");
+  }
+
+  nid_t nid_hasher::finish() {
     nid_t ret;
-    ::SHA256(data.data(), data.size(), ret.data());
+    if (!::EVP_DigestFinal_ex(ctx.get(), ret.data(), nullptr))
+      throw std::runtime_error("Could not hash");
     return ret;
   }
 
+  nid_hasher::nid_hasher() : ctx{::EVP_MD_CTX_new(), &::EVP_MD_CTX_free} {
+    if (!ctx || !::EVP_DigestInit_ex(ctx.get(), ::EVP_sha256(), nullptr))
+      throw std::runtime_error("Could not start hash");
+  }
+
   size_t distance(nid_t a, nid_t b) {
-    // A table will be fast and efficient
-    constexpr size_t _ffs_table[256] = {
-      8, 0, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
-      4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
-      5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-      5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
-      6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-      6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-      6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-      6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-      7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-    };
-
-    for (size_t i = 0; i < a.size(); ++i) {
-      if ((a[i] ^= b[i]) == 0) continue;
-      else return (a.size() - i - 1) * 8 + _ffs_table[a[i]];
+    for (size_t i = 0; i < a.size(); i += 8) {
+      // Big endian, so that the first byte is the most significant
+      uint64_t x = 0;
+      for (size_t j = 0; j < 8; ++j)
+        x = (x << 8) | uint8_t(a[i + j] ^ b[i + j]);
+      if (x == 0)
+        continue;
+
+#if defined(__GNUC__)
+      size_t top = 63 - static_cast<size_t>(__builtin_clzll(x));
+#else
+      size_t top = 0;
+      while (x >>= 1)
+        ++top;
+#endif
+      return (a.size() - i - 8) * 8 + top;
     }
 
     return 0;
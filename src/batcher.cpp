@@ -0,0 +1,392 @@
+#include "batcher.hpp"
+
+#include "node.hpp"
+
+#include <algorithm>
+#include <optional>
+
+namespace c3::kademlia {
+  namespace {
+    template<typename Items>
+    void fail_all(Items& batch, std::exception_ptr error) {
+      for (auto& i : batch)
+        i.cb(error, {});
+    }
+
+    /// A call sharing requests from lookups that may each give up on theirs
+    class withdrawable_call {
+    private:
+      std::mutex ctx_mutex;
+      // Only while the call is going
+      grpc::ClientContext* ctx = nullptr;
+      size_t wanted;
+      bool called_off = false;
+
+    public:
+      /// One fewer of its requests is wanted, and once none are, the call goes too
+      inline void withdraw() {
+        std::unique_lock lock{ctx_mutex};
+        if (--wanted)
+          return;
+        called_off = true;
+        if (ctx)
+          ctx->TryCancel();
+      }
+      inline void started(grpc::ClientContext& c) {
+        std::unique_lock lock{ctx_mutex};
+        ctx = &c;
+        // gRPC holds this until the call starts
+        if (called_off)
+          ctx->TryCancel();
+      }
+      /// Whether we called it off, in which case whatever went wrong was us
+      inline bool finished() {
+        std::unique_lock lock{ctx_mutex};
+        ctx = nullptr;
+        return called_off;
+      }
+
+    public:
+      inline withdrawable_call(size_t wanted) : wanted{wanted} {}
+    };
+
+    /// Fails anything in batch that has already been cancelled, and has the call withdrawn once the
+    /// rest all have been too. Null if that leaves nothing to send
+    template<typename Items>
+    std::shared_ptr<withdrawable_call> withdrawable(Items& batch) {
+      Items wanted;
+      for (auto& i : batch) {
+        if (i.cancel && i.cancel->cancelled())
+          i.cb(std::make_exception_ptr(cancelled{}), {});
+        else
+          wanted.push_back(std::move(i));
+      }
+      batch.swap(wanted);
+      if (batch.empty())
+        return nullptr;
+
+      auto ret = std::make_shared<withdrawable_call>(batch.size());
+      for (auto& i : batch)
+        if (i.cancel)
+          i.cancel->on_cancel([ret]() { ret->withdraw(); });
+      return ret;
+    }
+
+    /// Tells everyone in batch that it's going now
+    template<typename Items>
+    void mark_sent(Items& batch) {
+      for (auto& i : batch)
+        if (i.sent)
+          i.sent();
+    }
+  }
+
+  std::vector<remote_node::batcher::store_item_t> remote_node::batcher::take(lane_t<store_item_t>& lane) {
+    size_t count = 0, bytes = 0;
+    // Always take at least one, however big, so that nothing can get stuck
+    while (count < lane.waiting.size() && count < max_batch &&
+           (count == 0 || bytes + lane.waiting[count].req.data().size() <= max_batch_bytes))
+      bytes += lane.waiting[count++].req.data().size();
+
+    std::vector<store_item_t> ret{std::make_move_iterator(lane.waiting.begin()),
+                                  std::make_move_iterator(lane.waiting.begin() + static_cast<std::ptrdiff_t>(count))};
+    lane.waiting.erase(lane.waiting.begin(), lane.waiting.begin() + static_cast<std::ptrdiff_t>(count));
+    return ret;
+  }
+
+  template<typename Item>
+  std::vector<Item> remote_node::batcher::take(lane_t<Item>& lane) {
+    size_t count = std::min(lane.waiting.size(), max_batch);
+    std::vector<Item> ret{std::make_move_iterator(lane.waiting.begin()),
+                          std::make_move_iterator(lane.waiting.begin() + static_cast<std::ptrdiff_t>(count))};
+    lane.waiting.erase(lane.waiting.begin(), lane.waiting.begin() + static_cast<std::ptrdiff_t>(count));
+    return ret;
+  }
+
+  template<typename Item>
+  void remote_node::batcher::enqueue(const remote_node& peer, lane_ptr_t<Item> lane, Item item) {
+    key_t key{peer.details.location, peer.details.nid};
+    std::vector<Item> batch;
+    std::optional<remote_node> via;
+
+    {
+      std::unique_lock lock{peers_mutex};
+      auto iter = peers.find(key);
+      if (iter == peers.end())
+        iter = peers.emplace(key, peer_t{peer, {}, {}, {}}).first;
+      auto& l = iter->second.*lane;
+      l.waiting.push_back(std::move(item));
+      ++requests;
+      // It'll go when whatever is in flight comes back
+      if (l.in_flight)
+        return;
+
+      l.in_flight = true;
+      batch = take(l);
+      via = iter->second.via;
+    }
+
+    send(key, *via, std::move(batch));
+  }
+
+  template<typename Item>
+  void remote_node::batcher::next(const key_t& key, lane_ptr_t<Item> lane) {
+    std::vector<Item> batch;
+    std::optional<remote_node> via;
+
+    {
+      std::unique_lock lock{peers_mutex};
+      auto iter = peers.find(key);
+      auto& l = iter->second.*lane;
+      if (l.waiting.empty()) {
+        l.in_flight = false;
+        if (iter->second.idle())
+          peers.erase(iter);
+        return;
+      }
+
+      batch = take(l);
+      via = iter->second.via;
+    }
+
+    send(key, *via, std::move(batch));
+  }
+
+  void remote_node::batcher::send(const key_t& key, remote_node& via, std::vector<store_item_t> batch) {
+    ++calls;
+
+    proto::StoreBatchRequest req;
+    size_t bytes = 0;
+    try {
+      for (auto& i : batch) {
+        bytes += i.req.data().size();
+        // We don't need the requests any more, so there's no sense copying them again
+        req.add_values()->Swap(&i.req);
+      }
+    }
+    catch (...) {
+      fail_all(batch, std::current_exception());
+      next(key, &peer_t::stores);
+      return;
+    }
+
+    engine.unary<proto::StoreBatchResponse>(
+      [&](grpc::ClientContext& ctx, grpc::CompletionQueue* queue) {
+        via.init_ctx(ctx, bytes);
+        return via.stub->PrepareAsyncstore_batch(&ctx, req, queue);
+      },
+      [this, key, stub = via.stub, pool = &via.parent->get_channels(), batch = std::move(batch)]
+      (grpc::Status& status, grpc::ClientContext& ctx, proto::StoreBatchResponse& res) mutable {
+        try {
+          handle_status(status);
+          check_server_nid(ctx, key.second);
+          if (static_cast<size_t>(res.success_size()) != batch.size())
+            throw std::invalid_argument("Wrong number of store_batch results");
+        }
+        catch (...) {
+          pool->failed(key.first);
+          fail_all(batch, std::current_exception());
+          next(key, &peer_t::stores);
+          return;
+        }
+
+        pool->succeeded(key.first);
+        for (size_t i = 0; i < batch.size(); ++i)
+          batch[i].cb(nullptr, res.success(static_cast<int>(i)));
+        next(key, &peer_t::stores);
+      });
+  }
+
+  void remote_node::batcher::send(const key_t& key, remote_node& via, std::vector<find_node_item_t> batch) {
+    auto call = withdrawable(batch);
+    if (!call) {
+      next(key, &peer_t::node_finds);
+      return;
+    }
+    ++calls;
+
+    proto::FindBatchRequest req;
+    for (auto& i : batch)
+      req.add_nids(i.nid.data(), i.nid.size());
+
+    mark_sent(batch);
+    engine.unary<proto::FindNodeBatchResponse>(
+      [&](grpc::ClientContext& ctx, grpc::CompletionQueue* queue) {
+        via.init_ctx(ctx);
+        call->started(ctx);
+        return via.stub->PrepareAsyncfind_node_batch(&ctx, req, queue);
+      },
+      [this, key, stub = via.stub, pool = &via.parent->get_channels(), our_nid = via.parent->get_nid(),
+       batch = std::move(batch), call]
+      (grpc::Status& status, grpc::ClientContext& ctx, proto::FindNodeBatchResponse& res) mutable {
+        // Nobody wanted it, so it says nothing about the peer. If it came back anyway, it's still good
+        if (call->finished() && !status.ok()) {
+          fail_all(batch, std::make_exception_ptr(cancelled{}));
+          next(key, &peer_t::node_finds);
+          return;
+        }
+        try {
+          handle_status(status);
+          check_server_nid(ctx, key.second);
+          if (static_cast<size_t>(res.results_size()) != batch.size())
+            throw std::invalid_argument("Wrong number of find_node_batch results");
+        }
+        catch (...) {
+          pool->failed(key.first);
+          fail_all(batch, std::current_exception());
+          next(key, &peer_t::node_finds);
+          return;
+        }
+
+        pool->succeeded(key.first);
+        // One bad answer only spoils its own request
+        for (size_t i = 0; i < batch.size(); ++i) {
+          std::vector<contact> found;
+          try { found = parse_contacts(res.results(static_cast<int>(i)), our_nid); }
+          catch (...) {
+            batch[i].cb(std::current_exception(), {});
+            continue;
+          }
+          batch[i].cb(nullptr, std::move(found));
+        }
+        next(key, &peer_t::node_finds);
+      });
+  }
+
+  void remote_node::batcher::send(const key_t& key, remote_node& via, std::vector<find_value_item_t> batch) {
+    auto call = withdrawable(batch);
+    if (!call) {
+      next(key, &peer_t::value_finds);
+      return;
+    }
+    ++calls;
+
+    proto::FindBatchRequest req;
+    for (auto& i : batch)
+      req.add_nids(i.nid.data(), i.nid.size());
+
+    mark_sent(batch);
+    engine.unary<proto::FindValueBatchResponse>(
+      [&](grpc::ClientContext& ctx, grpc::CompletionQueue* queue) {
+        via.init_ctx(ctx);
+        call->started(ctx);
+        return via.stub->PrepareAsyncfind_value_batch(&ctx, req, queue);
+      },
+      [this, key, stub = via.stub, pool = &via.parent->get_channels(), our_nid = via.parent->get_nid(),
+       batch = std::move(batch), call]
+      (grpc::Status& status, grpc::ClientContext& ctx, proto::FindValueBatchResponse& res) mutable {
+        // Nobody wanted it, so it says nothing about the peer. If it came back anyway, it's still good
+        if (call->finished() && !status.ok()) {
+          fail_all(batch, std::make_exception_ptr(cancelled{}));
+          next(key, &peer_t::value_finds);
+          return;
+        }
+        try {
+          handle_status(status);
+          check_server_nid(ctx, key.second);
+          if (static_cast<size_t>(res.results_size()) != batch.size())
+            throw std::invalid_argument("Wrong number of find_value_batch results");
+        }
+        catch (...) {
+          pool->failed(key.first);
+          fail_all(batch, std::current_exception());
+          next(key, &peer_t::value_finds);
+          return;
+        }
+
+        pool->succeeded(key.first);
+        for (size_t i = 0; i < batch.size(); ++i) {
+          value_result_t found;
+          try { found = parse_value(*res.mutable_results(static_cast<int>(i)), our_nid); }
+          catch (...) {
+            batch[i].cb(std::current_exception(), {});
+            continue;
+          }
+          batch[i].cb(nullptr, std::move(found));
+        }
+        next(key, &peer_t::value_finds);
+      });
+  }
+
+  void remote_node::batcher::store(const remote_node& peer, span<const uint8_t> data, age_t age,
+                                   callback_t<bool> cb) {
+    // Too big to share a message with anything, so it may as well go now
+    if (static_cast<size_t>(data.size()) > stream_threshold) {
+      std::unique_lock lock{streams_mutex};
+      // Nobody waits on these, so the finished ones are cleared out as new ones come along
+      streams.erase(std::remove_if(streams.begin(), streams.end(), [](auto& i) {
+        return i.wait_for(std::chrono::seconds{0}) == std::future_status::ready;
+      }), streams.end());
+      streams.push_back(std::async(std::launch::async, [peer, data, age, cb = std::move(cb)]() {
+        bool ret;
+        try { ret = remote_node{peer}.store_stream(data, age); }
+        catch (...) {
+          cb(std::current_exception(), false);
+          return;
+        }
+        cb(nullptr, ret);
+      }));
+      return;
+    }
+
+    store_item_t item{{}, std::move(cb)};
+    item.req.set_data(data.data(), static_cast<size_t>(data.size()));
+    item.req.set_age(age.count());
+    enqueue(peer, &peer_t::stores, std::move(item));
+  }
+
+  void remote_node::batcher::cache(const remote_node& peer, span<const uint8_t> data, std::chrono::seconds ttl,
+                                   callback_t<bool> cb) {
+    if (static_cast<size_t>(data.size()) > stream_threshold) {
+      cb(std::make_exception_ptr(std::invalid_argument("Too big to cache")), false);
+      return;
+    }
+
+    store_item_t item{{}, std::move(cb)};
+    item.req.set_data(data.data(), static_cast<size_t>(data.size()));
+    item.req.set_cache_ttl(static_cast<uint64_t>(std::max<int64_t>(ttl.count(), 1)));
+    enqueue(peer, &peer_t::stores, std::move(item));
+  }
+
+  void remote_node::batcher::find_node(const remote_node& peer, nid_t nid, callback_t<std::vector<contact>> cb,
+                                       std::shared_ptr<cancellation> cancel, std::function<void()> sent) {
+    if (cancel && cancel->cancelled()) {
+      cb(std::make_exception_ptr(cancelled{}), {});
+      return;
+    }
+    enqueue(peer, &peer_t::node_finds, find_node_item_t{nid, std::move(cb), std::move(cancel), std::move(sent)});
+  }
+
+  void remote_node::batcher::find_value(const remote_node& peer, nid_t nid, callback_t<value_result_t> cb,
+                                        std::shared_ptr<cancellation> cancel, std::function<void()> sent) {
+    if (cancel && cancel->cancelled()) {
+      cb(std::make_exception_ptr(cancelled{}), {});
+      return;
+    }
+    enqueue(peer, &peer_t::value_finds, find_value_item_t{nid, std::move(cb), std::move(cancel), std::move(sent)});
+  }
+
+  remote_node::batcher::stats_t remote_node::batcher::get_stats() const {
+    return { calls, requests };
+  }
+
+  remote_node::batcher::batcher(rpc_engine& engine) : engine{engine} {}
+
+  void remote_node::store(batcher& via, span<const uint8_t> data, age_t age, callback_t<bool> cb) {
+    via.store(*this, data, age, std::move(cb));
+  }
+
+  void remote_node::cache(batcher& via, span<const uint8_t> data, std::chrono::seconds ttl, callback_t<bool> cb) {
+    via.cache(*this, data, ttl, std::move(cb));
+  }
+
+  void remote_node::find_node(batcher& via, nid_t nid, callback_t<std::vector<contact>> cb,
+                              std::shared_ptr<cancellation> cancel, std::function<void()> sent) {
+    via.find_node(*this, nid, std::move(cb), std::move(cancel), std::move(sent));
+  }
+
+  void remote_node::find_value(batcher& via, nid_t nid, callback_t<value_result_t> cb,
+                               std::shared_ptr<cancellation> cancel, std::function<void()> sent) {
+    via.find_value(*this, nid, std::move(cb), std::move(cancel), std::move(sent));
+  }
+}
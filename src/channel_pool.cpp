@@ -0,0 +1,78 @@
+#include "channel_pool.hpp"
+
+namespace c3::kademlia {
+  void channel_pool::evict(clock::time_point now) {
+    while (!lru.empty()) {
+      auto& oldest = channels.at(lru.back());
+      if (channels.size() <= max_channels && now - oldest.last_used < idle_timeout)
+        break;
+
+      // Anyone still holding the channel keeps it open until they're done
+      channels.erase(lru.back());
+      lru.pop_back();
+      ++evictions;
+    }
+  }
+
+  channel_pool::entry_t channel_pool::get(const std::string& location) {
+    auto now = clock::now();
+    std::unique_lock lock{channels_mutex};
+
+    if (auto iter = channels.find(location); iter != channels.end()) {
+      auto& slot = iter->second;
+      slot.last_used = now;
+      lru.splice(lru.begin(), lru, slot.lru_pos);
+      ++hits;
+      return slot.entry;
+    }
+
+    ++misses;
+    auto channel = grpc::CreateChannel(location, grpc::InsecureChannelCredentials());
+    entry_t entry{channel, proto::Kademlia::NewStub(channel)};
+
+    lru.push_front(location);
+    try {
+      channels.emplace(location, slot_t{entry, now, {}, lru.begin()});
+    }
+    catch (...) {
+      lru.pop_front();
+      throw;
+    }
+    evict(now);
+
+    return entry;
+  }
+
+  void channel_pool::succeeded(const std::string& location) {
+    auto now = clock::now();
+    std::unique_lock lock{channels_mutex};
+    if (auto iter = channels.find(location); iter != channels.end())
+      iter->second.last_success = now;
+  }
+
+  void channel_pool::failed(const std::string& location) {
+    std::unique_lock lock{channels_mutex};
+    if (auto iter = channels.find(location); iter != channels.end())
+      iter->second.last_success = {};
+  }
+
+  bool channel_pool::alive(const std::string& location) const {
+    auto now = clock::now();
+    std::unique_lock lock{channels_mutex};
+    auto iter = channels.find(location);
+    return iter != channels.end() && iter->second.last_success != clock::time_point{} &&
+           now - iter->second.last_success < liveness_window;
+  }
+
+  channel_pool::stats_t channel_pool::get_stats() const {
+    size_t open;
+    {
+      std::unique_lock lock{channels_mutex};
+      open = channels.size();
+    }
+    return { open, hits, misses, evictions };
+  }
+
+  channel_pool::channel_pool(size_t max_channels, clock::duration idle_timeout, clock::duration liveness_window) :
+    max_channels{max_channels}, idle_timeout{idle_timeout}, liveness_window{liveness_window} {}
+}
@@ -0,0 +1,113 @@
+#include "datagram.hpp"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace c3::kademlia {
+  namespace {
+    /// Splits off the port, and the brackets and gRPC scheme around the host
+    std::pair<std::string, std::string> split_location(std::string_view location) {
+      for (std::string_view scheme : { "ipv4:", "ipv6:" })
+        if (location.substr(0, scheme.size()) == scheme)
+          location.remove_prefix(scheme.size());
+
+      auto pos = location.find_last_of(':');
+      if (pos == std::string_view::npos)
+        throw std::invalid_argument("No port found on location");
+
+      auto host = location.substr(0, pos);
+      if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+      return { std::string{host}, std::string{location.substr(pos + 1)} };
+    }
+
+    addrinfo* lookup(const std::string& host, const std::string& port, int flags) {
+      addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_DGRAM;
+      hints.ai_flags = flags | AI_NUMERICSERV;
+
+      addrinfo* ret = nullptr;
+      if (int err = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &ret); err != 0)
+        throw std::runtime_error(std::string{"Could not resolve location: "} + ::gai_strerror(err));
+      return ret;
+    }
+  }
+
+  udp_socket::address_t udp_socket::resolve(std::string_view location) {
+    auto [host, port] = split_location(location);
+    auto found = lookup(host, port, 0);
+
+    address_t ret;
+    ret.length = static_cast<uint32_t>(std::min<size_t>(found->ai_addrlen, ret.storage.size()));
+    std::memcpy(ret.storage.data(), found->ai_addr, ret.length);
+    ::freeaddrinfo(found);
+    return ret;
+  }
+
+  std::string udp_socket::describe(const address_t& addr) {
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    auto sa = reinterpret_cast<const sockaddr*>(addr.storage.data());
+    if (::getnameinfo(sa, addr.length, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+      throw std::invalid_argument("Unknown address");
+
+    if (sa->sa_family == AF_INET6)
+      return std::string{"ipv6:["} + host + "]:" + port;
+    return std::string{"ipv4:"} + host + ":" + port;
+  }
+
+  void udp_socket::send(const address_t& to, span<const uint8_t> data) {
+    // Lost datagrams are dealt with by whoever sent them, so there's nothing more to do on failure
+    ::sendto(static_cast<int>(fd), data.data(), static_cast<size_t>(data.size()), 0,
+             reinterpret_cast<const sockaddr*>(to.storage.data()), to.length);
+  }
+
+  std::optional<size_t> udp_socket::receive(span<uint8_t> buf, address_t& from, std::chrono::milliseconds timeout) {
+    pollfd p = {};
+    p.fd = static_cast<int>(fd);
+    p.events = POLLIN;
+    if (::poll(&p, 1, static_cast<int>(timeout.count())) <= 0)
+      return std::nullopt;
+
+    socklen_t len = from.storage.size();
+    auto n = ::recvfrom(static_cast<int>(fd), buf.data(), static_cast<size_t>(buf.size()), 0,
+                        reinterpret_cast<sockaddr*>(from.storage.data()), &len);
+    if (n < 0)
+      return std::nullopt;
+    from.length = static_cast<uint32_t>(len);
+    return static_cast<size_t>(n);
+  }
+
+  udp_socket::udp_socket(std::string_view host, uint16_t port) {
+    auto [bare_host, ignored] = split_location(std::string{host} + ":0");
+    auto found = lookup(bare_host, std::to_string(port), AI_PASSIVE);
+
+    int s = ::socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    if (s < 0) {
+      ::freeaddrinfo(found);
+      throw std::system_error(errno, std::generic_category(), "Could not open datagram socket");
+    }
+    if (::bind(s, found->ai_addr, found->ai_addrlen) != 0) {
+      int err = errno;
+      ::close(s);
+      ::freeaddrinfo(found);
+      throw std::system_error(err, std::generic_category(), "Could not bind datagram socket");
+    }
+    ::freeaddrinfo(found);
+    fd = s;
+  }
+
+  udp_socket::~udp_socket() {
+    if (fd >= 0)
+      ::close(static_cast<int>(fd));
+  }
+}
@@ -0,0 +1,139 @@
+#include "datagram.hpp"
+
+// Otherwise windows.h takes std::min from us
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+
+#include <cstring>
+#include <system_error>
+
+namespace c3::kademlia {
+  namespace {
+    /// Winsock wants starting before anything else, and then only the once
+    struct winsock_t {
+      winsock_t() {
+        WSADATA data;
+        if (int err = ::WSAStartup(MAKEWORD(2, 2), &data); err != 0)
+          throw std::system_error(err, std::system_category(), "Could not start Winsock");
+      }
+      ~winsock_t() { ::WSACleanup(); }
+    };
+
+    void start_winsock() {
+      static winsock_t winsock;
+    }
+
+    /// Splits off the port, and the brackets and gRPC scheme around the host
+    std::pair<std::string, std::string> split_location(std::string_view location) {
+      for (std::string_view scheme : { "ipv4:", "ipv6:" })
+        if (location.substr(0, scheme.size()) == scheme)
+          location.remove_prefix(scheme.size());
+
+      auto pos = location.find_last_of(':');
+      if (pos == std::string_view::npos)
+        throw std::invalid_argument("No port found on location");
+
+      auto host = location.substr(0, pos);
+      if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+      return { std::string{host}, std::string{location.substr(pos + 1)} };
+    }
+
+    addrinfo* lookup(const std::string& host, const std::string& port, int flags) {
+      start_winsock();
+
+      addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_DGRAM;
+      hints.ai_flags = flags | AI_NUMERICSERV;
+
+      addrinfo* ret = nullptr;
+      if (int err = ::getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &ret); err != 0)
+        throw std::runtime_error(std::string{"Could not resolve location: "} + ::gai_strerrorA(err));
+      return ret;
+    }
+  }
+
+  udp_socket::address_t udp_socket::resolve(std::string_view location) {
+    auto [host, port] = split_location(location);
+    auto found = lookup(host, port, 0);
+
+    address_t ret;
+    ret.length = static_cast<uint32_t>(std::min<size_t>(found->ai_addrlen, ret.storage.size()));
+    std::memcpy(ret.storage.data(), found->ai_addr, ret.length);
+    ::freeaddrinfo(found);
+    return ret;
+  }
+
+  std::string udp_socket::describe(const address_t& addr) {
+    start_winsock();
+
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    auto sa = reinterpret_cast<const sockaddr*>(addr.storage.data());
+    if (::getnameinfo(sa, static_cast<socklen_t>(addr.length), host, sizeof(host), port, sizeof(port),
+                      NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+      throw std::invalid_argument("Unknown address");
+
+    if (sa->sa_family == AF_INET6)
+      return std::string{"ipv6:["} + host + "]:" + port;
+    return std::string{"ipv4:"} + host + ":" + port;
+  }
+
+  void udp_socket::send(const address_t& to, span<const uint8_t> data) {
+    // Lost datagrams are dealt with by whoever sent them, so there's nothing more to do on failure
+    ::sendto(static_cast<SOCKET>(fd), reinterpret_cast<const char*>(data.data()), static_cast<int>(data.size()), 0,
+             reinterpret_cast<const sockaddr*>(to.storage.data()), static_cast<int>(to.length));
+  }
+
+  std::optional<size_t> udp_socket::receive(span<uint8_t> buf, address_t& from, std::chrono::milliseconds timeout) {
+    WSAPOLLFD p = {};
+    p.fd = static_cast<SOCKET>(fd);
+    p.events = POLLRDNORM;
+    if (::WSAPoll(&p, 1, static_cast<INT>(timeout.count())) <= 0)
+      return std::nullopt;
+
+    int len = static_cast<int>(from.storage.size());
+    auto n = ::recvfrom(static_cast<SOCKET>(fd), reinterpret_cast<char*>(buf.data()), static_cast<int>(buf.size()), 0,
+                        reinterpret_cast<sockaddr*>(from.storage.data()), &len);
+    if (n == SOCKET_ERROR)
+      return std::nullopt;
+    from.length = static_cast<uint32_t>(len);
+    return static_cast<size_t>(n);
+  }
+
+  udp_socket::udp_socket(std::string_view host, uint16_t port) {
+    auto [bare_host, ignored] = split_location(std::string{host} + ":0");
+    auto found = lookup(bare_host, std::to_string(port), AI_PASSIVE);
+
+    SOCKET s = ::socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    if (s == INVALID_SOCKET) {
+      int err = ::WSAGetLastError();
+      ::freeaddrinfo(found);
+      throw std::system_error(err, std::system_category(), "Could not open datagram socket");
+    }
+    if (::bind(s, found->ai_addr, static_cast<int>(found->ai_addrlen)) != 0) {
+      int err = ::WSAGetLastError();
+      ::closesocket(s);
+      ::freeaddrinfo(found);
+      throw std::system_error(err, std::system_category(), "Could not bind datagram socket");
+    }
+    ::freeaddrinfo(found);
+
+    // Otherwise a port unreachable from anyone we sent to fails our next receive, whoever it's from
+    BOOL report = FALSE;
+    DWORD ignored_bytes = 0;
+    ::WSAIoctl(s, SIO_UDP_CONNRESET, &report, sizeof(report), nullptr, 0, &ignored_bytes, nullptr, nullptr);
+
+    fd = static_cast<intptr_t>(s);
+  }
+
+  udp_socket::~udp_socket() {
+    if (static_cast<SOCKET>(fd) != INVALID_SOCKET)
+      ::closesocket(static_cast<SOCKET>(fd));
+  }
+}
@@ -0,0 +1,423 @@
+#include "datagram.hpp"
+
+#include <future>
+#include <limits>
+#include <random>
+
+namespace c3::kademlia {
+  namespace {
+    constexpr uint8_t datagram_version = 2;
+    constexpr size_t max_unreachable = 4096;
+    constexpr size_t max_cookies = 4096;
+    // Where the cookie sits in the header, so a request can be given one without encoding it again
+    constexpr size_t cookie_offset = 8;
+
+    template<typename T>
+    void set_int(std::vector<uint8_t>& out, size_t pos, T val) {
+      for (size_t i = sizeof(T); i > 0; --i)
+        out[pos++] = static_cast<uint8_t>(val >> ((i - 1) * 8));
+    }
+
+    nid_t random_secret() {
+      std::random_device rd;
+      nid_t ret;
+      for (auto& i : ret)
+        i = static_cast<uint8_t>(rd());
+      return ret;
+    }
+
+    template<typename T>
+    void put_int(std::vector<uint8_t>& out, T val) {
+      for (size_t i = sizeof(T); i > 0; --i)
+        out.push_back(static_cast<uint8_t>(val >> ((i - 1) * 8)));
+    }
+
+    /// Reads through a packet, throwing if anything runs off the end
+    class reader {
+    private:
+      span<const uint8_t> data;
+      size_t pos = 0;
+
+    public:
+      inline size_t remaining() const { return static_cast<size_t>(data.size()) - pos; }
+
+      inline span<const uint8_t> take(size_t len) {
+        if (len > remaining())
+          throw std::invalid_argument("Datagram too short");
+        auto ret = data.subspan(fix_gsl_bs(pos), fix_gsl_bs(len));
+        pos += len;
+        return ret;
+      }
+      template<typename T>
+      inline T get_int() {
+        T ret = 0;
+        for (auto i : take(sizeof(T)))
+          ret = static_cast<T>((ret << 8) | i);
+        return ret;
+      }
+      inline nid_t get_nid() {
+        auto bytes = take(std::tuple_size_v<nid_t>);
+        nid_t ret;
+        std::copy(bytes.begin(), bytes.end(), ret.begin());
+        return ret;
+      }
+
+    public:
+      inline reader(span<const uint8_t> data) : data{data} {}
+    };
+  }
+
+  std::vector<uint8_t> datagram_transport::encode(const message_t& msg) {
+    std::vector<uint8_t> ret;
+    ret.reserve(max_datagram);
+
+    ret.push_back('K');
+    ret.push_back('D');
+    ret.push_back(datagram_version);
+    ret.push_back(static_cast<uint8_t>(msg.kind));
+    put_int<uint32_t>(ret, msg.id);
+    put_int<uint64_t>(ret, msg.cookie);
+    ret.insert(ret.end(), msg.sender.begin(), msg.sender.end());
+    put_int<uint16_t>(ret, msg.port);
+
+    switch (msg.kind) {
+      case kind_t::ping:
+      case kind_t::pong:
+      case kind_t::retry:
+        break;
+      case kind_t::find_node:
+      case kind_t::find_value:
+        ret.insert(ret.end(), msg.target.begin(), msg.target.end());
+        break;
+      case kind_t::nodes: {
+        auto count_pos = ret.size();
+        ret.push_back(0);
+        uint8_t count = 0;
+        // Whoever doesn't fit is left out, as the closest come first
+        for (auto& i : msg.contacts) {
+          if (i.location.size() > std::numeric_limits<uint8_t>::max())
+            continue;
+          if (ret.size() + i.nid.size() + 1 + i.location.size() > max_datagram || count == k)
+            break;
+          ret.insert(ret.end(), i.nid.begin(), i.nid.end());
+          ret.push_back(static_cast<uint8_t>(i.location.size()));
+          ret.insert(ret.end(), i.location.begin(), i.location.end());
+          ++count;
+        }
+        ret[count_pos] = count;
+      } break;
+      case kind_t::value:
+        if (ret.size() + msg.value.size() > max_datagram)
+          throw std::invalid_argument("Value too big for a datagram");
+        ret.insert(ret.end(), msg.value.begin(), msg.value.end());
+        break;
+      case kind_t::large_value:
+        put_int<uint64_t>(ret, msg.size);
+        break;
+      default:
+        throw std::invalid_argument("Unknown datagram kind");
+    }
+
+    return ret;
+  }
+
+  datagram_transport::message_t datagram_transport::decode(span<const uint8_t> packet) {
+    reader r{packet};
+    auto magic = r.take(2);
+    if (magic[0] != 'K' || magic[1] != 'D')
+      throw std::invalid_argument("Not one of our datagrams");
+    if (r.get_int<uint8_t>() != datagram_version)
+      throw std::invalid_argument("Unknown datagram version");
+
+    message_t ret;
+    ret.kind = static_cast<kind_t>(r.get_int<uint8_t>());
+    ret.id = r.get_int<uint32_t>();
+    ret.cookie = r.get_int<uint64_t>();
+    ret.sender = r.get_nid();
+    ret.port = r.get_int<uint16_t>();
+
+    switch (ret.kind) {
+      case kind_t::ping:
+      case kind_t::pong:
+      case kind_t::retry:
+        break;
+      case kind_t::find_node:
+      case kind_t::find_value:
+        ret.target = r.get_nid();
+        break;
+      case kind_t::nodes: {
+        size_t count = r.get_int<uint8_t>();
+        if (count > k)
+          throw std::invalid_argument("Too many found nodes");
+        ret.contacts.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+          auto nid = r.get_nid();
+          auto location = r.take(r.get_int<uint8_t>());
+          ret.contacts.push_back({nid, {location.begin(), location.end()}});
+        }
+      } break;
+      case kind_t::value:
+        ret.value = buffer::copy(r.take(r.remaining()));
+        break;
+      case kind_t::large_value:
+        ret.size = r.get_int<uint64_t>();
+        break;
+      default:
+        throw std::invalid_argument("Unknown datagram kind");
+    }
+
+    if (r.remaining() != 0)
+      throw std::invalid_argument("Trailing bytes in datagram");
+
+    return ret;
+  }
+
+  void datagram_transport::request(const std::string& location, message_t msg,
+                                   std::chrono::milliseconds timeout, callback_t cb) {
+    pending_t p;
+    try { p.to = udp_socket::resolve(location); }
+    catch (...) {
+      cb(std::current_exception(), {});
+      return;
+    }
+    p.interval = std::max<std::chrono::milliseconds>(timeout / static_cast<int>(attempts), std::chrono::milliseconds{1});
+    p.location = location;
+    p.cb = std::move(cb);
+
+    msg.sender = our_nid;
+    msg.port = our_port;
+
+    auto to = p.to;
+    std::vector<uint8_t> packet;
+    {
+      std::unique_lock lock{pending_mutex};
+      // Random, so that nobody who can't see what we send can guess one to answer
+      do
+        msg.id = static_cast<uint32_t>(id_rng());
+      while (pending.count(msg.id));
+      if (auto iter = cookies.find(location); iter != cookies.end())
+        msg.cookie = iter->second;
+      packet = encode(msg);
+      p.packet = packet;
+      p.next_send = std::chrono::steady_clock::now() + p.interval;
+      pending.emplace(msg.id, std::move(p));
+    }
+
+    ++requests;
+    socket.send(to, packet);
+  }
+
+  datagram_transport::message_t datagram_transport::request(const std::string& location, message_t msg,
+                                                            std::chrono::milliseconds timeout) {
+    std::promise<message_t> reply;
+    auto ret = reply.get_future();
+    request(location, std::move(msg), timeout, [&reply](std::exception_ptr error, message_t res) {
+      if (error)
+        reply.set_exception(error);
+      else
+        reply.set_value(std::move(res));
+    });
+    return ret.get();
+  }
+
+  bool datagram_transport::reachable(const std::string& location) {
+    std::unique_lock lock{pending_mutex};
+    auto iter = unreachable.find(location);
+    if (iter == unreachable.end())
+      return true;
+    if (iter->second > std::chrono::steady_clock::now())
+      return false;
+    unreachable.erase(iter);
+    return true;
+  }
+
+  void datagram_transport::mark_unreachable(const std::string& location) {
+    auto now = std::chrono::steady_clock::now();
+    std::unique_lock lock{pending_mutex};
+    if (unreachable.size() >= max_unreachable) {
+      for (auto i = unreachable.begin(); i != unreachable.end();)
+        i = i->second > now ? std::next(i) : unreachable.erase(i);
+      // They'll just have to time out again
+      if (unreachable.size() >= max_unreachable)
+        unreachable.clear();
+    }
+    unreachable[location] = now + unreachable_for;
+  }
+
+  datagram_transport::stats_t datagram_transport::get_stats() const {
+    return { requests, retransmits, timeouts, served, retries };
+  }
+
+  std::chrono::milliseconds datagram_transport::tick() {
+    auto now = std::chrono::steady_clock::now();
+    auto wait = std::chrono::milliseconds{100};
+    std::vector<callback_t> failed;
+    {
+      std::unique_lock lock{pending_mutex};
+      for (auto i = pending.begin(); i != pending.end();) {
+        auto& p = i->second;
+        if (p.next_send <= now) {
+          if (p.sends == attempts) {
+            failed.push_back(std::move(p.cb));
+            i = pending.erase(i);
+            continue;
+          }
+          socket.send(p.to, p.packet);
+          ++p.sends;
+          ++retransmits;
+          p.next_send = now + p.interval;
+        }
+        wait = std::min(wait, std::chrono::duration_cast<std::chrono::milliseconds>(p.next_send - now));
+        ++i;
+      }
+    }
+
+    for (auto& i : failed) {
+      ++timeouts;
+      try { i(std::make_exception_ptr(timed_out{}), {}); }
+      catch (...) {}
+    }
+
+    return std::max(wait, std::chrono::milliseconds{1});
+  }
+
+  uint64_t datagram_transport::make_cookie(const nid_t& key, const udp_socket::address_t& addr) const {
+    nid_hasher h;
+    h.update({key.data(), fix_gsl_bs(key.size())});
+    h.update({addr.storage.data(), fix_gsl_bs(addr.length)});
+    auto digest = h.finish();
+
+    uint64_t ret = 0;
+    for (size_t i = 0; i < sizeof(ret); ++i)
+      ret = (ret << 8) | digest[i];
+    // Zero is what a request with no cookie carries
+    return ret ? ret : 1;
+  }
+
+  void datagram_transport::serve(message_t& req, const udp_socket::address_t& from, size_t request_size) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - secret_changed >= cookie_lifetime) {
+      old_secret = secret;
+      secret = random_secret();
+      secret_changed = now;
+    }
+
+    message_t reply;
+    try {
+      reply.cookie = make_cookie(secret, from);
+      req.verified = req.cookie == reply.cookie || (req.cookie && req.cookie == make_cookie(old_secret, from));
+
+      // A pong is no bigger than the ping, so that much we'll answer anyone
+      if (!req.verified && req.kind != kind_t::ping) {
+        reply.kind = kind_t::retry;
+        ++retries;
+      }
+      else if (!handler(req, reply))
+        return;
+      reply.id = req.id;
+      reply.sender = our_nid;
+      reply.port = our_port;
+
+      auto packet = encode(reply);
+      if (!req.verified && packet.size() > request_size)
+        return;
+      socket.send(from, packet);
+      ++served;
+    }
+    catch (...) {}
+  }
+
+  void datagram_transport::take_reply(message_t reply, const udp_socket::address_t& from) {
+    callback_t cb;
+    {
+      std::unique_lock lock{pending_mutex};
+      auto iter = pending.find(reply.id);
+      // Anyone can send us anything, so it has to have come from who we asked
+      if (iter == pending.end() || !(iter->second.to == from))
+        return;
+      auto& p = iter->second;
+
+      if (reply.cookie) {
+        if (cookies.size() >= max_cookies && !cookies.count(p.location))
+          cookies.clear();
+        cookies[p.location] = reply.cookie;
+      }
+
+      if (reply.kind == kind_t::retry) {
+        // Once is enough; if they still don't believe us, we let it time out
+        if (p.retried || !reply.cookie)
+          return;
+        p.retried = true;
+        set_int<uint64_t>(p.packet, cookie_offset, reply.cookie);
+        p.next_send = std::chrono::steady_clock::now() + p.interval;
+        socket.send(p.to, p.packet);
+        return;
+      }
+
+      cb = std::move(p.cb);
+      pending.erase(iter);
+    }
+    try { cb(nullptr, std::move(reply)); }
+    catch (...) {}
+  }
+
+  void datagram_transport::receive_body() {
+    // One more than we'd ever send, so that anything bigger shows up as too big
+    std::vector<uint8_t> buf(max_datagram + 1);
+    while (!die) {
+      auto wait = tick();
+
+      udp_socket::address_t from;
+      auto got = socket.receive({buf.data(), fix_gsl_bs(buf.size())}, from, wait);
+      if (!got || *got > max_datagram)
+        continue;
+
+      message_t msg;
+      try {
+        msg = decode({buf.data(), fix_gsl_bs(*got)});
+        msg.from = udp_socket::describe(from);
+      }
+      catch (...) { continue; }
+
+      switch (msg.kind) {
+        case kind_t::ping:
+        case kind_t::find_node:
+        case kind_t::find_value:
+          serve(msg, from, *got);
+          break;
+        default:
+          take_reply(std::move(msg), from);
+          break;
+      }
+    }
+  }
+
+  datagram_transport::datagram_transport(std::string_view host, uint16_t port, nid_t our_nid, handler_t handler,
+                                         std::chrono::steady_clock::duration unreachable_for) :
+    socket{host, port},
+    our_nid{our_nid},
+    our_port{port},
+    handler{std::move(handler)},
+    unreachable_for{unreachable_for},
+    id_rng{std::random_device{}()},
+    secret{random_secret()},
+    old_secret{random_secret()},
+    secret_changed{std::chrono::steady_clock::now()},
+    receive_thread{&datagram_transport::receive_body, this} {}
+
+  datagram_transport::~datagram_transport() {
+    die = true;
+    if (receive_thread.joinable())
+      receive_thread.join();
+
+    std::unordered_map<uint32_t, pending_t> left;
+    {
+      std::unique_lock lock{pending_mutex};
+      left.swap(pending);
+    }
+    for (auto& i : left) {
+      try { i.second.cb(std::make_exception_ptr(std::runtime_error("Shutting down")), {}); }
+      catch (...) {}
+    }
+  }
+}
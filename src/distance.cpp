@@ -0,0 +1,89 @@
+#include "base.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define C3_KADEMLIA_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace c3::kademlia {
+  namespace {
+    void distance_keys_scalar(const nid_t& target, const nid_t* nids, size_t count, distance_key* out) {
+      for (size_t n = 0; n < count; ++n) {
+        for (size_t i = 0; i < out[n].size(); ++i) {
+          uint64_t word = 0;
+          for (size_t j = 0; j < 8; ++j)
+            word = (word << 8) | uint8_t(nids[n][i * 8 + j] ^ target[i * 8 + j]);
+          out[n][i] = word;
+        }
+      }
+    }
+
+#ifdef C3_KADEMLIA_X86_KERNELS
+    // Reverses the bytes of each 64 bit word, as x86 is little endian and nids are big endian
+    #define C3_KADEMLIA_BSWAP64_MASK 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+    __attribute__((target("avx2")))
+    void distance_keys_avx2(const nid_t& target, const nid_t* nids, size_t count, distance_key* out) {
+      // One nid is exactly one register
+      static_assert(sizeof(nid_t) == sizeof(__m256i) && sizeof(distance_key) == sizeof(__m256i));
+
+      const auto t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(target.data()));
+      const auto swap = _mm256_setr_epi8(C3_KADEMLIA_BSWAP64_MASK, C3_KADEMLIA_BSWAP64_MASK);
+      for (size_t n = 0; n < count; ++n) {
+        auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(nids[n].data()));
+        x = _mm256_shuffle_epi8(_mm256_xor_si256(x, t), swap);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out[n].data()), x);
+      }
+    }
+
+    __attribute__((target("ssse3")))
+    void distance_keys_ssse3(const nid_t& target, const nid_t* nids, size_t count, distance_key* out) {
+      const auto t_lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target.data()));
+      const auto t_hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target.data() + 16));
+      const auto swap = _mm_setr_epi8(C3_KADEMLIA_BSWAP64_MASK);
+      for (size_t n = 0; n < count; ++n) {
+        auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nids[n].data()));
+        auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nids[n].data() + 16));
+        lo = _mm_shuffle_epi8(_mm_xor_si128(lo, t_lo), swap);
+        hi = _mm_shuffle_epi8(_mm_xor_si128(hi, t_hi), swap);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out[n].data()), lo);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out[n].data() + 2), hi);
+      }
+    }
+
+    #undef C3_KADEMLIA_BSWAP64_MASK
+#endif
+
+    struct kernel_t {
+      void (*func)(const nid_t&, const nid_t*, size_t, distance_key*);
+      const char* name;
+    };
+
+    kernel_t pick_kernel() {
+#ifdef C3_KADEMLIA_X86_KERNELS
+      if (__builtin_cpu_supports("avx2"))
+        return { distance_keys_avx2, "avx2" };
+      if (__builtin_cpu_supports("ssse3"))
+        return { distance_keys_ssse3, "ssse3" };
+#endif
+      return { distance_keys_scalar, "scalar" };
+    }
+
+    const kernel_t& kernel() {
+      static const kernel_t ret = pick_kernel();
+      return ret;
+    }
+  }
+
+  void distance_keys(const nid_t& target, span<const nid_t> nids, distance_key* out) {
+    kernel().func(target, nids.data(), static_cast<size_t>(nids.size()), out);
+  }
+
+  void distance_keys_scalar(const nid_t& target, span<const nid_t> nids, distance_key* out) {
+    distance_keys_scalar(target, nids.data(), static_cast<size_t>(nids.size()), out);
+  }
+
+  const char* distance_keys_kernel() {
+    return kernel().name;
+  }
+}
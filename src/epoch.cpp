@@ -0,0 +1,62 @@
+#include "epoch.hpp"
+
+#include <thread>
+
+namespace c3::kademlia {
+  size_t epoch_domain::this_stripe() {
+    static std::atomic<size_t> next = 0;
+    thread_local size_t ret = next++ % stripe_count;
+    return ret;
+  }
+
+  epoch_domain::guard epoch_domain::read() {
+    auto& s = stripes[this_stripe()];
+
+    while (true) {
+      auto e = current.load();
+      auto& counter = s.readers[e & 1];
+      counter.fetch_add(1);
+      // If the epoch flipped under us, the writer may have missed our registration
+      if (current.load() == e)
+        return {&counter};
+      counter.fetch_sub(1);
+    }
+  }
+
+  void epoch_domain::synchronize() {
+    std::unique_lock lock{synchronize_mutex};
+
+    auto parity = current.fetch_add(1) & 1;
+
+    for (auto& i : stripes)
+      while (i.readers[parity].load(std::memory_order_acquire) != 0)
+        std::this_thread::yield();
+  }
+
+  void epoch_domain::retire_raw(void* ptr, void (*deleter)(void*)) {
+    std::unique_lock lock{retired_mutex};
+    retired.push_back({ptr, deleter});
+    ++retired_count;
+  }
+
+  void epoch_domain::reclaim() {
+    std::vector<retired_t> to_free;
+    {
+      std::unique_lock lock{retired_mutex};
+      to_free.swap(retired);
+    }
+    if (to_free.empty())
+      return;
+
+    synchronize();
+
+    for (auto& i : to_free)
+      i.deleter(i.ptr);
+    retired_count -= to_free.size();
+  }
+
+  epoch_domain::~epoch_domain() {
+    for (auto& i : retired)
+      i.deleter(i.ptr);
+  }
+}
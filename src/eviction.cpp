@@ -0,0 +1,163 @@
+#include "eviction.hpp"
+
+namespace c3::kademlia {
+  void eviction_policy::lru::on_insert(const nid_t& nid) {
+    std::unique_lock lock{order_mutex};
+    if (positions.find(nid) != positions.end())
+      return;
+    order.push_front(nid);
+    positions.emplace(nid, order.begin());
+  }
+
+  void eviction_policy::lru::on_remove(const nid_t& nid) {
+    std::unique_lock lock{order_mutex};
+    auto iter = positions.find(nid);
+    if (iter == positions.end())
+      return;
+    order.erase(iter->second);
+    positions.erase(iter);
+  }
+
+  void eviction_policy::lru::on_hit(const nid_t& nid) {
+    std::unique_lock lock{order_mutex};
+    auto iter = positions.find(nid);
+    if (iter == positions.end())
+      return;
+    order.splice(order.begin(), order, iter->second);
+  }
+
+  std::optional<nid_t> eviction_policy::lru::pick_victim(const nid_t&) {
+    std::unique_lock lock{order_mutex};
+    if (order.empty())
+      return std::nullopt;
+    return order.back();
+  }
+
+  size_t eviction_policy::tiny_lfu::sketch_index(const nid_t& nid, size_t row) const {
+    // Nids are uniform, so each row can just use a different pair of bytes
+    size_t h = (size_t{nid[row * 2]} << 8) | nid[row * 2 + 1];
+    h |= (size_t{nid[row * 2 + 8]} << 24) | (size_t{nid[row * 2 + 9]} << 16);
+    return row * (sketch_mask + 1) + (h & sketch_mask);
+  }
+
+  uint8_t eviction_policy::tiny_lfu::frequency(const nid_t& nid) const {
+    uint8_t ret = counter_max;
+    for (size_t row = 0; row < sketch_depth; ++row)
+      ret = std::min(ret, sketch[sketch_index(nid, row)]);
+    return ret;
+  }
+
+  void eviction_policy::tiny_lfu::record(const nid_t& nid) {
+    for (size_t row = 0; row < sketch_depth; ++row) {
+      auto& counter = sketch[sketch_index(nid, row)];
+      if (counter < counter_max)
+        ++counter;
+    }
+
+    // Age everything, so that yesterday's hot keys don't stay hot forever
+    if (++additions == sample_size) {
+      for (auto& i : sketch)
+        i >>= 1;
+      additions /= 2;
+    }
+  }
+
+  void eviction_policy::tiny_lfu::on_insert(const nid_t& nid) {
+    std::unique_lock lock{policy_mutex};
+    if (positions.find(nid) != positions.end())
+      return;
+    record(nid);
+    probation.push_front(nid);
+    positions.emplace(nid, position_t{segment_t::probation, probation.begin()});
+  }
+
+  void eviction_policy::tiny_lfu::on_remove(const nid_t& nid) {
+    std::unique_lock lock{policy_mutex};
+    auto iter = positions.find(nid);
+    if (iter == positions.end())
+      return;
+    (iter->second.segment == segment_t::probation ? probation : protect).erase(iter->second.iter);
+    positions.erase(iter);
+  }
+
+  void eviction_policy::tiny_lfu::on_hit(const nid_t& nid) {
+    std::unique_lock lock{policy_mutex};
+    record(nid);
+
+    auto iter = positions.find(nid);
+    if (iter == positions.end())
+      return;
+
+    auto& pos = iter->second;
+    if (pos.segment == segment_t::protect) {
+      protect.splice(protect.begin(), protect, pos.iter);
+      return;
+    }
+
+    // A second hit earns a place in the protected segment
+    protect.splice(protect.begin(), probation, pos.iter);
+    pos.segment = segment_t::protect;
+
+    // Keep the protected segment to about 80% of what we hold, demoting its coldest back
+    if (protect.size() * 5 > positions.size() * 4) {
+      auto demoted = std::prev(protect.end());
+      probation.splice(probation.begin(), protect, demoted);
+      positions[*demoted] = {segment_t::probation, demoted};
+    }
+  }
+
+  void eviction_policy::tiny_lfu::on_miss(const nid_t& nid) {
+    std::unique_lock lock{policy_mutex};
+    record(nid);
+  }
+
+  std::optional<nid_t> eviction_policy::tiny_lfu::pick_victim(const nid_t& incoming) {
+    std::unique_lock lock{policy_mutex};
+
+    // Turned away stores count too, so that something replicated to us often enough gets in
+    record(incoming);
+
+    auto& from = probation.empty() ? protect : probation;
+    if (from.empty())
+      return std::nullopt;
+
+    auto candidate = from.back();
+    if (frequency(incoming) <= frequency(candidate))
+      return std::nullopt;
+    return candidate;
+  }
+
+  eviction_policy::tiny_lfu::tiny_lfu(size_t expected_keys) {
+    size_t width = 16;
+    while (width < expected_keys)
+      width *= 2;
+
+    sketch.resize(width * sketch_depth);
+    sketch_mask = width - 1;
+    sample_size = width * 10;
+  }
+
+  void eviction_policy::furthest::on_insert(const nid_t& nid) {
+    std::unique_lock lock{distances_mutex};
+    distances.insert(xor_distance(our_nid, nid));
+  }
+
+  void eviction_policy::furthest::on_remove(const nid_t& nid) {
+    std::unique_lock lock{distances_mutex};
+    distances.erase(xor_distance(our_nid, nid));
+  }
+
+  void eviction_policy::furthest::on_hit(const nid_t&) {}
+
+  std::optional<nid_t> eviction_policy::furthest::pick_victim(const nid_t& incoming) {
+    std::unique_lock lock{distances_mutex};
+    if (distances.empty())
+      return std::nullopt;
+
+    auto furthest = *distances.rbegin();
+    if (xor_distance(our_nid, incoming) >= furthest)
+      return std::nullopt;
+    // XOR is its own inverse, so this gets the nid back
+    return xor_distance(our_nid, furthest);
+  }
+}
@@ -0,0 +1,132 @@
+#include "expiry_wheel.hpp"
+
+namespace c3::kademlia {
+  uint64_t expiry_wheel::tick_of(clock::time_point t) const {
+    return std::chrono::duration_cast<std::chrono::seconds>(t - epoch).count();
+  }
+
+  void expiry_wheel::place(entry e, std::vector<nid_t>& due) {
+    if (e.deadline <= current_tick) {
+      due.push_back(e.nid);
+      return;
+    }
+
+    // Find the lowest level where everything above the slot agrees with the current tick
+    size_t level = 0;
+    for (; level < level_count - 1; ++level)
+      if ((e.deadline >> (slot_bits * (level + 1))) == (current_tick >> (slot_bits * (level + 1))))
+        break;
+
+    wheel[level][(e.deadline >> (slot_bits * level)) % slot_count].push_back(e);
+  }
+
+  void expiry_wheel::advance(uint64_t to, std::vector<nid_t>& due) {
+    std::vector<entry> cascading;
+
+    while (current_tick < to) {
+      ++current_tick;
+
+      // Higher levels must go first, as they may cascade into a lower slot that is rolling over now
+      for (size_t level = level_count - 1; level > 0; --level) {
+        if (current_tick % (uint64_t{1} << (slot_bits * level)) != 0)
+          continue;
+
+        auto& slot = wheel[level][(current_tick >> (slot_bits * level)) % slot_count];
+        cascading.clear();
+        cascading.swap(slot);
+        for (auto& i : cascading)
+          place(i, due);
+      }
+
+      auto& slot = wheel[0][current_tick % slot_count];
+      for (auto& i : slot)
+        due.push_back(i.nid);
+      slot.clear();
+    }
+  }
+
+  void expiry_wheel::tick_body() {
+    std::unique_lock lock{wheel_mutex};
+    std::vector<nid_t> due;
+
+    while (!die) {
+      if (pending_count == 0) {
+        wheel_condvar.wait(lock, [&]() { return die || pending_count != 0; });
+        continue;
+      }
+
+      auto next = epoch + std::chrono::seconds(current_tick + 1);
+      if (wheel_condvar.wait_until(lock, next, [&]() { return die; }))
+        break;
+
+      due.clear();
+      advance(tick_of(now()), due);
+      if (due.empty())
+        continue;
+
+      pending_count -= due.size();
+
+      // Don't hold our lock while the owner takes theirs, or schedule() could deadlock against us
+      lock.unlock();
+      on_expire(due);
+      lock.lock();
+    }
+  }
+
+  void expiry_wheel::schedule(nid_t nid, clock::duration ttl) {
+    auto at = now();
+    std::unique_lock lock{wheel_mutex};
+
+    // Round up, so that we never expire anything early
+    auto deadline = tick_of(at + ttl + std::chrono::seconds(1) - clock::duration(1));
+
+    // An empty wheel has nothing to cascade, so if the thread has been idle we can just catch it up
+    if (pending_count == 0)
+      current_tick = std::max(current_tick, tick_of(at));
+
+    // Always leave at least one tick, so that the callback only ever runs on our thread
+    deadline = std::max(deadline, current_tick + 1);
+    // Keep the top level from wrapping around
+    deadline = std::min(deadline, current_tick + (uint64_t{1} << (slot_bits * level_count)) -
+                                  (uint64_t{1} << (slot_bits * (level_count - 1))));
+
+    // As the deadline is in the future, this never touches due
+    std::vector<nid_t> due;
+    place({nid, deadline}, due);
+    ++pending_count;
+
+    wheel_condvar.notify_all();
+  }
+
+  void expiry_wheel::poll() {
+    std::vector<nid_t> due;
+    {
+      std::unique_lock lock{wheel_mutex};
+      advance(tick_of(now()), due);
+      pending_count -= due.size();
+    }
+    if (!due.empty())
+      on_expire(due);
+  }
+
+  expiry_wheel::expiry_wheel(callback_t on_expire) :
+    on_expire{std::move(on_expire)},
+    now{&clock::now},
+    epoch{now()},
+    tick_thread{&expiry_wheel::tick_body, this} {}
+
+  expiry_wheel::expiry_wheel(callback_t on_expire, time_source_t now) :
+    on_expire{std::move(on_expire)},
+    now{std::move(now)},
+    epoch{this->now()} {}
+
+  expiry_wheel::~expiry_wheel() {
+    {
+      std::unique_lock lock{wheel_mutex};
+      die = true;
+      wheel_condvar.notify_all();
+    }
+    if (tick_thread.joinable())
+      tick_thread.join();
+  }
+}
@@ -0,0 +1,206 @@
+#include "base.hpp"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace c3::kademlia {
+  namespace {
+    struct md_deleter {
+      inline void operator()(::EVP_MD* md) const noexcept {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        ::EVP_MD_free(md);
+#else
+        (void)md;
+#endif
+      }
+    };
+    struct md_ctx_deleter {
+      inline void operator()(::EVP_MD_CTX* ctx) const noexcept { ::EVP_MD_CTX_free(ctx); }
+    };
+
+    /// OpenSSL 3 looks SHA-256 up again on every call to SHA256(), which for a small value costs
+    /// more than the hashing does, so we fetch it once. Contexts hold their own reference to it
+    const ::EVP_MD* get_sha256() {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+      static std::unique_ptr<::EVP_MD, md_deleter> md{::EVP_MD_fetch(nullptr, "SHA256", nullptr)};
+      if (!md)
+        throw std::runtime_error("Could not fetch SHA-256");
+      return md.get();
+#else
+      return ::EVP_sha256();
+#endif
+    }
+
+    /// A few threads that hash runs of a batch
+    ///
+    /// OpenSSL already picks the best SHA-256 kernel the CPU has (SHA-NI, AVX2 and so on), so what
+    /// we add is spreading a batch over cores. The nid of a value is the plain SHA-256 of it, so
+    /// splitting one value into a hash tree would change its nid; a single value is always hashed
+    /// on one thread.
+    class hash_engine {
+    private:
+      // Below this, waking another thread costs more than it saves
+      static constexpr size_t parallel_threshold = 256 * 1024;
+
+      struct batch_t {
+        span<const span<const uint8_t>> in;
+        nid_t* out;
+        std::atomic<size_t> remaining;
+      };
+
+      struct job_t {
+        batch_t* batch;
+        size_t begin;
+        size_t end;
+      };
+
+    private:
+      //
+      std::mutex jobs_mutex;
+      std::condition_variable jobs_condvar;
+      std::condition_variable done_condvar;
+      std::deque<job_t> jobs;
+      bool die = false;
+      //
+
+      std::vector<std::thread> workers;
+
+    private:
+      static void run(const job_t& job) {
+        for (size_t i = job.begin; i < job.end; ++i)
+          job.batch->out[i] = compute_nid(job.batch->in[static_cast<std::ptrdiff_t>(i)]);
+      }
+
+      void finish(const job_t& job) {
+        if (--job.batch->remaining == 0) {
+          std::unique_lock lock{jobs_mutex};
+          done_condvar.notify_all();
+        }
+      }
+
+      void worker_body() {
+        std::unique_lock lock{jobs_mutex};
+        while (true) {
+          jobs_condvar.wait(lock, [&]() { return die || !jobs.empty(); });
+          if (die)
+            return;
+
+          auto job = jobs.front();
+          jobs.pop_front();
+
+          lock.unlock();
+          run(job);
+          finish(job);
+          lock.lock();
+        }
+      }
+
+    public:
+      void hash(span<const span<const uint8_t>> in, nid_t* out) {
+        size_t count = static_cast<size_t>(in.size());
+        size_t total = 0;
+        for (auto& i : in)
+          total += static_cast<size_t>(i.size());
+
+        if (count < 2 || total < parallel_threshold || workers.empty()) {
+          for (size_t i = 0; i < count; ++i)
+            out[i] = compute_nid(in[static_cast<std::ptrdiff_t>(i)]);
+          return;
+        }
+
+        // Cut the batch into runs of roughly equal bytes, one for each thread including ours
+        std::vector<job_t> runs;
+        batch_t batch{in, out, 0};
+        size_t share = total / (workers.size() + 1) + 1;
+        size_t begin = 0, acc = 0;
+        for (size_t i = 0; i < count; ++i) {
+          acc += static_cast<size_t>(in[static_cast<std::ptrdiff_t>(i)].size());
+          if (acc >= share || i + 1 == count) {
+            runs.push_back({&batch, begin, i + 1});
+            begin = i + 1;
+            acc = 0;
+          }
+        }
+        batch.remaining = runs.size();
+
+        {
+          std::unique_lock lock{jobs_mutex};
+          // We do the first run ourselves
+          jobs.insert(jobs.end(), runs.begin() + 1, runs.end());
+          jobs_condvar.notify_all();
+        }
+
+        run(runs.front());
+        finish(runs.front());
+
+        // Help out with anything nobody has picked up yet, rather than sitting idle
+        std::unique_lock lock{jobs_mutex};
+        while (batch.remaining != 0) {
+          auto mine = std::find_if(jobs.begin(), jobs.end(), [&](auto& j) { return j.batch == &batch; });
+          if (mine == jobs.end()) {
+            done_condvar.wait(lock, [&]() { return batch.remaining == 0; });
+            break;
+          }
+          auto job = *mine;
+          jobs.erase(mine);
+          lock.unlock();
+          run(job);
+          finish(job);
+          lock.lock();
+        }
+      }
+
+    public:
+      hash_engine() {
+        size_t n = std::thread::hardware_concurrency();
+        // Leave a core for the caller, who helps out anyway
+        n = n > 1 ? std::min<size_t>(n - 1, 8) : 0;
+        for (size_t i = 0; i < n; ++i)
+          workers.emplace_back(&hash_engine::worker_body, this);
+      }
+
+      ~hash_engine() {
+        {
+          std::unique_lock lock{jobs_mutex};
+          die = true;
+          jobs_condvar.notify_all();
+        }
+        for (auto& i : workers)
+          i.join();
+      }
+    };
+
+    hash_engine& get_engine() {
+      static hash_engine engine;
+      return engine;
+    }
+  }
+
+  nid_t compute_nid(span<const uint8_t> data) {
+    // One for each thread, so that nothing is allocated or looked up once it has hashed anything
+    thread_local std::unique_ptr<::EVP_MD_CTX, md_ctx_deleter> ctx{::EVP_MD_CTX_new()};
+    if (!ctx)
+      throw std::bad_alloc();
+
+    nid_t ret;
+    if (!::EVP_DigestInit_ex(ctx.get(), get_sha256(), nullptr) ||
+        !::EVP_DigestUpdate(ctx.get(), data.data(), static_cast<size_t>(data.size())) ||
+        !::EVP_DigestFinal_ex(ctx.get(), ret.data(), nullptr))
+      throw std::runtime_error("Could not hash");
+    return ret;
+  }
+
+  std::vector<nid_t> compute_nids(span<const span<const uint8_t>> data) {
+    std::vector<nid_t> ret(static_cast<size_t>(data.size()));
+    get_engine().hash(data, ret.data());
+    return ret;
+  }
+}
@@ -1,82 +1,191 @@
 #include "k_buckets.hpp"
 
+#include <algorithm>
+
 namespace c3::kademlia {
+  size_t k_buckets::bucket_t::find(const nid_t& nid) const {
+    for (size_t i = 0; i < size; ++i)
+      if (nids[i] == nid)
+        return i;
+    return size;
+  }
+
+  void k_buckets::bucket_t::push_front(const contact& c) {
+    std::move_backward(nids.begin(), nids.begin() + size, nids.begin() + size + 1);
+    std::move_backward(location_spans.begin(), location_spans.begin() + size, location_spans.begin() + size + 1);
+
+    nids[0] = c.nid;
+    location_spans[0] = { static_cast<uint32_t>(locations.size()), static_cast<uint32_t>(c.location.size()) };
+    locations.append(c.location);
+    ++size;
+  }
+
+  void k_buckets::bucket_t::move_to_front(size_t i) {
+    std::rotate(nids.begin(), nids.begin() + i, nids.begin() + i + 1);
+    std::rotate(location_spans.begin(), location_spans.begin() + i, location_spans.begin() + i + 1);
+  }
+
+  void k_buckets::bucket_t::erase(size_t i) {
+    auto [offset, length] = location_spans[i];
+
+    // Close the gap, so that the string never holds more than the live locations
+    locations.erase(offset, length);
+    for (size_t j = 0; j < size; ++j)
+      if (location_spans[j].first > offset)
+        location_spans[j].first -= length;
+
+    std::move(nids.begin() + i + 1, nids.begin() + size, nids.begin() + i);
+    std::move(location_spans.begin() + i + 1, location_spans.begin() + size, location_spans.begin() + i);
+    --size;
+  }
+
+  const k_buckets::bucket_t* k_buckets::latest(size_t index) const {
+    if (pending[index])
+      return pending[index].get();
+    return current.load(std::memory_order_relaxed)->buckets[index];
+  }
+
+  k_buckets::bucket_t& k_buckets::writable(size_t index) {
+    auto& ret = pending[index];
+    if (!ret) {
+      auto published = current.load(std::memory_order_relaxed)->buckets[index];
+      ret = published ? std::make_unique<bucket_t>(*published) : std::make_unique<bucket_t>();
+    }
+
+    if (!dirty) {
+      dirty = true;
+      write_condvar.notify_all();
+    }
+    return *ret;
+  }
+
+  bool k_buckets::insert(size_t index, const contact& c) {
+    // Long lived contacts are worth more than new ones, so a full bucket keeps what it has
+    if (auto bucket = latest(index); bucket && bucket->full() && bucket->find(c.nid) == bucket->size) {
+      remember(index, c);
+      return false;
+    }
+
+    auto& bucket = writable(index);
+    if (auto pos = bucket.find(c.nid); pos != bucket.size)
+      bucket.move_to_front(pos);
+    else {
+      bucket.push_front(c);
+      joined(c.nid);
+    }
+    return true;
+  }
+
+  void k_buckets::remember(size_t index, const contact& c) {
+    auto& cache = replacements[index];
+    auto pos = std::find_if(cache.begin(), cache.end(), [&](auto& i) { return i.nid == c.nid; });
+    if (pos != cache.end())
+      cache.erase(pos);
+    else if (cache.size() == replacement_max)
+      cache.pop_back();
+    else
+      ++replacements_cached;
+    cache.insert(cache.begin(), c);
+
+    // See whether the oldest contact is still about, unless someone is already on it
+    if (ping && !probing[index]) {
+      probing[index] = true;
+      probes.push_back(index);
+      write_condvar.notify_all();
+    }
+  }
+
+  void k_buckets::joined(const nid_t& nid) {
+    {
+      std::unique_lock lock{timing_mutex};
+      timings.try_emplace(nid);
+    }
+    if (watch)
+      watch(nid, true);
+  }
+
+  void k_buckets::left(const nid_t& nid) {
+    {
+      std::unique_lock lock{timing_mutex};
+      timings.erase(nid);
+    }
+    if (watch)
+      watch(nid, false);
+  }
+
+  void k_buckets::promote(size_t index) {
+    auto& cache = replacements[index];
+    if (cache.empty())
+      return;
+
+    auto& bucket = writable(index);
+    if (bucket.full())
+      return;
+
+    bucket.push_front(cache.front());
+    joined(cache.front().nid);
+    cache.erase(cache.begin());
+    --replacements_cached;
+    ++replacements_used;
+  }
+
+  std::vector<contact> k_buckets::closest(const nid_t& target, const nid_t& exclude, size_t count) const {
+    struct candidate_t {
+      const bucket_t* bucket;
+      size_t index;
+    };
+    std::vector<candidate_t> candidates;
+    std::vector<nid_t> nids;
+    // We usually stop within a bucket of count, so this saves growing them on every request
+    candidates.reserve(count + k);
+    nids.reserve(count + k);
+
+    auto guard = epoch.read();
+    auto snapshot = current.load(std::memory_order_acquire);
+
+    auto take = [&](size_t offset) {
+      auto bucket = snapshot->buckets[offset];
+      if (!bucket)
+        return;
+
+      for (size_t i = 0; i < bucket->size; ++i) {
+        if (bucket->nids[i] == exclude)
+          continue;
+        candidates.push_back({bucket, i});
+        nids.push_back(bucket->nids[i]);
+      }
+    };
+
+    // Anything in target's own bucket is closer to it than anything elsewhere. After that come all
+    // the buckets below it, whose distances share its top bit, and then each bucket above in turn.
+    // So we only need to rank the last lot we take.
+    size_t nid_distance = bucket_of(target);
+    take(nid_distance);
+    if (candidates.size() < count)
+      for (size_t i = 0; i < nid_distance; ++i)
+        take(i);
+    for (size_t i = nid_distance + 1; i < B && candidates.size() < count; ++i)
+      take(i);
+
+    std::vector<distance_key> keys(nids.size());
+    distance_keys(target, nids, keys.data());
+
+    std::vector<size_t> order(candidates.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    auto last = order.begin() + static_cast<std::ptrdiff_t>(std::min(count, order.size()));
+    std::partial_sort(order.begin(), last, order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+
+    // The snapshot can't change under us, so only the winners' locations need copying out
+    std::vector<contact> ret;
+    ret.reserve(static_cast<size_t>(last - order.begin()));
+    for (auto i = order.begin(); i != last; ++i)
+      ret.push_back(candidates[*i].bucket->get(candidates[*i].index));
+    return ret;
+  }
+
   std::vector<contact> k_buckets::find_node(nid_t sender, nid_t nid) const {
-   std::vector<contact> ret;
-   auto inserter = std::back_inserter(ret);
-
-   size_t nid_distance = distance(parent->get_nid(), nid);
-
-   {
-     auto& mutex_and_bucket = base[nid_distance];
-     std::shared_lock lock{mutex_and_bucket.first};
-     const auto& bucket = mutex_and_bucket.second;
-
-     size_t limit = std::min(bucket.size(), k);
-     auto bucket_iter = bucket.cbegin();
-
-     for (size_t i = 0; i < limit; ++i) {
-       if (bucket_iter->nid == sender) continue;
-       *inserter++ = *(bucket_iter++);
-     }
-   }
-
-   if (ret.size() == k)
-     return ret;
-
-   bool hit_max = false;
-   bool hit_min = false;
-
-   size_t i = 0;
-
-   while(true) {
-     if (!hit_max) {
-       auto offset = nid_distance + i;
-       hit_max = (offset == B - 1);
-
-       if (offset == nid_distance)
-         goto skip_max;
-
-       auto& mutex_and_bucket = base[offset];
-       std::shared_lock lock{mutex_and_bucket.first};
-       const auto& bucket = mutex_and_bucket.second;
-
-       for (auto i : bucket) {
-         if (i.nid == sender)
-           continue;
-         ret.push_back(i);
-         if (ret.size() == k)
-           return ret;
-       }
-     }
-     skip_max:
-     if (!hit_min) {
-       auto offset = nid_distance - i;
-       hit_min = (offset == 0);
-
-       if (offset == nid_distance)
-         goto skip_min;
-
-       auto& mutex_and_bucket = base[offset];
-       std::shared_lock lock{mutex_and_bucket.first};
-       const auto& bucket = mutex_and_bucket.second;
-
-       for (auto i : bucket) {
-         if (i.nid == sender)
-           continue;
-         ret.push_back(i);
-         if (ret.size() == k)
-           return ret;
-       }
-     }
-
-     skip_min:
-     if (hit_max && hit_min)
-       break;
-     else ++i;
-   }
-
-   return ret;
+    return closest(nid, sender, k);
   }
 
   bool k_buckets::update(contact c) {
@@ -84,21 +193,8 @@ namespace c3::kademlia {
       throw std::runtime_error("Tried to add self!");
 
     try {
-      auto& mutex_and_bucket = get_bucket(c.nid);
-      std::unique_lock lock{mutex_and_bucket.first};
-      auto& bucket = mutex_and_bucket.second;
-
-      auto pos = std::find_if(bucket.begin(), bucket.end(),
-                              [&](auto a) { return a.nid == c.nid; });
-      if (pos != bucket.end()) {
-        auto elem = std::move(*pos);
-        bucket.erase(pos);
-        bucket.push_front(elem);
-      }
-      else
-        bucket.push_front(c);
-
-      return true;
+      std::unique_lock lock{write_mutex};
+      return insert(bucket_of(c.nid), c);
     }
     catch (...) {
       drop(c.nid);
@@ -106,55 +202,99 @@ namespace c3::kademlia {
     }
   }
 
+  bool k_buckets::touch(const nid_t& nid) {
+    auto index = bucket_of(nid);
+    std::unique_lock lock{write_mutex};
+
+    auto bucket = latest(index);
+    if (!bucket)
+      return false;
+    auto pos = bucket->find(nid);
+    if (pos == bucket->size)
+      return false;
+    // Whoever talks to us most will usually be at the front already, and needn't copy anything
+    if (pos != 0)
+      writable(index).move_to_front(pos);
+    return true;
+  }
+
   bool k_buckets::drop(nid_t nid) {
-    auto& mutex_and_bucket = get_bucket(nid);
-    std::unique_lock lock{mutex_and_bucket.first};
-    auto& bucket = mutex_and_bucket.second;
+    auto index = bucket_of(nid);
+    std::unique_lock lock{write_mutex};
 
-    auto pos = std::find_if(bucket.begin(), bucket.end(),
-                            [&](auto a) { return a.nid == nid; });
-    if (pos == bucket.end()) return false;
+    // Lookups drop plenty of nodes we never had, so don't copy the bucket unless we have to
+    if (auto bucket = latest(index); !bucket || bucket->find(nid) == bucket->size)
+      return false;
 
-    bucket.erase(pos);
+    auto& bucket = writable(index);
+    bucket.erase(bucket.find(nid));
+    left(nid);
+    promote(index);
 
     return true;
   }
 
   std::vector<contact> k_buckets::get_alpha(nid_t nid) const {
-    std::vector<contact> ret;
-    auto inserter = std::back_inserter(ret);
+    auto ret = closest(nid, nid, k);
+
+    // Contacts whose distances share a top bit are about as close as each other, so amongst those
+    // we'd rather ask whoever answers quickest
+    std::vector<std::pair<size_t, std::chrono::microseconds>> ranks;
+    ranks.reserve(ret.size());
+    for (auto& i : ret)
+      ranks.emplace_back(distance(nid, i.nid), rtt_of(i.nid).expected());
+
+    std::vector<size_t> order(ret.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return ranks[a] < ranks[b]; });
+    order.resize(std::min(order.size(), alpha));
+
+    std::vector<contact> chosen;
+    for (auto i : order)
+      chosen.push_back(std::move(ret[i]));
+    return chosen;
+  }
 
-    size_t nid_distance = distance(parent->get_nid(), nid);
+  void k_buckets::observe_rtt(const nid_t& nid, std::chrono::microseconds rtt) {
+    std::unique_lock lock{timing_mutex};
+    auto iter = timings.find(nid);
+    if (iter == timings.end())
+      return;
 
-    {
-      auto& mutex_and_bucket = base[nid_distance];
-      std::shared_lock lock{mutex_and_bucket.first};
-      const auto& bucket = mutex_and_bucket.second;
+    iter->second.rtt.observe(rtt);
+    iter->second.histogram.record(rtt);
+  }
+
+  rtt_estimate k_buckets::rtt_of(const nid_t& nid) const {
+    std::unique_lock lock{timing_mutex};
+    auto iter = timings.find(nid);
+    return iter == timings.end() ? rtt_estimate{} : iter->second.rtt;
+  }
 
-      size_t limit = std::min(bucket.size(), alpha);
-      auto bucket_iter = bucket.cbegin();
+  std::vector<node::peer_latency_t> k_buckets::get_peer_latencies() const {
+    std::vector<node::peer_latency_t> ret;
 
-      for (size_t i = 0; i < limit; ++i) {
-        if ((*bucket_iter).nid == nid) continue;
-        *inserter++ = *bucket_iter++;
+    {
+      auto guard = epoch.read();
+      auto snapshot = current.load(std::memory_order_acquire);
+      for (auto i : snapshot->buckets) {
+        if (!i)
+          continue;
+        for (size_t j = 0; j < i->size; ++j)
+          ret.push_back({i->get(j), {}, {}, {}, {}});
       }
     }
 
-    if (ret.size() != alpha) {
-      // We start at one so that we do not give ourselves as a node
-      for (size_t i = 1; i < base.size(); ++i) {
-        // Stop duplicates
-        if (i == nid_distance) continue;
-
-        auto& mutex_and_bucket = base[i];
-        std::shared_lock lock{mutex_and_bucket.first};
-        const auto& bucket = mutex_and_bucket.second;
-
-        std::copy_n(bucket.begin(), std::min(bucket.size(), ret.size() - alpha), inserter);
-
-        if (ret.size() == alpha)
-          break;
-      }
+    std::unique_lock lock{timing_mutex};
+    for (auto& i : ret) {
+      auto iter = timings.find(i.peer.nid);
+      auto rtt = iter == timings.end() ? rtt_estimate{} : iter->second.rtt;
+      i.srtt = std::chrono::microseconds{rtt.srtt_us};
+      i.rttvar = std::chrono::microseconds{rtt.rttvar_us};
+      i.timeout = rtt.timeout();
+      if (iter != timings.end())
+        i.histogram = iter->second.histogram;
     }
 
     return ret;
@@ -165,37 +305,192 @@ namespace c3::kademlia {
     if (c.nid == parent->get_nid())
       throw std::runtime_error("Tried to add self!");
 
-    auto& mutex_and_bucket = get_bucket(c.nid);
-    std::unique_lock lock{mutex_and_bucket.first};
-    auto& bucket = mutex_and_bucket.second;
+    {
+      auto index = bucket_of(c.nid);
+      std::unique_lock lock{write_mutex};
 
+      if (auto bucket = latest(index); bucket && bucket->find(c.nid) != bucket->size)
+        return;
 
-    if (std::find_if(bucket.cbegin(), bucket.cend(),
-                     [&](const contact& i) { return i.nid == c.nid; }) != bucket.cend())
-      return;
+      insert(index, c);
+    }
 
-    bucket.push_front(c);
+    // Peers are added by hand or while joining, and whoever did it expects to be able to use them
+    publish();
   }
 
   size_t k_buckets::count() const {
-    size_t acc = 0;
+    auto guard = epoch.read();
+    auto snapshot = current.load(std::memory_order_acquire);
 
-    for (auto& i : base) {
-      std::shared_lock lock{i.first};
-      acc += i.second.size();
-    }
+    size_t acc = 0;
+    for (auto i : snapshot->buckets)
+      if (i)
+        acc += i->size;
 
     return acc;
   }
 
   std::vector<contact> k_buckets::get_all() const {
+    auto guard = epoch.read();
+    auto snapshot = current.load(std::memory_order_acquire);
+
     std::vector<contact> ret;
+    for (auto i : snapshot->buckets) {
+      if (!i)
+        continue;
+      for (size_t j = 0; j < i->size; ++j)
+        ret.push_back(i->get(j));
+    }
+
+    return ret;
+  }
+
+  node::routing_stats_t k_buckets::get_stats() const {
+    node::routing_stats_t ret;
 
-    for (auto& i : base) {
-      std::shared_lock lock{i.first};
-      std::copy(i.second.begin(), i.second.end(), std::back_inserter(ret));
+    {
+      auto guard = epoch.read();
+      auto snapshot = current.load(std::memory_order_acquire);
+
+      for (auto i : snapshot->buckets) {
+        if (!i)
+          continue;
+        ret.contacts += i->size;
+        ++ret.buckets_used;
+        if (i->full())
+          ++ret.buckets_full;
+      }
     }
 
+    ret.replacements_cached = replacements_cached;
+    ret.replacements_used = replacements_used;
+    ret.evictions = evictions;
     return ret;
   }
+
+  void k_buckets::publish() {
+    {
+      std::unique_lock lock{write_mutex};
+      if (!dirty)
+        return;
+
+      auto old = current.load(std::memory_order_relaxed);
+      auto next = std::make_unique<snapshot_t>(*old);
+      std::vector<const bucket_t*> replaced;
+      replaced.reserve(B);
+
+      for (size_t i = 0; i < B; ++i) {
+        if (!pending[i])
+          continue;
+        if (old->buckets[i])
+          replaced.push_back(old->buckets[i]);
+        // Empty buckets aren't worth keeping around
+        if (pending[i]->size == 0)
+          pending[i].reset();
+        next->buckets[i] = pending[i].release();
+      }
+
+      current.store(next.release(), std::memory_order_release);
+      dirty = false;
+
+      // Only now that nobody new can find them
+      for (auto i : replaced)
+        epoch.retire(i);
+      epoch.retire(old);
+    }
+
+    epoch.reclaim();
+  }
+
+  void k_buckets::publish_body() {
+    std::unique_lock lock{write_mutex};
+    while (true) {
+      write_condvar.wait(lock, [&]() { return die || dirty; });
+      // Give the batch a while to fill up
+      write_condvar.wait_for(lock, publish_interval, [&]() { return die; });
+      if (die)
+        return;
+
+      lock.unlock();
+      try { publish(); }
+      // We'll get another go next time round
+      catch (...) {}
+      lock.lock();
+    }
+  }
+
+  void k_buckets::probe_body() {
+    std::unique_lock lock{write_mutex};
+    while (true) {
+      write_condvar.wait(lock, [&]() { return die || !probes.empty(); });
+      if (die)
+        return;
+
+      auto index = probes.front();
+      probes.erase(probes.begin());
+
+      // Things may have moved on since we were asked
+      auto bucket = latest(index);
+      if (!bucket || !bucket->full() || replacements[index].empty()) {
+        probing[index] = false;
+        continue;
+      }
+      auto oldest = bucket->get(bucket->size - 1);
+
+      lock.unlock();
+      bool alive = false;
+      try { alive = ping(oldest); }
+      catch (...) {}
+      lock.lock();
+
+      probing[index] = false;
+
+      bucket = latest(index);
+      if (!bucket)
+        continue;
+      auto pos = bucket->find(oldest.nid);
+      // Already dropped by someone else, who will have promoted a replacement
+      if (pos == bucket->size)
+        continue;
+
+      auto& writing = writable(index);
+      if (alive) {
+        // It answered, so it has been seen more recently than anyone else in there
+        writing.move_to_front(pos);
+        continue;
+      }
+
+      writing.erase(pos);
+      left(oldest.nid);
+      ++evictions;
+      promote(index);
+    }
+  }
+
+  k_buckets::k_buckets(node* parent, pinger_t ping, watcher_t watch) :
+    parent{parent},
+    ping{std::move(ping)},
+    watch{std::move(watch)},
+    current{new snapshot_t},
+    publish_thread{&k_buckets::publish_body, this},
+    probe_thread{&k_buckets::probe_body, this} {}
+
+  k_buckets::~k_buckets() {
+    {
+      std::unique_lock lock{write_mutex};
+      die = true;
+      write_condvar.notify_all();
+    }
+    if (publish_thread.joinable())
+      publish_thread.join();
+    if (probe_thread.joinable())
+      probe_thread.join();
+
+    // Nobody can be reading by now, so anything retired goes with the epoch domain
+    auto snapshot = current.load();
+    for (auto i : snapshot->buckets)
+      delete i;
+    delete snapshot;
+  }
 }
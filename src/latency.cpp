@@ -0,0 +1,98 @@
+#include "latency.hpp"
+
+#include <algorithm>
+
+namespace c3::kademlia {
+  void rtt_estimate::observe(std::chrono::microseconds sample) noexcept {
+    auto r = static_cast<uint32_t>(std::clamp<int64_t>(sample.count(), 1, UINT32_MAX));
+
+    if (!known()) {
+      srtt_us = r;
+      rttvar_us = r / 2;
+      return;
+    }
+
+    uint32_t delta = srtt_us > r ? srtt_us - r : r - srtt_us;
+    // RTTVAR <- 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT <- 7/8 SRTT + 1/8 R
+    rttvar_us = static_cast<uint32_t>((uint64_t{rttvar_us} * 3 + delta) / 4);
+    srtt_us = std::max<uint32_t>(static_cast<uint32_t>((uint64_t{srtt_us} * 7 + r) / 8), 1);
+  }
+
+  std::chrono::milliseconds rtt_estimate::timeout() const noexcept {
+    if (!known())
+      return max_timeout;
+
+    auto rto = std::chrono::microseconds{uint64_t{srtt_us} + 4 * uint64_t{rttvar_us}};
+    return std::clamp(std::chrono::ceil<std::chrono::milliseconds>(rto), min_timeout, max_timeout);
+  }
+
+  size_t latency_histogram::index_of(std::chrono::microseconds latency) noexcept {
+    auto us = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0));
+    if (us < (uint64_t{1} << min_bits))
+      return 0;
+
+#if defined(__GNUC__)
+    size_t top = 63 - static_cast<size_t>(__builtin_clzll(us));
+#else
+    size_t top = min_bits;
+    while (us >> (top + 1))
+      ++top;
+#endif
+    // The bit below the top one says which half of the power of two we're in
+    size_t half = (us >> (top - 1)) & 1;
+    return std::min((top - min_bits) * 2 + half, bucket_count - 1);
+  }
+
+  std::chrono::microseconds latency_histogram::upper_of(size_t index) noexcept {
+    size_t top = index / 2 + min_bits;
+    uint64_t base = uint64_t{1} << top;
+    return std::chrono::microseconds{index % 2 ? base * 2 : base + base / 2};
+  }
+
+  void latency_histogram::record(std::chrono::microseconds latency) noexcept {
+    counts[index_of(latency)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  size_t latency_histogram::count() const noexcept {
+    size_t ret = 0;
+    for (auto& i : counts)
+      ret += i.load(std::memory_order_relaxed);
+    return ret;
+  }
+
+  std::chrono::microseconds latency_histogram::percentile(double p) const noexcept {
+    std::array<uint32_t, bucket_count> snapshot;
+    size_t total = 0;
+    for (size_t i = 0; i < bucket_count; ++i)
+      total += snapshot[i] = counts[i].load(std::memory_order_relaxed);
+    if (total == 0)
+      return std::chrono::microseconds{0};
+
+    auto wanted = static_cast<size_t>(std::clamp(p, 0.0, 1.0) * static_cast<double>(total));
+    size_t acc = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+      acc += snapshot[i];
+      if (acc > wanted || acc == total)
+        return upper_of(i);
+    }
+    return upper_of(bucket_count - 1);
+  }
+
+  std::vector<latency_histogram::bucket_t> latency_histogram::buckets() const {
+    std::vector<bucket_t> ret;
+    for (size_t i = 0; i < bucket_count; ++i)
+      if (auto n = counts[i].load(std::memory_order_relaxed))
+        ret.push_back({upper_of(i), n});
+    return ret;
+  }
+
+  latency_histogram::latency_histogram(const latency_histogram& other) noexcept {
+    *this = other;
+  }
+
+  latency_histogram& latency_histogram::operator=(const latency_histogram& other) noexcept {
+    for (size_t i = 0; i < bucket_count; ++i)
+      counts[i].store(other.counts[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return *this;
+  }
+}
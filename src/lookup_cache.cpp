@@ -0,0 +1,144 @@
+#include "lookup_cache.hpp"
+
+#include <algorithm>
+
+namespace c3::kademlia {
+  void lookup_cache::erase(std::map<nid_t, entry_t>::iterator iter) {
+    for (auto& c : iter->second.contacts) {
+      auto [begin, end] = holders.equal_range(c.nid);
+      for (auto i = begin; i != end; ++i) {
+        if (i->second == iter->first) {
+          holders.erase(i);
+          break;
+        }
+      }
+    }
+    lru.erase(iter->second.lru_pos);
+    entries.erase(iter);
+  }
+
+  bool lookup_cache::covers(std::map<nid_t, entry_t>::iterator iter, const nid_t& key, clock::time_point now) {
+    if (iter->second.expiry <= now) {
+      erase(iter);
+      return false;
+    }
+    if (iter->first == key)
+      return true;
+    return distance(iter->first, key) < iter->second.region;
+  }
+
+  std::optional<std::vector<contact>> lookup_cache::get(const nid_t& key) {
+    auto now = clock::now();
+    std::unique_lock lock{cache_mutex};
+
+    // Whoever shares the longest prefix with key is next to it in order, on one side or the other
+    std::optional<std::map<nid_t, entry_t>::iterator> found;
+    auto after = entries.lower_bound(key);
+    auto before = after == entries.begin() ? entries.end() : std::prev(after);
+    if (after != entries.end() && covers(after, key, now))
+      found = after;
+    else if (before != entries.end() && covers(before, key, now))
+      found = before;
+
+    if (!found) {
+      ++misses;
+      return std::nullopt;
+    }
+
+    auto& entry = (*found)->second;
+    lru.splice(lru.begin(), lru, entry.lru_pos);
+    ++hits;
+    requests_saved += entry.requests;
+
+    auto ret = entry.contacts;
+    if ((*found)->first != key) {
+      std::sort(ret.begin(), ret.end(), [&](auto& a, auto& b) {
+        return xor_distance(key, a.nid) < xor_distance(key, b.nid);
+      });
+    }
+    return ret;
+  }
+
+  void lookup_cache::put(const nid_t& key, std::vector<contact> contacts, size_t requests) {
+    if (contacts.empty())
+      return;
+
+    entry_t entry;
+    if (contacts.size() < k) {
+      // Either this is everyone there is, or the lookup didn't get far, and we can't tell which. So
+      // it's only good for its own key, and only until we hear of anyone at all
+      entry.furthest.fill(0xff);
+      entry.region = 0;
+    }
+    else {
+      auto& furthest = contacts.back().nid;
+      entry.furthest = xor_distance(key, furthest);
+      entry.region = distance(key, furthest);
+
+      // The furthest is never inside, and whoever is outside is only there for being closest to our
+      // key, which says little of how close they are to another. So one is all we can do with
+      size_t inside = std::count_if(contacts.begin(), contacts.end(), [&](auto& c) {
+        return distance(key, c.nid) < entry.region;
+      });
+      if (inside + 1 < contacts.size())
+        entry.region = 0;
+    }
+    entry.requests = requests;
+    entry.expiry = clock::now() + max_age;
+    entry.contacts = std::move(contacts);
+
+    std::unique_lock lock{cache_mutex};
+    if (auto iter = entries.find(key); iter != entries.end())
+      erase(iter);
+    while (!lru.empty() && entries.size() >= max_entries)
+      erase(entries.find(lru.back()));
+
+    lru.push_front(key);
+    entry.lru_pos = lru.begin();
+    for (auto& c : entry.contacts)
+      holders.emplace(c.nid, key);
+    entries.emplace(key, std::move(entry));
+  }
+
+  void lookup_cache::learned(const nid_t& nid) {
+    std::unique_lock lock{cache_mutex};
+    for (auto i = entries.begin(); i != entries.end();) {
+      auto next = std::next(i);
+      if (xor_distance(i->first, nid) < i->second.furthest) {
+        erase(i);
+        ++invalidations;
+      }
+      i = next;
+    }
+  }
+
+  void lookup_cache::dropped(const nid_t& nid) {
+    std::unique_lock lock{cache_mutex};
+    std::vector<nid_t> keys;
+    auto [begin, end] = holders.equal_range(nid);
+    for (auto i = begin; i != end; ++i)
+      keys.push_back(i->second);
+
+    for (auto& i : keys) {
+      if (auto iter = entries.find(i); iter != entries.end()) {
+        erase(iter);
+        ++invalidations;
+      }
+    }
+  }
+
+  void lookup_cache::clear() {
+    std::unique_lock lock{cache_mutex};
+    entries.clear();
+    lru.clear();
+    holders.clear();
+  }
+
+  lookup_cache::stats_t lookup_cache::get_stats() const {
+    std::unique_lock lock{cache_mutex};
+    return { hits, misses, requests_saved, invalidations, entries.size() };
+  }
+
+  lookup_cache::lookup_cache(size_t max_entries, clock::duration max_age) :
+    max_entries{max_entries}, max_age{max_age} {}
+}
@@ -1,6 +1,10 @@
 #define SDL_MAIN_HANDLED
 
 #include "node.hpp"
+#include "backing_store_sharded.hpp"
+#ifndef _WIN32
+#include "backing_store_log.hpp"
+#endif
 
 #include "format.pb.h"
 #include "format.grpc.pb.h"
@@ -46,6 +50,9 @@ private:
     bool localhost = false;
     bool auto_nid = true;
     char nid[256] = {0};
+    int store_type = 0;
+    int eviction_type = 3;
+    char store_dir[256] = "kademlia-store";
   };
 
   struct control_state {
@@ -180,8 +187,26 @@ private:
 
     nid_t nid = setup_s->auto_nid ? generate_nid() : parse_nid(setup_s->nid);
 
-    // TODO: allow selection of type
-    std::shared_ptr<backing_store> store = std::make_shared<backing_store::simple>();
+    std::shared_ptr<backing_store> store;
+    switch (setup_s->store_type) {
+      case 1:
+        store = std::make_shared<backing_store::sharded>();
+        break;
+#ifndef _WIN32
+      case 2:
+        store = std::make_shared<backing_store::log>(setup_s->store_dir);
+        break;
+#endif
+      default: {
+        std::unique_ptr<eviction_policy> policy;
+        switch (setup_s->eviction_type) {
+          case 1: policy = std::make_unique<eviction_policy::lru>(); break;
+          case 2: policy = std::make_unique<eviction_policy::tiny_lfu>(); break;
+          case 3: policy = std::make_unique<eviction_policy::furthest>(nid); break;
+        }
+        store = std::make_shared<backing_store::simple>(16 * 1024 * 1024, 1024, std::move(policy));
+      }
+    }
 
     local.emplace(addr, nid, store);
 
@@ -221,6 +246,17 @@ private:
       ImGui::InputText("nid", setup_s->nid, sizeof(setup_s->nid));
     }
 
+#ifndef _WIN32
+    ImGui::Combo("Storage", &setup_s->store_type, "Memory\0Sharded memory\0Disk log\0");
+    if (setup_s->store_type == 2)
+      ImGui::InputText("Storage directory", setup_s->store_dir, sizeof(setup_s->store_dir));
+#else
+    ImGui::Combo("Storage", &setup_s->store_type, "Memory\0Sharded memory\0");
+#endif
+    if (setup_s->store_type == 0)
+      ImGui::Combo("When full", &setup_s->eviction_type,
+                   "Reject new values\0Evict least recent\0Evict least frequent\0Evict furthest\0");
+
     ImGui::InputTextMultiline("Bootnodes", setup_s->bootnodes, sizeof(setup_s->bootnodes));
 
     if (ImGui::Button("Start"))
@@ -254,10 +290,210 @@ private:
       ImGui::NextColumn();
       ImGui::Text("%zu/%zu keys", stats.keys_used, stats.keys_max);
       ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      auto cache = control_s->parent->back()->get_cache_stats();
+      ImGui::Text("Copies cached for lookups (hits)");
+      ImGui::NextColumn();
+      ImGui::Text("%zu keys, %zu bytes (%zu)", cache.keys, cache.bytes, cache.hits);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Pending expiry");
+      ImGui::NextColumn();
+      ImGui::Text("%zu keys", stats.keys_expiring);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Hits/misses");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu", stats.eviction.hits, stats.eviction.misses);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Evicted/rejected");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu", stats.eviction.evictions, stats.eviction.rejections);
+      ImGui::NextColumn();
+
+      if (stats.disk_bytes) {
+        ImGui::Separator();
+
+        ImGui::Text("Disk usage");
+        ImGui::NextColumn();
+        ImGui::Text("%zu bytes (%zu reclaimable)", stats.disk_bytes, stats.compaction_debt);
+        ImGui::NextColumn();
+      }
     }
     ImGui::Separator();
     ImGui::Columns(1);
     ImGui::Unindent( 16.0f );
+    ImGui::Text("Routing stats");
+    ImGui::Indent( 16.0f );
+    ImGui::Columns(2);
+    ImGui::Separator();
+    {
+      // Cheap enough to do every frame, as it never locks
+      auto stats = local->get_routing_stats();
+      ImGui::Text("Buckets used");
+      ImGui::NextColumn();
+      ImGui::Text("%zu (%zu full)", stats.buckets_used, stats.buckets_full);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Replacements cached/used");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu", stats.replacements_cached, stats.replacements_used);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Evicted");
+      ImGui::NextColumn();
+      ImGui::Text("%zu contacts", stats.evictions);
+      ImGui::NextColumn();
+    }
+    {
+      auto stats = local->get_lookup_stats();
+      ImGui::Separator();
+
+      ImGui::Text("Lookups (failed)");
+      ImGui::NextColumn();
+      ImGui::Text("%zu (%zu)", stats.lookups, stats.failures);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Lookups shared/cached");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu", stats.coalesced, stats.cached);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Values cached on the way");
+      ImGui::NextColumn();
+      ImGui::Text("%zu", stats.path_caches);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Requests hedged/called off, lookups out of time");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu, %zu", stats.hedges, stats.cancelled, stats.out_of_time);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Lookup time (mean/p50/p99)");
+      ImGui::NextColumn();
+      ImGui::Text("%.1f/%.1f/%.1f ms", stats.mean_latency.count() / 1000.0,
+                  stats.p50_latency.count() / 1000.0, stats.p99_latency.count() / 1000.0);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Mean/max hops");
+      ImGui::NextColumn();
+      ImGui::Text("%.2f/%zu", stats.mean_hops, stats.max_hops);
+      ImGui::NextColumn();
+    }
+    {
+      auto stats = local->get_lookup_cache_stats();
+      ImGui::Separator();
+
+      ImGui::Text("Lookup cache hit rate (requests saved)");
+      ImGui::NextColumn();
+      auto total = stats.hits + stats.misses;
+      ImGui::Text("%.1f%% (%zu)", total ? 100.0 * stats.hits / total : 0.0, stats.requests_saved);
+      ImGui::NextColumn();
+    }
+    {
+      auto stats = local->get_store_stats();
+      ImGui::Separator();
+
+      ImGui::Text("Stores (failed/replicas in flight)");
+      ImGui::NextColumn();
+      ImGui::Text("%zu (%zu/%zu)", stats.stores, stats.failures, stats.in_flight);
+      ImGui::NextColumn();
+
+      ImGui::Separator();
+
+      ImGui::Text("Store time to quorum/all (p50/p99)");
+      ImGui::NextColumn();
+      ImGui::Text("%.1f/%.1f ms, %.1f/%.1f ms",
+                  stats.p50_quorum_latency.count() / 1000.0, stats.p99_quorum_latency.count() / 1000.0,
+                  stats.p50_replicated_latency.count() / 1000.0, stats.p99_replicated_latency.count() / 1000.0);
+      ImGui::NextColumn();
+    }
+    {
+      auto stats = local->get_channel_stats();
+      ImGui::Separator();
+
+      ImGui::Text("Channels open (reused/opened/closed)");
+      ImGui::NextColumn();
+      ImGui::Text("%zu (%zu/%zu/%zu)", stats.open, stats.hits, stats.misses, stats.evictions);
+      ImGui::NextColumn();
+    }
+    {
+      auto stats = local->get_batch_stats();
+      ImGui::Separator();
+
+      ImGui::Text("Requests/calls");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu", stats.requests, stats.calls);
+      ImGui::NextColumn();
+    }
+    {
+      auto stats = local->get_server_stats();
+      ImGui::Separator();
+
+      ImGui::Text("RPCs served/shed");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu", stats.served, stats.shed);
+      ImGui::NextColumn();
+    }
+    if (local->get_datagrams()) {
+      auto stats = local->get_datagram_stats();
+      ImGui::Separator();
+
+      ImGui::Text("Datagrams sent/resent/timed out/served/retried");
+      ImGui::NextColumn();
+      ImGui::Text("%zu/%zu/%zu/%zu/%zu", stats.requests, stats.retransmits, stats.timeouts, stats.served, stats.retries);
+      ImGui::NextColumn();
+    }
+    ImGui::Separator();
+    ImGui::Columns(1);
+    ImGui::Unindent( 16.0f );
+    if (ImGui::CollapsingHeader("Peer latency")) {
+      ImGui::Columns(4);
+      ImGui::Text("Peer");
+      ImGui::NextColumn();
+      ImGui::Text("SRTT (var)");
+      ImGui::NextColumn();
+      ImGui::Text("Timeout");
+      ImGui::NextColumn();
+      ImGui::Text("p50/p99 (samples)");
+      ImGui::NextColumn();
+      for (auto& i : local->get_peer_latencies()) {
+        ImGui::Separator();
+        ImGui::Text("%s", i.peer.location.c_str());
+        ImGui::NextColumn();
+        ImGui::Text("%.1f (%.1f) ms", i.srtt.count() / 1000.0, i.rttvar.count() / 1000.0);
+        ImGui::NextColumn();
+        ImGui::Text("%lld ms", static_cast<long long>(i.timeout.count()));
+        ImGui::NextColumn();
+        ImGui::Text("%.1f/%.1f ms (%zu)", i.histogram.percentile(0.5).count() / 1000.0,
+                    i.histogram.percentile(0.99).count() / 1000.0, i.histogram.count());
+        ImGui::NextColumn();
+      }
+      ImGui::Columns(1);
+    }
     if (ImGui::Button("Refresh")) {
       try { local->join(); }
       catch (const std::exception& e) {
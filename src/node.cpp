@@ -2,47 +2,250 @@
 
 #include "node.hpp"
 
+#include "arena.hpp"
+#include "async_server.hpp"
+#include "datagram.hpp"
 #include "internal.hpp"
 #include "k_buckets.hpp"
+#include "lookup_cache.hpp"
+#include "single_flight.hpp"
+#include "batcher.hpp"
 
 #include "internal.hpp"
 #include "format.pb.h"
 #include "format.grpc.pb.h"
 
-#include <queue>
+#include <grpcpp/resource_quota.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
 
 #include <thread>
-#include <future>
 
 namespace c3::kademlia {
-  class node::impl : public proto::Kademlia::Service {
+  using found_node_t = std::vector<contact>;
+  using found_value_t = buffer;
+  /// Someone who has the value, but too much of it to put in a reply
+  struct found_large_t {
+    contact holder;
+    size_t size;
+  };
+  using find_common_ret = std::variant<found_value_t, found_node_t, found_large_t>;
+
+  namespace {
+    // Someone who turns us away for being busy is still there, so rather than drop them we wait a
+    // little, twice as long each time, and ask again
+    constexpr size_t overload_retries = 2;
+    constexpr std::chrono::milliseconds overload_backoff{50};
+
+    bool is_overloaded(std::exception_ptr error) {
+      try { std::rethrow_exception(error); }
+      catch (const overloaded&) { return true; }
+      catch (...) { return false; }
+    }
+  }
+
+  struct find_iteration;
+
+  // The unary RPCs go through the callback API, so that their messages can come from our arenas.
+  // The streams stay synchronous, as they spend their time waiting on the network anyway
+  using service_base =
+    proto::Kademlia::WithCallbackMethod_ping<
+    proto::Kademlia::WithCallbackMethod_store<
+    proto::Kademlia::WithCallbackMethod_find_node<
+    proto::Kademlia::WithCallbackMethod_find_value<
+    proto::Kademlia::WithCallbackMethod_store_batch<
+    proto::Kademlia::WithCallbackMethod_find_node_batch<
+    proto::Kademlia::WithCallbackMethod_find_value_batch<
+    proto::Kademlia::Service>>>>>>>;
+
+  class node::impl : public service_base {
   public:
     node* parent;
+    // Before buckets, which tells it who comes and goes
+    lookup_cache recent_lookups;
     k_buckets buckets;
     std::shared_ptr<backing_store> back;
 
-    bool replicate_looping = true;
+    // Before batcher and engine, as replica stores still going when they go come back here
+    std::atomic<size_t> stores = 0;
+    std::atomic<size_t> failed_stores = 0;
+    std::atomic<size_t> stores_in_flight = 0;
+    latency_histogram store_quorum_latency;
+    latency_histogram store_replicated_latency;
+
+    // Must come before engine, whose callbacks come back here until it's gone
+    remote_node::batcher batcher{engine};
+    // Lookups go through here rather than spawning threads for each probe
+    rpc_engine engine;
+
+    std::atomic<size_t> lookups = 0;
+    std::atomic<size_t> failed_lookups = 0;
+    std::atomic<size_t> lookup_micros = 0;
+    std::atomic<size_t> lookup_hops = 0;
+    std::atomic<size_t> lookup_max_hops = 0;
+
+    latency_histogram lookup_latency;
+    // Every probe's round trip, for peers we haven't timed ourselves
+    latency_histogram probe_latency;
+    // Values we've found and left a copy of on the way
+    std::atomic<size_t> path_caches = 0;
+    std::atomic<size_t> hedged_probes = 0;
+    std::atomic<size_t> cancelled_probes = 0;
+    std::atomic<size_t> lookups_out_of_time = 0;
+
+    // Callers after the same target share one lookup, rather than each going over the network
+    single_flight<std::vector<contact>> node_lookups;
+    single_flight<std::variant<buffer, std::vector<contact>>> value_lookups;
+
+    // What we send back to everyone, so it's only built the once
+    const std::string nid_metadata;
+
+    arena_allocator<proto::PingRequest, proto::PingResponse> ping_messages;
+    arena_allocator<proto::StoreRequest, proto::StoreResponse> store_messages;
+    arena_allocator<proto::FindNodeRequest, proto::FindNodeResponse> find_node_messages;
+    arena_allocator<proto::FindValueRequest, proto::FindValueResponse> find_value_messages;
+    arena_allocator<proto::StoreBatchRequest, proto::StoreBatchResponse> store_batch_messages;
+    arena_allocator<proto::FindBatchRequest, proto::FindNodeBatchResponse> find_node_batch_messages;
+    arena_allocator<proto::FindBatchRequest, proto::FindValueBatchResponse> find_value_batch_messages;
+
+    /// Seeds obj from our buckets and runs it, keeping track of how it went
+    find_common_ret run_lookup(find_iteration& obj);
+
+    /// Wraps cb so that a successful reply feeds peer's round trip time
+    ///
+    /// The clock starts again each time the hook we give back is called, which is whenever the
+    /// request actually goes out. Otherwise a wait behind the peer's last batch, or for a datagram
+    /// that never came back, would be put down to them
+    template<typename T>
+    std::pair<remote_node::callback_t<T>, std::function<void()>> time_rpc(nid_t peer, remote_node::callback_t<T> cb) {
+      using clock = std::chrono::steady_clock;
+      auto sent = std::make_shared<std::atomic<clock::time_point>>(clock::now());
+      return {
+        [this, peer, cb = std::move(cb), sent](std::exception_ptr error, T res) {
+          if (!error) {
+            auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - sent->load());
+            buckets.observe_rtt(peer, rtt);
+            probe_latency.record(rtt);
+          }
+          cb(error, std::move(res));
+        },
+        [sent]() { sent->store(clock::now()); }
+      };
+    }
+
+    /// Asks c over datagrams if we use them and they answer them, and through the batcher otherwise
+    ///
+    /// Datagrams are only a packet each, so they're left to finish once cancel goes, but nothing
+    /// is sent after them
+    void probe_find_node(const contact& c, nid_t nid, std::shared_ptr<cancellation> cancel,
+                         remote_node::callback_t<found_node_t> cb, std::function<void()> sent) {
+      auto remote = remote_node::unchecked(parent, c, buckets.rpc_timeout(c.nid));
+      if (!datagram || !datagram->reachable(c.location)) {
+        remote.find_node(batcher, nid, std::move(cb), std::move(cancel), std::move(sent));
+        return;
+      }
+      sent();
+      remote.find_node(*datagram, nid, [this, remote, nid, cancel, cb = std::move(cb), sent]
+                                       (std::exception_ptr error, found_node_t res) mutable {
+        if (error && is_timeout(error)) {
+          datagram->mark_unreachable(remote.get_location());
+          remote.find_node(batcher, nid, std::move(cb), std::move(cancel), std::move(sent));
+        }
+        else
+          cb(error, std::move(res));
+      });
+    }
+    void probe_find_value(const contact& c, nid_t nid, std::shared_ptr<cancellation> cancel,
+                          remote_node::callback_t<remote_node::value_result_t> cb, std::function<void()> sent) {
+      auto remote = remote_node::unchecked(parent, c, buckets.rpc_timeout(c.nid));
+      if (!datagram || !datagram->reachable(c.location)) {
+        remote.find_value(batcher, nid, std::move(cb), std::move(cancel), std::move(sent));
+        return;
+      }
+      sent();
+      remote.find_value(*datagram, nid, [this, remote, nid, cancel, cb = std::move(cb), sent]
+                                        (std::exception_ptr error, remote_node::value_result_t res) mutable {
+        if (error && is_timeout(error)) {
+          datagram->mark_unreachable(remote.get_location());
+          remote.find_value(batcher, nid, std::move(cb), std::move(cancel), std::move(sent));
+        }
+        else
+          cb(error, std::move(res));
+      });
+    }
+
+    static bool is_timeout(std::exception_ptr error) {
+      try { std::rethrow_exception(error); }
+      catch (const timed_out&) { return true; }
+      catch (...) { return false; }
+    }
+
+    std::atomic<bool> replicate_looping = true;
     std::mutex replicate_looping_mutex;
     std::condition_variable replicate_looping_condvar;
     std::thread replicate_thread{&node::impl::rep_loop, this};
 
+    // Only in callback mode
+    std::atomic<size_t> served = 0;
+    // Goes before async, but after everything its handler uses
+    std::unique_ptr<datagram_transport> datagram;
+    // Only in async mode. Last, so that its queues stop before anything their calls use goes
+    std::unique_ptr<async_service<impl>> async;
+
   private:
     void rep_loop() {
       while (replicate_looping) {
-        std::unique_lock lock{replicate_looping_mutex};
-        if (replicate_looping_condvar.wait_for(lock, tReplicate, [&]() { return !replicate_looping; }))
-          return;
-        auto keys = back->get_all_keys();
-        for (auto i : keys) {
-          auto val = back->retrieve(i);
-          if (!val)
-            continue;
-          parent->store(i, val->dat, val->age);
+        {
+          std::unique_lock lock{replicate_looping_mutex};
+          if (replicate_looping_condvar.wait_for(lock, tReplicate, [&]() { return !replicate_looping; }))
+            return;
+        }
+
+        backing_store::cursor_t cursor;
+        while (!cursor.done && replicate_looping) {
+          // Keeps a replication pass from holding more than a batch of values at once
+          auto batch = back->scan(cursor, backing_store::default_scan_batch);
+          std::vector<store_item_t> items;
+          for (auto& [nid, val] : batch.items)
+            items.push_back({nid, val.dat.get(), val.age});
+          // This only throws once it's done all it can, so one bad key doesn't stop the rest. The
+          // values are only ours until the next batch, so every replica has to be done with them
+          try { parent->iterative_store(items, k); }
+          catch (...) {}
+          cursor = batch.next;
         }
       }
     }
 
   private:
+    /// Whatever we have of nid, whether it's stored here or a lookup only left us a copy
+    std::optional<backing_store::value_t> retrieve(const nid_t& nid) {
+      if (auto val = back->retrieve(nid))
+        return val;
+      return back->retrieve_cached(nid);
+    }
+    /// As retrieve, but without reading the value in
+    std::optional<size_t> size_of(const nid_t& nid) {
+      if (auto size = back->size_of(nid))
+        return size;
+      if (auto val = back->retrieve_cached(nid))
+        return val->dat.size();
+      return std::nullopt;
+    }
+    /// A piece of what retrieve would give
+    std::optional<buffer> read(const nid_t& nid, size_t offset, size_t length) {
+      if (auto piece = back->read(nid, offset, length))
+        return piece;
+      if (auto val = back->retrieve_cached(nid); val && offset <= val->dat.size())
+        return val->dat.slice(offset, std::min(length, val->dat.size() - offset));
+      return std::nullopt;
+    }
+    static std::chrono::seconds cache_ttl_of(const proto::StoreRequest& req) {
+      return std::chrono::seconds{std::min<uint64_t>(req.cache_ttl(), tExpire.count())};
+    }
+
     void find_node_impl(nid_t sender, nid_t nid, proto::FindNodeResponse* res) {
       auto nodes = buckets.find_node(sender, nid);
 
@@ -52,8 +255,9 @@ namespace c3::kademlia {
         c->set_location(i.location);
       }
     }
-    nid_t update(grpc::ServerContext* ctx) {
-      auto meta = ctx->client_metadata();
+    nid_t update(grpc::ServerContextBase* ctx) {
+      // These all point into the call's own buffers, so nothing is copied until we need to keep it
+      auto& meta = ctx->client_metadata();
 
       auto nid_iter = meta.find(metadata_nid_key);
       if (nid_iter == meta.end())
@@ -68,39 +272,91 @@ namespace c3::kademlia {
         throw std::runtime_error("Bad client port");
       //auto port = strtoul(port_iter->second.data(), nullptr, 10); //TODO: change port
 
-      try {
+      // Only someone new needs their location working out
+      if (!buckets.touch(nid)) {
         std::string_view port{ port_iter->second.data(), port_iter->second.size()};
         buckets.update({nid, replace_port(ctx->peer(), port)});
       }
-      catch (const std::exception& e) {
-        throw;
-      }
 
-      ctx->AddInitialMetadata(metadata_nid_key,
-        {reinterpret_cast<const char*>(parent->our_nid.data()), parent->our_nid.size()});
+      ctx->AddInitialMetadata(metadata_nid_key, nid_metadata);
 
       return nid;
     }
 
+    /// Runs a handler for the callback API, which doesn't turn exceptions into errors for us
+    template<typename Func>
+    grpc::ServerUnaryReactor* respond(grpc::CallbackServerContext* ctx, Func&& func) {
+      ++served;
+      auto reactor = ctx->DefaultReactor();
+      try { reactor->Finish(func()); }
+      catch (const std::exception& e) { reactor->Finish({grpc::StatusCode::UNKNOWN, e.what()}); }
+      catch (...) { reactor->Finish({grpc::StatusCode::UNKNOWN, ""}); }
+      return reactor;
+    }
+
   public:
-    grpc::Status ping(grpc::ServerContext* ctx, const proto::PingRequest*,
-                      proto::PingResponse*) override {
+    bool handle_datagram(const datagram_transport::message_t& req, datagram_transport::message_t& reply) {
+      using kind_t = datagram_transport::kind_t;
+
+      if (req.sender == parent->get_nid())
+        return false;
+      // Until they've shown they're really at the address it came from, the nid on it could be
+      // anyone's, and taking it would let them push whoever they liked out of our table
+      if (req.verified && !buckets.touch(req.sender))
+        buckets.update({req.sender, replace_port(req.from, std::to_string(req.port))});
+
+      switch (req.kind) {
+        case kind_t::ping:
+          reply.kind = kind_t::pong;
+          return true;
+        case kind_t::find_node:
+          reply.kind = kind_t::nodes;
+          reply.contacts = buckets.find_node(req.sender, req.target);
+          return true;
+        case kind_t::find_value: {
+          // Anything that won't fit in a datagram is fetched over gRPC, so isn't worth reading in
+          auto size = size_of(req.target);
+          std::optional<backing_store::value_t> val;
+          if (size && datagram_transport::header_size + *size > datagram_transport::max_datagram) {
+            reply.kind = kind_t::large_value;
+            reply.size = *size;
+          }
+          else if (size && (val = retrieve(req.target))) {
+            reply.kind = kind_t::value;
+            reply.value = val->dat;
+          }
+          else {
+            reply.kind = kind_t::nodes;
+            reply.contacts = buckets.find_node(req.sender, req.target);
+          }
+          return true;
+        }
+        default:
+          return false;
+      }
+    }
+
+    grpc::Status handle_ping(grpc::ServerContextBase* ctx, const proto::PingRequest*,
+                             proto::PingResponse*) {
       update(ctx);
 
       return grpc::Status::OK;
     }
 
-    grpc::Status store(grpc::ServerContext* ctx, const proto::StoreRequest* req,
-                       proto::StoreResponse* res) override {
+    grpc::Status handle_store(grpc::ServerContextBase* ctx, const proto::StoreRequest* req,
+                              proto::StoreResponse* res) {
       update(ctx);
 
-      res->set_success(back->store(string_to_data(req->data())));
+      if (req->cache_ttl())
+        res->set_success(back->cache(buffer::copy(string_to_data(req->data())), cache_ttl_of(*req)));
+      else
+        res->set_success(back->store(string_to_data(req->data())));
 
       return grpc::Status::OK;
     }
 
-    grpc::Status find_node(grpc::ServerContext* ctx, const proto::FindNodeRequest* req,
-                           proto::FindNodeResponse* res) override {
+    grpc::Status handle_find_node(grpc::ServerContextBase* ctx, const proto::FindNodeRequest* req,
+                                  proto::FindNodeResponse* res) {
       nid_t sender = update(ctx);
 
       find_node_impl(sender, deserialise_nid(req->nid()), res);
@@ -108,13 +364,19 @@ namespace c3::kademlia {
       return grpc::Status::OK;
     }
 
-    grpc::Status find_value(grpc::ServerContext* ctx, const proto::FindValueRequest* req,
-                            proto::FindValueResponse* res) override {
+    grpc::Status handle_find_value(grpc::ServerContextBase* ctx, const proto::FindValueRequest* req,
+                                   proto::FindValueResponse* res) {
       nid_t sender = update(ctx);
 
       nid_t nid = deserialise_nid(req->nid());
 
-      if (auto val = back->retrieve(nid))
+      // Big values are left for find_value_stream, so we only read in those that fit. retrieve
+      // only hands us a reference, so this is the one copy, into protobuf's own string
+      auto size = size_of(nid);
+      std::optional<backing_store::value_t> val;
+      if (size && *size > stream_threshold)
+        res->set_found_size(*size);
+      else if (size && (val = retrieve(nid)))
         res->set_found(val->dat.data(), val->dat.size());
       else
         find_node_impl(sender, deserialise_nid(req->nid()), res->mutable_not_found());
@@ -122,9 +384,219 @@ namespace c3::kademlia {
       return grpc::Status::OK;
     }
 
+    grpc::Status handle_store_batch(grpc::ServerContextBase* ctx, const proto::StoreBatchRequest* req,
+                                    proto::StoreBatchResponse* res) {
+      update(ctx);
+
+      if (static_cast<size_t>(req->values_size()) > remote_node::batcher::max_batch)
+        return {grpc::StatusCode::INVALID_ARGUMENT, "Batch too big"};
+
+      // Copies left by lookups go to the cache as they come, and the rest are stored together
+      std::vector<bool> success(static_cast<size_t>(req->values_size()), false);
+      std::vector<backing_store::value_t> values;
+      std::vector<size_t> positions;
+      values.reserve(success.size());
+      for (size_t i = 0; i < success.size(); ++i) {
+        auto& val = req->values(static_cast<int>(i));
+        auto dat = buffer::copy(string_to_data(val.data()));
+        if (val.cache_ttl())
+          success[i] = back->cache(std::move(dat), cache_ttl_of(val));
+        else {
+          values.push_back({std::move(dat), age_t{val.age()}});
+          positions.push_back(i);
+        }
+      }
+
+      auto stored = back->store_batch(std::move(values));
+      for (size_t i = 0; i < positions.size() && i < stored.size(); ++i)
+        success[positions[i]] = stored[i];
+      for (auto i : success)
+        res->add_success(i);
+
+      return grpc::Status::OK;
+    }
+
+    grpc::Status handle_find_node_batch(grpc::ServerContextBase* ctx, const proto::FindBatchRequest* req,
+                                        proto::FindNodeBatchResponse* res) {
+      nid_t sender = update(ctx);
+
+      if (static_cast<size_t>(req->nids_size()) > remote_node::batcher::max_batch)
+        return {grpc::StatusCode::INVALID_ARGUMENT, "Batch too big"};
+
+      for (auto& i : req->nids())
+        find_node_impl(sender, deserialise_nid(i), res->add_results());
+
+      return grpc::Status::OK;
+    }
+
+    grpc::Status handle_find_value_batch(grpc::ServerContextBase* ctx, const proto::FindBatchRequest* req,
+                                         proto::FindValueBatchResponse* res) {
+      nid_t sender = update(ctx);
+
+      if (static_cast<size_t>(req->nids_size()) > remote_node::batcher::max_batch)
+        return {grpc::StatusCode::INVALID_ARGUMENT, "Batch too big"};
+
+      std::vector<nid_t> nids;
+      for (auto& i : req->nids())
+        nids.push_back(deserialise_nid(i));
+
+      // Past this, values are left for find_value_stream, so the reply stays a sensible size. We
+      // work out which those are from their sizes, so that they're never read in
+      size_t budget = stream_threshold;
+      std::vector<std::optional<size_t>> sizes;
+      std::vector<bool> fits;
+      std::vector<nid_t> wanted;
+      for (auto& i : nids) {
+        sizes.push_back(size_of(i));
+        fits.push_back(sizes.back() && *sizes.back() <= budget);
+        if (fits.back()) {
+          budget -= *sizes.back();
+          wanted.push_back(i);
+        }
+      }
+
+      auto found = back->retrieve_batch(wanted);
+      for (size_t i = 0; i < found.size(); ++i)
+        if (!found[i])
+          found[i] = back->retrieve_cached(wanted[i]);
+
+      for (size_t i = 0, j = 0; i < nids.size(); ++i) {
+        auto result = res->add_results();
+        std::optional<backing_store::value_t> val;
+        if (fits[i] && j < found.size())
+          val = std::move(found[j++]);
+
+        if (val)
+          result->set_found(val->dat.data(), val->dat.size());
+        else if (sizes[i] && !fits[i])
+          result->set_found_size(*sizes[i]);
+        // Includes anything that went between our looking at its size and reading it
+        else
+          find_node_impl(sender, nids[i], result->mutable_not_found());
+      }
+
+      return grpc::Status::OK;
+    }
+
+  public:
+    grpc::ServerUnaryReactor* ping(grpc::CallbackServerContext* ctx, const proto::PingRequest* req,
+                                   proto::PingResponse* res) override {
+      return respond(ctx, [&]() { return handle_ping(ctx, req, res); });
+    }
+    grpc::ServerUnaryReactor* store(grpc::CallbackServerContext* ctx, const proto::StoreRequest* req,
+                                    proto::StoreResponse* res) override {
+      return respond(ctx, [&]() { return handle_store(ctx, req, res); });
+    }
+    grpc::ServerUnaryReactor* find_node(grpc::CallbackServerContext* ctx, const proto::FindNodeRequest* req,
+                                        proto::FindNodeResponse* res) override {
+      return respond(ctx, [&]() { return handle_find_node(ctx, req, res); });
+    }
+    grpc::ServerUnaryReactor* find_value(grpc::CallbackServerContext* ctx, const proto::FindValueRequest* req,
+                                         proto::FindValueResponse* res) override {
+      return respond(ctx, [&]() { return handle_find_value(ctx, req, res); });
+    }
+    grpc::ServerUnaryReactor* store_batch(grpc::CallbackServerContext* ctx, const proto::StoreBatchRequest* req,
+                                          proto::StoreBatchResponse* res) override {
+      return respond(ctx, [&]() { return handle_store_batch(ctx, req, res); });
+    }
+    grpc::ServerUnaryReactor* find_node_batch(grpc::CallbackServerContext* ctx, const proto::FindBatchRequest* req,
+                                              proto::FindNodeBatchResponse* res) override {
+      return respond(ctx, [&]() { return handle_find_node_batch(ctx, req, res); });
+    }
+    grpc::ServerUnaryReactor* find_value_batch(grpc::CallbackServerContext* ctx, const proto::FindBatchRequest* req,
+                                               proto::FindValueBatchResponse* res) override {
+      return respond(ctx, [&]() { return handle_find_value_batch(ctx, req, res); });
+    }
+
+    grpc::Status store_stream(grpc::ServerContext* ctx, grpc::ServerReader<proto::StoreChunk>* reader,
+                              proto::StoreResponse* res) override {
+      update(ctx);
+
+      proto::StoreChunk chunk;
+      if (!reader->Read(&chunk))
+        return {grpc::StatusCode::INVALID_ARGUMENT, "Empty store_stream"};
+
+      // Each chunk goes straight into the store, so we only ever hold the one we're reading
+      auto writer = back->begin_store(chunk.size(), age_t{chunk.age()});
+      if (!writer) {
+        res->set_success(false);
+        return grpc::Status::OK;
+      }
+
+      while (true) {
+        if (!writer->write(string_to_data(chunk.data()))) {
+          res->set_success(false);
+          return grpc::Status::OK;
+        }
+        // The last chunk carries the nid
+        if (!chunk.nid().empty())
+          break;
+        if (!reader->Read(&chunk))
+          return {grpc::StatusCode::INVALID_ARGUMENT, "store_stream ended without a nid"};
+      }
+
+      res->set_success(writer->commit(deserialise_nid(chunk.nid())));
+
+      return grpc::Status::OK;
+    }
+
+    grpc::Status find_value_stream(grpc::ServerContext* ctx, const proto::FindValueRequest* req,
+                                   grpc::ServerWriter<proto::FindValueChunk>* writer) override {
+      nid_t sender = update(ctx);
+
+      nid_t nid = deserialise_nid(req->nid());
+
+      proto::FindValueChunk chunk;
+      auto size = size_of(nid);
+      if (!size) {
+        find_node_impl(sender, nid, chunk.mutable_not_found());
+        writer->Write(chunk);
+        return grpc::Status::OK;
+      }
+
+      chunk.set_size(*size);
+      if (!writer->Write(chunk))
+        return grpc::Status::CANCELLED;
+
+      // We only read each chunk as it's about to go, so however big the value, we only hold one.
+      // Write waits on flow control, so a slow reader holds us back rather than piling up chunks
+      for (size_t off = 0; off < *size;) {
+        auto piece = read(nid, off, chunk_size);
+        // Gone from under us, so what they have so far won't match its nid
+        if (!piece || piece->empty())
+          return {grpc::StatusCode::NOT_FOUND, "Value went while streaming it"};
+        chunk.set_data(piece->data(), piece->size());
+        if (!writer->Write(chunk))
+          return grpc::Status::CANCELLED;
+        off += piece->size();
+      }
+
+      return grpc::Status::OK;
+    }
+
   public:
     impl(node* parent, std::shared_ptr<backing_store> store) :
-      parent{parent}, buckets{parent}, back{std::move(store)} {}
+      parent{parent},
+      buckets{parent, [parent](const contact& c) {
+        // Constructing one pings it, unless they answered something a moment ago
+        try { remote_node{parent, c}; return true; }
+        catch (...) { return is_overloaded(std::current_exception()); }
+      }, [this](const nid_t& nid, bool joined) {
+        if (joined)
+          recent_lookups.learned(nid);
+        else
+          recent_lookups.dropped(nid);
+      }},
+      back{std::move(store)},
+      nid_metadata{reinterpret_cast<const char*>(parent->get_nid().data()), parent->get_nid().size()} {
+      SetMessageAllocatorFor_ping(&ping_messages);
+      SetMessageAllocatorFor_store(&store_messages);
+      SetMessageAllocatorFor_find_node(&find_node_messages);
+      SetMessageAllocatorFor_find_value(&find_value_messages);
+      SetMessageAllocatorFor_store_batch(&store_batch_messages);
+      SetMessageAllocatorFor_find_node_batch(&find_node_batch_messages);
+      SetMessageAllocatorFor_find_value_batch(&find_value_batch_messages);
+    }
 
     ~impl() {
       {
@@ -138,22 +610,53 @@ namespace c3::kademlia {
   };
 
   // Now we have the impl, we can define the destructor
-  node::~node() = default;
+  node::~node() {
+    // Our own queues can only be drained once the server is shut down, and must be before it goes
+    if (server)
+      server->Shutdown();
+    if (service->async)
+      service->async->stop();
+  }
 
-  node::node(std::string addr, nid_t nid, std::shared_ptr<backing_store> store) :
+  node::node(std::string addr, nid_t nid, std::shared_ptr<backing_store> store, server_options_t options) :
     our_nid{nid},
     service{std::make_unique<impl>(this, store)} {
     int bound_port = 0;
     grpc::ServerBuilder builder;
     builder.AddListeningPort(addr, grpc::InsecureServerCredentials(), &bound_port);
-    builder.RegisterService(service.get());
+
+    grpc::ResourceQuota quota{"kademlia-" + addr};
+    if (options.memory_quota)
+      quota.Resize(options.memory_quota);
+    if (options.max_threads)
+      quota.SetMaxThreads(static_cast<int>(options.max_threads));
+    builder.SetResourceQuota(quota);
+
+    if (options.mode == server_options_t::mode_t::async) {
+      service->async = std::make_unique<async_service<impl>>(*service, builder, options.queues,
+                                                             options.threads_per_queue, options.max_backlog);
+      builder.RegisterService(service->async.get());
+    }
+    else
+      builder.RegisterService(service.get());
+
     server = builder.BuildAndStart();
     if (bound_port == 0)
       throw std::runtime_error("Could not open port");
+    if (service->async)
+      service->async->start();
+
+    if (options.datagrams)
+      service->datagram = std::make_unique<datagram_transport>(
+        std::string_view{addr}.substr(0, addr.find_last_of(':')), static_cast<uint16_t>(bound_port), our_nid,
+        [svc = service.get()](auto& req, auto& reply) { return svc->handle_datagram(req, reply); });
 
     our_port = std::to_string(bound_port);
   }
 
+  node::node(std::string addr, nid_t nid, std::shared_ptr<backing_store> store) :
+    node{std::move(addr), nid, std::move(store), server_options_t{}} {}
+
   remote_node node::connect(std::string location) {
     return {this, location};
   }
@@ -163,7 +666,8 @@ namespace c3::kademlia {
       return { this, c };
     }
     catch(...) {
-      service->buckets.drop(c.nid);
+      if (!is_overloaded(std::current_exception()))
+        service->buckets.drop(c.nid);
       throw;
     }
   }
@@ -177,6 +681,10 @@ namespace c3::kademlia {
     return service->buckets.count();
   }
 
+  node::routing_stats_t node::get_routing_stats() const {
+    return service->buckets.get_stats();
+  }
+
   void node::join() {
     auto found = iterative_find_node(get_nid());
 
@@ -184,11 +692,11 @@ namespace c3::kademlia {
       add_peer(i.location);
   }
 
-  std::optional<std::vector<uint8_t>> node::find(nid_t nid) {
+  std::optional<buffer> node::find(nid_t nid) {
     auto ret = iterative_find_value(nid);
-    return std::visit([&](auto val) -> std::optional<std::vector<uint8_t>> {
+    return std::visit([&](auto val) -> std::optional<buffer> {
       using T = std::decay_t<decltype(val)>;
-      if constexpr (std::is_same_v<std::vector<uint8_t>, T>) {
+      if constexpr (std::is_same_v<buffer, T>) {
         // Give us a copy that will not be replicated, in case we want it later
         service->back->store(val);
         return val;
@@ -198,197 +706,684 @@ namespace c3::kademlia {
     }, ret);
   }
 
-  using found_node_t = std::vector<contact>;
-  using found_value_t = std::vector<uint8_t>;
-  using find_common_ret = std::variant<found_value_t, found_node_t>;
-
+  /// One iterative lookup
+  ///
+  /// The shortlist is kept in order of XOR distance from the target, and as soon as a reply comes
+  /// in, the closest candidate nobody has asked yet is sent a request, so that there are always
+  /// alpha in flight. We're done once the k closest we know of that are still alive have all
+  /// answered.
+  ///
+  /// Anyone who takes longer than their p95 to answer is overdue, and has the next closest asked
+  /// alongside them, so one slow peer doesn't hold the rest up. A node lookup can finish without
+  /// them, but a value lookup can't say there's no value while they might still give it to us.
+  /// Whatever is still in flight once we have our answer, or once the deadline is up, is called off.
+  /// Anyone too busy to answer is asked again after a backoff, and never dropped from the routing
+  /// table for it.
   struct find_iteration {
-    std::vector<contact> contacted;
-    std::queue<contact> uncontacted;
-    // If something is in this collection, but neither of the contacted or uncontacted collections,
-    // then it will be ignored
-    std::set<nid_t> all;
-    // The one value we can be sure will not turn up: us
-    nid_t closest_node;
+    enum class state_t { waiting, in_flight, answered, failed };
+
+    struct candidate_t {
+      contact c;
+      state_t state = state_t::waiting;
+      // How many requests deep in the lookup this one will be asked in
+      size_t hop = 1;
+      std::chrono::microseconds expected_rtt{0};
+      std::chrono::microseconds p95_rtt{0};
+      // Once in flight, when we stop waiting on them alone
+      std::chrono::steady_clock::time_point hedge_at = {};
+      bool overdue = false;
+      // If they were too busy to answer, when to ask again, and how many times they have been
+      std::chrono::steady_clock::time_point retry_at = {};
+      size_t retries = 0;
+    };
+
+    struct reply_t {
+      distance_key key;
+      std::exception_ptr error;
+      find_common_ret res;
+    };
+
+    /// Shared with the callbacks, so that stragglers have somewhere to go once we've returned
+    struct inbox_t {
+      std::mutex replies_mutex;
+      std::condition_variable replies_condvar;
+      std::vector<reply_t> replies;
+    };
+
     nid_t nid;
-    std::function<remote_node(contact)> connect;
+    std::map<distance_key, candidate_t> shortlist;
+    std::shared_ptr<inbox_t> inbox = std::make_shared<inbox_t>();
+    /// Calls off whatever we're still waiting on, once we have what we wanted
+    std::shared_ptr<cancellation> outstanding = std::make_shared<cancellation>();
+    /// When we give up and go with whoever we've heard from
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    size_t in_flight = 0;
+    /// Those in flight that have taken longer than they usually would, who each let one more go
+    size_t overdue = 0;
+    /// How many we asked because someone else was overdue
+    size_t hedges = 0;
+    /// Whether we ran out of time before the lookup was done
+    bool out_of_time = false;
+    /// Whether we're after a value, which anyone overdue may be about to give us, so that nobody
+    /// else answering can tell us it isn't there
+    bool finding_value = false;
+    /// What we take the p95 of anyone we haven't timed to be
+    std::chrono::microseconds untimed_p95 = rtt_estimate::min_timeout;
+    /// Once we're done, how deep the lookup went to get its answer
+    size_t hops = 0;
+    /// How many we've asked
+    size_t requests = 0;
+    /// Whoever gave us the value, if anyone did
+    std::optional<distance_key> holder;
+    /// Starts asking a contact, and calls back from wherever the answer turns up, unless it's been
+    /// cancelled by then
+    std::function<void(contact, std::shared_ptr<cancellation>, remote_node::callback_t<find_common_ret>)> probe;
     std::function<void(nid_t)> drop;
-    std::function<find_common_ret(remote_node&)> find;
+    std::function<rtt_estimate(const nid_t&)> rtt_of;
 
-    void add_candidate(contact i) {
-      all.insert(i.nid);
-      uncontacted.push(i);
+    distance_key key_of(const nid_t& n) const {
+      distance_key ret;
+      distance_keys(nid, {&n, 1}, &ret);
+      return ret;
     }
 
-    std::optional<find_common_ret> iterate() {
-      size_t to_probe = std::min(alpha, uncontacted.size());
-      std::vector<contact> closest_n;
-      std::vector<std::future<find_common_ret>> threads;
-      closest_n.reserve(to_probe);
-      // NOTE: not a typo, this is to allow std::transform
-      threads.resize(to_probe);
+    void add_candidate(contact i, size_t hop = 1) {
+      auto key = key_of(i.nid);
+      if (shortlist.find(key) != shortlist.end())
+        return;
+      auto rtt = rtt_of(i.nid);
+      candidate_t cand;
+      cand.c = std::move(i);
+      cand.hop = hop;
+      cand.expected_rtt = rtt.expected();
+      cand.p95_rtt = rtt.known() ? rtt.p95() : untimed_p95;
+      shortlist.emplace(key, std::move(cand));
+    }
 
-      for (size_t i = 0; i < to_probe; ++i) {
-        closest_n.push_back(uncontacted.front());
-        // Temporarily reject this node
-        uncontacted.pop();
+    /// Those that have answered, closest first
+    std::vector<contact> contacted(size_t max = std::numeric_limits<size_t>::max()) const {
+      std::vector<contact> ret;
+      for (auto& [key, cand] : shortlist) {
+        if (ret.size() == max)
+          break;
+        if (cand.state == state_t::answered)
+          ret.push_back(cand.c);
       }
-      std::transform(closest_n.begin(), closest_n.end(), threads.begin(),
-                     [&](auto c) {
-        return std::async(std::launch::async, [&, c]() -> find_common_ret {
-          remote_node remote = connect(c);
-          auto remote_nid = remote.get_nid();
-
-          if (std::find_if(contacted.begin(), contacted.end(),
-                           [&](auto i) { return i.nid == remote_nid; }) != contacted.end())
-            throw std::runtime_error("I already have been searched!");
-
-          auto res = find(remote);
-
-          return std::visit([&](auto val) -> find_common_ret {
-            using T = std::decay_t<decltype(val)>;
-            if constexpr (std::is_same_v<found_value_t, T>)
-              return val;
-            else {
-              std::vector<contact> ret;
-              for (auto& i : val)
-                if (all.find(i.nid) == all.end())
-                  ret.emplace_back(std::move(i));
-              return find(remote);
-            }
-          }, res);
+      return ret;
+    }
+
+    bool start(const distance_key& key, candidate_t& cand) {
+      try {
+        probe(cand.c, outstanding, [inbox = inbox, key](std::exception_ptr error, find_common_ret res) {
+          std::unique_lock lock{inbox->replies_mutex};
+          inbox->replies.push_back({key, error, std::move(res)});
+          inbox->replies_condvar.notify_all();
         });
-      });
+      }
+      catch (...) {
+        cand.state = state_t::failed;
+        drop(cand.c.nid);
+        return false;
+      }
 
-      std::optional<std::vector<uint8_t>> end_value;
+      cand.state = state_t::in_flight;
+      cand.hedge_at = std::chrono::steady_clock::now() + cand.p95_rtt;
+      ++in_flight;
+      ++requests;
+      return true;
+    }
 
-      for (size_t i = 0; i < threads.size(); ++i) {
-        try {
-          auto res = threads[i].get();
+    /// Marks whoever has been in flight longer than their p95 as overdue, and returns when the next
+    /// one will be
+    std::chrono::steady_clock::time_point find_overdue() {
+      auto now = std::chrono::steady_clock::now();
+      auto ret = deadline;
+      for (auto& [key, cand] : shortlist) {
+        if (cand.state != state_t::in_flight || cand.overdue)
+          continue;
+        if (cand.hedge_at <= now) {
+          cand.overdue = true;
+          ++overdue;
+        }
+        else
+          ret = std::min(ret, cand.hedge_at);
+      }
+      return ret;
+    }
 
-          contacted.push_back(closest_n[i]);
+    /// The k closest that answered, and how deep we had to go for them
+    found_node_t closest_answered() {
+      auto ret = contacted(k);
+      for (auto& i : ret)
+        hops = std::max(hops, shortlist.at(key_of(i.nid)).hop);
+      return ret;
+    }
 
-          std::visit([&](auto& val) {
-            using T = std::decay_t<decltype(val)>;
-            if constexpr (std::is_same_v<T, found_value_t>) {
-              end_value = val;
-            }
-            else {
-              // Unreject this node
-              for (auto& i : val) {
-                if (all.find(i.nid) != all.end())
-                  continue;
+    /// Returns the value, or who has it, if that's what this was
+    std::optional<find_common_ret> handle(reply_t& reply) {
+      --in_flight;
 
-                add_candidate(i);
-              }
-            }
-          }, res);
-        }
-        // Do nothing, as it is already only in all, and therefore rejected
-        catch (...) {
-          drop(closest_n[i].nid);
+      auto iter = shortlist.find(reply.key);
+      if (iter == shortlist.end())
+        return std::nullopt;
+      auto& cand = iter->second;
+      if (cand.overdue) {
+        cand.overdue = false;
+        --overdue;
+      }
+
+      if (reply.error) {
+        bool busy = is_overloaded(reply.error);
+        if (busy && cand.retries < overload_retries) {
+          cand.state = state_t::waiting;
+          cand.retry_at = std::chrono::steady_clock::now() + overload_backoff * (1 << cand.retries);
+          ++cand.retries;
+          return std::nullopt;
         }
+        cand.state = state_t::failed;
+        if (!busy)
+          drop(cand.c.nid);
+        return std::nullopt;
+      }
+
+      cand.state = state_t::answered;
+      if (auto found = std::get_if<found_node_t>(&reply.res)) {
+        for (auto& i : *found)
+          add_candidate(std::move(i), cand.hop + 1);
+        return std::nullopt;
       }
 
-      if (end_value)
-        return *end_value;
+      hops = cand.hop;
+      holder = reply.key;
+      return std::move(reply.res);
+    }
 
-      if (contacted.size() == k)
-        return contacted;
+    /// The closest we asked who didn't have the value, which is where Kademlia caches it
+    std::optional<contact> closest_non_holder() const {
+      for (auto& [key, cand] : shortlist)
+        if (cand.state == state_t::answered && key != holder)
+          return cand.c;
+      return std::nullopt;
+    }
 
-      if (uncontacted.size() == 0 && contacted.size() == 0)
-        throw std::runtime_error("All nodes broken");
+    /// How long c should keep a copy of the value for
+    ///
+    /// Kademlia makes this inversely proportional to how many nodes sit between c and where the
+    /// value lives. Each bit that c's distance has over that of whoever gave it to us, or failing
+    /// them the closest who answered, roughly doubles that, so each one halves the time.
+    std::chrono::seconds path_cache_ttl(const contact& c) const {
+      const contact* from = nullptr;
+      if (auto iter = holder ? shortlist.find(*holder) : shortlist.end(); iter != shortlist.end())
+        from = &iter->second.c;
+      for (auto i = shortlist.begin(); !from && i != shortlist.end(); ++i)
+        if (i->second.state == state_t::answered)
+          from = &i->second.c;
+
+      size_t ours = distance(nid, c.nid);
+      size_t theirs = from ? distance(nid, from->nid) : ours;
+      size_t between = ours > theirs ? ours - theirs : 0;
+
+      auto full = std::chrono::duration_cast<std::chrono::seconds>(tExpire);
+      return std::max<std::chrono::seconds>(std::chrono::seconds{60}, full / (int64_t{1} << std::min<size_t>(between, 32)));
+    }
 
-      nid_t new_closest;
-      // Note how we cannot have no nodes, so this will always select a node
-      {
-        auto iter = all.cbegin();
-        size_t new_min_dist = distance(*iter, nid);
-        auto closest = iter;
-        while (iter != all.cend()) {
-          if (auto dist = distance(nid, *iter); dist < new_min_dist) {
-            closest = iter;
-            new_min_dist = dist;
+    find_common_ret run() {
+      while (true) {
+        // Walk the k closest that are still alive, to see who is left to ask. Anyone overdue is
+        // passed over until they answer, so that the next closest is asked in their place
+        size_t alive = 0;
+        bool settled = true;
+        auto now = std::chrono::steady_clock::now();
+        // When the first of those backing off is due
+        auto retry = std::chrono::steady_clock::time_point::max();
+        std::vector<std::pair<const distance_key*, candidate_t*>> waiting;
+        for (auto& [key, cand] : shortlist) {
+          if (cand.state == state_t::failed)
+            continue;
+          if (cand.overdue) {
+            if (finding_value)
+              settled = false;
+            continue;
           }
-		  ++iter;
+          if (alive++ == k)
+            break;
+
+          if (cand.state == state_t::waiting && cand.retry_at > now)
+            retry = std::min(retry, cand.retry_at);
+          else if (cand.state == state_t::waiting)
+            waiting.emplace_back(&key, &cand);
+          if (cand.state != state_t::answered)
+            settled = false;
         }
-        new_closest = *closest;
-      }
-      // FIXME: This returns few nodes
-      if (std::equal(closest_node.begin(), closest_node.end(), new_closest.begin()))
-        return contacted;
 
-      closest_node = new_closest;
+        // Those whose distances share a top bit are about as close as each other, so amongst
+        // those we'd rather ask whoever answers quickest
+        std::stable_sort(waiting.begin(), waiting.end(), [&](auto& a, auto& b) {
+          return std::make_pair(distance(nid, a.second->c.nid), a.second->expected_rtt) <
+                 std::make_pair(distance(nid, b.second->c.nid), b.second->expected_rtt);
+        });
+        bool lost_some = false;
+        for (auto& [key, cand] : waiting) {
+          if (in_flight >= alpha + overdue)
+            break;
+          bool hedge = in_flight >= alpha;
+          if (!start(*key, *cand))
+            lost_some = true;
+          else if (hedge)
+            ++hedges;
+        }
 
-      return std::nullopt;
-    }
+        // Someone further out may now be in the k closest
+        if (lost_some)
+          continue;
+        // With nobody left to take their place, the overdue are as close as we'll get
+        if (alive <= k && overdue)
+          settled = false;
+
+        if (settled) {
+          auto ret = closest_answered();
+          if (ret.empty())
+            throw std::runtime_error("All nodes broken");
+          return ret;
+        }
 
-    find_common_ret iterate_until_done() {
-      std::optional<find_common_ret> ret;
-      do ret = iterate();
-      while (!ret);
-      return *ret;
+        // The best we can do now is whoever we've heard from so far
+        if (std::chrono::steady_clock::now() >= deadline) {
+          out_of_time = true;
+          auto ret = closest_answered();
+          if (ret.empty())
+            throw timed_out{};
+          return ret;
+        }
+
+        auto wake = std::min(find_overdue(), retry);
+        std::vector<reply_t> replies;
+        {
+          std::unique_lock lock{inbox->replies_mutex};
+          auto ready = [&]() { return !inbox->replies.empty(); };
+          if (wake == std::chrono::steady_clock::time_point::max())
+            inbox->replies_condvar.wait(lock, ready);
+          else
+            inbox->replies_condvar.wait_until(lock, wake, ready);
+          replies.swap(inbox->replies);
+        }
+        // Someone may have gone overdue while we waited, which lets someone else go
+        find_overdue();
+
+        for (auto& i : replies)
+          if (auto val = handle(i))
+            return std::move(*val);
+      }
     }
 
   public:
-    find_iteration(nid_t nid, nid_t our_nid, decltype(connect) connect, decltype(drop) drop,
-                   decltype(find) find) :
-      closest_node{our_nid}, nid{nid}, connect{connect}, drop{drop}, find{find} {}
+    find_iteration(nid_t nid, decltype(probe) probe, decltype(drop) drop, decltype(rtt_of) rtt_of) :
+      nid{nid}, probe{probe}, drop{drop}, rtt_of{rtt_of} {}
   };
 
-  std::vector<contact> node::iterative_find_node(nid_t nid) {
-    find_iteration obj(nid, our_nid,
-                       [&](auto i) { return connect(i); },
-                       [&](auto i) { service->buckets.drop(i); },
-                       [&](remote_node& remote) { return remote.find_node(nid); });
-    for (auto i : service->buckets.get_alpha(nid))
+  find_common_ret node::impl::run_lookup(find_iteration& obj) {
+    if (probe_latency.count())
+      obj.untimed_p95 = probe_latency.percentile(0.95);
+    // Seed with all the k closest we know, so that there is someone to fall back on
+    for (auto i : buckets.find_node(parent->get_nid(), obj.nid))
       obj.add_candidate(i);
 
-    return std::get<std::vector<contact>>(obj.iterate_until_done());
-  }
+    auto start = std::chrono::steady_clock::now();
+    if (auto budget = parent->get_lookup_budget(); budget > budget.zero())
+      obj.deadline = start + budget;
 
-  std::variant<std::vector<uint8_t>, std::vector<contact>> node::iterative_find_value(nid_t nid) {
-    find_iteration obj(nid, our_nid,
-                       [&](auto i) { return connect(i); },
-                       [&](auto i) { service->buckets.drop(i); },
-                       [&](remote_node& remote) { return remote.find_value(nid); });
+    // Whatever is still going once we're done has nobody to go to
+    auto call_off = [&]() {
+      cancelled_probes += obj.in_flight;
+      obj.outstanding->cancel();
+      hedged_probes += obj.hedges;
+      if (obj.out_of_time)
+        ++lookups_out_of_time;
+    };
 
-    for (auto i : service->buckets.get_alpha(nid))
-      obj.add_candidate(i);
+    try {
+      auto ret = obj.run();
+      auto took = std::chrono::steady_clock::now() - start;
+      call_off();
+
+      ++lookups;
+      auto took_us = std::chrono::duration_cast<std::chrono::microseconds>(took);
+      lookup_micros += static_cast<size_t>(took_us.count());
+      lookup_latency.record(took_us);
+      lookup_hops += obj.hops;
+      for (size_t prev = lookup_max_hops; prev < obj.hops && !lookup_max_hops.compare_exchange_weak(prev, obj.hops););
+
+      return ret;
+    }
+    catch (...) {
+      call_off();
+      ++failed_lookups;
+      throw;
+    }
+  }
 
-    auto ret = obj.iterate_until_done();
+  std::vector<contact> node::iterative_find_node(nid_t nid) {
+    return service->node_lookups.get(nid, [&]() {
+      find_iteration obj(nid,
+                         [&](contact c, std::shared_ptr<cancellation> cancel, remote_node::callback_t<find_common_ret> cb) {
+                           auto [timed, sent] = service->time_rpc(c.nid, std::move(cb));
+                           service->probe_find_node(c, nid, std::move(cancel), [timed = std::move(timed)](std::exception_ptr error, found_node_t res) {
+                             timed(error, std::move(res));
+                           }, std::move(sent));
+                         },
+                         [&](auto i) {
+                           service->buckets.drop(i);
+                           // They may be in a lookup we kept without ever having been in our table
+                           service->recent_lookups.dropped(i);
+                         },
+                         [&](auto& i) { return service->buckets.rtt_of(i); });
+
+      auto ret = std::get<found_node_t>(service->run_lookup(obj));
+      service->recent_lookups.put(nid, ret, obj.requests);
+      return ret;
+    });
+  }
 
-    std::visit([&](auto res) {
-      using T = std::decay_t<decltype(res)>;
+  std::variant<buffer, std::vector<contact>> node::iterative_find_value(nid_t nid) {
+    return service->value_lookups.get(nid, [&]() {
+      find_iteration obj(nid,
+                         [&](contact c, std::shared_ptr<cancellation> cancel, remote_node::callback_t<find_common_ret> cb) {
+                           auto [timed, sent] = service->time_rpc(c.nid, std::move(cb));
+                           service->probe_find_value(c, nid, std::move(cancel), [c, timed = std::move(timed)]
+                                                     (std::exception_ptr error, remote_node::value_result_t res) {
+                             timed(error, std::visit([&](auto val) -> find_common_ret {
+                               if constexpr (std::is_same_v<decltype(val), remote_node::large_value_t>)
+                                 return found_large_t{c, val.size};
+                               else
+                                 return val;
+                             }, std::move(res)));
+                           }, std::move(sent));
+                         },
+                         [&](auto i) {
+                           service->buckets.drop(i);
+                           // They may be in a lookup we kept without ever having been in our table
+                           service->recent_lookups.dropped(i);
+                         },
+                         [&](auto& i) { return service->buckets.rtt_of(i); });
+      obj.finding_value = true;
+
+      auto found = service->run_lookup(obj);
+
+      std::variant<buffer, std::vector<contact>> ret;
+      if (auto large = std::get_if<found_large_t>(&found)) {
+        // The value is too big to have come back with the lookup, so we fetch it from them now
+        try {
+          ret = remote_node::unchecked(this, large->holder, service->buckets.rpc_timeout(large->holder.nid))
+                  .find_value_stream(nid, large->size);
+        }
+        catch (...) {
+          ret = obj.contacted(k);
+        }
+      }
+      else if (auto val = std::get_if<found_value_t>(&found))
+        ret = std::move(*val);
+      else {
+        // Just as good as a node lookup, for whoever stores here next
+        service->recent_lookups.put(nid, std::get<found_node_t>(found), obj.requests);
+        ret = std::move(std::get<found_node_t>(found));
+      }
 
-      if constexpr (std::is_same_v<found_value_t, T>) {
-        // Sort in descending order of distance, so we can pop the back to get the closest
-        std::sort(obj.contacted.begin(), obj.contacted.end(), [&](auto a, auto b) {
-          return distance(a.nid, nid) > distance(b.nid, nid);
-        });
-        while (obj.contacted.size() == 0) {
-          try {
-            remote_node r = connect(obj.contacted.back());
-            r.store(res);
-          }
-          catch (...) {
-            obj.contacted.pop_back();
-          }
+      // The closest we asked who didn't have it keeps a copy for a while, so that the next lookup
+      // through there stops early, and a hot value spreads out from its k closest. Anything too big
+      // to batch is left where it is
+      if (auto val = std::get_if<buffer>(&ret); val && val->size() <= stream_threshold) {
+        if (auto target = obj.closest_non_holder()) {
+          ++service->path_caches;
+          remote_node::unchecked(this, *target, service->buckets.rpc_timeout(target->nid))
+            .cache(service->batcher, val->get(), obj.path_cache_ttl(*target), [](std::exception_ptr, bool) {});
         }
       }
-    }, obj.iterate_until_done());
 
+      return ret;
+    });
+  }
+
+  node::lookup_stats_t node::get_lookup_stats() const {
+    lookup_stats_t ret;
+    ret.lookups = service->lookups;
+    ret.failures = service->failed_lookups;
+    ret.max_hops = service->lookup_max_hops;
+    if (ret.lookups) {
+      ret.mean_latency = std::chrono::microseconds{service->lookup_micros / ret.lookups};
+      ret.mean_hops = static_cast<double>(service->lookup_hops) / static_cast<double>(ret.lookups);
+    }
+    ret.p50_latency = service->lookup_latency.percentile(0.5);
+    ret.p99_latency = service->lookup_latency.percentile(0.99);
+
+    auto node_flights = service->node_lookups.get_stats();
+    auto value_flights = service->value_lookups.get_stats();
+    ret.coalesced = node_flights.coalesced + value_flights.coalesced;
+    ret.cached = node_flights.cached + value_flights.cached;
+    ret.path_caches = service->path_caches;
+    ret.hedges = service->hedged_probes;
+    ret.cancelled = service->cancelled_probes;
+    ret.out_of_time = service->lookups_out_of_time;
     return ret;
   }
 
-  void node::iterative_store(nid_t key, span<const uint8_t> data, age_t age) {
-    for (auto& node : iterative_find_node(key)) {
-      connect(node).store(data, age);
+  lookup_cache::stats_t node::get_lookup_cache_stats() const {
+    return service->recent_lookups.get_stats();
+  }
+
+  void node::set_lookup_ttl(std::chrono::steady_clock::duration ttl) {
+    service->node_lookups.set_ttl(ttl);
+    service->value_lookups.set_ttl(ttl);
+  }
+
+  node::store_stats_t node::get_store_stats() const {
+    store_stats_t ret;
+    ret.stores = service->stores;
+    ret.failures = service->failed_stores;
+    ret.in_flight = service->stores_in_flight;
+    ret.p50_quorum_latency = service->store_quorum_latency.percentile(0.5);
+    ret.p99_quorum_latency = service->store_quorum_latency.percentile(0.99);
+    ret.p50_replicated_latency = service->store_replicated_latency.percentile(0.5);
+    ret.p99_replicated_latency = service->store_replicated_latency.percentile(0.99);
+    return ret;
+  }
+
+  std::vector<node::peer_latency_t> node::get_peer_latencies() const {
+    return service->buckets.get_peer_latencies();
+  }
+
+  void node::iterative_store(span<const store_item_t> items, size_t quorum) {
+    auto started = std::chrono::steady_clock::now();
+
+    struct item_tally_t {
+      size_t needed = 1;
+      size_t stored = 0;
+      size_t outstanding = 0;
+      bool settled = false;
+    };
+    // A destination too busy to take a store, to be asked again once it's due
+    struct retry_t {
+      size_t item;
+      contact c;
+      size_t attempt;
+      std::chrono::steady_clock::time_point at;
+    };
+    // Shared with the callbacks, which carry on after we've returned
+    struct tally_t {
+      std::mutex tally_mutex;
+      std::condition_variable tally_condvar;
+      std::vector<item_tally_t> items;
+      size_t unsettled = 0;
+      // Only we send retries, so once we've returned there's nobody to
+      std::vector<retry_t> retries;
+      bool returned = false;
+    };
+    auto tally = std::make_shared<tally_t>();
+    tally->items.resize(static_cast<size_t>(items.size()));
+
+    // Every lookup comes first, so that the stores all go out together, and whatever shares a
+    // destination also shares a call. One we did a moment ago needn't be done again
+    std::vector<std::vector<contact>> destinations(tally->items.size());
+    for (size_t i = 0; i < destinations.size(); ++i) {
+      auto& nid = items[fix_gsl_bs(i)].nid;
+      if (auto cached = service->recent_lookups.get(nid)) {
+        destinations[i] = std::move(*cached);
+        continue;
+      }
+      // An item we can't find anywhere for just counts as not stored
+      try { destinations[i] = iterative_find_node(nid); }
+      catch (...) {}
+    }
+
+    // Everything is counted before anything is sent, as a callback can come before we're done
+    // sending the rest
+    for (size_t i = 0; i < destinations.size(); ++i) {
+      auto& t = tally->items[i];
+      t.needed = std::clamp<size_t>(quorum, 1, std::max<size_t>(destinations[i].size(), 1));
+      t.outstanding = destinations[i].size();
+      t.settled = t.outstanding == 0;
+      if (!t.settled)
+        ++tally->unsettled;
+    }
+    service->stores += destinations.size();
+
+    // Anything streamed could still be going after we've returned, and the caller's copy might not
+    // be around by then
+    std::vector<span<const uint8_t>> payloads(destinations.size());
+    std::vector<buffer> kept(destinations.size());
+    for (size_t i = 0; i < destinations.size(); ++i) {
+      payloads[i] = items[fix_gsl_bs(i)].data;
+      if (tally->items[i].needed < destinations[i].size() && static_cast<size_t>(payloads[i].size()) > stream_threshold) {
+        kept[i] = buffer::copy(payloads[i]);
+        payloads[i] = kept[i].get();
+      }
+    }
+
+    auto send = [&](size_t i, const contact& c, size_t attempt) {
+      ++service->stores_in_flight;
+      remote_node::unchecked(this, c, service->buckets.rpc_timeout(c.nid))
+        .store(service->batcher, payloads[i], items[fix_gsl_bs(i)].age,
+               [svc = service.get(), tally, i, started, kept = kept[i], c, attempt](std::exception_ptr error, bool success) {
+          auto took = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+          bool busy = error && is_overloaded(error);
+          if (error && !busy) {
+            svc->buckets.drop(c.nid);
+            // We may have had them from a lookup we kept, whether or not they're in our table
+            svc->recent_lookups.dropped(c.nid);
+          }
+
+          {
+            std::unique_lock lock{tally->tally_mutex};
+            auto& t = tally->items[i];
+            if (busy && attempt < overload_retries && !tally->returned) {
+              // Still outstanding, as far as the tally goes, until the retry is in
+              tally->retries.push_back({i, c, attempt + 1,
+                                        std::chrono::steady_clock::now() + overload_backoff * (1 << attempt)});
+              tally->tally_condvar.notify_all();
+            }
+            else {
+              if (!error && success)
+                ++t.stored;
+              --t.outstanding;
+
+              if (!t.settled && (t.stored >= t.needed || t.outstanding == 0)) {
+                t.settled = true;
+                --tally->unsettled;
+                if (t.stored >= t.needed)
+                  svc->store_quorum_latency.record(took);
+                tally->tally_condvar.notify_all();
+              }
+              if (t.outstanding == 0)
+                svc->store_replicated_latency.record(took);
+            }
+          }
+          --svc->stores_in_flight;
+        });
+    };
+
+    for (size_t i = 0; i < destinations.size(); ++i)
+      for (auto& c : destinations[i])
+        send(i, c, 0);
+
+    std::unique_lock lock{tally->tally_mutex};
+    while (tally->unsettled) {
+      if (tally->retries.empty()) {
+        tally->tally_condvar.wait(lock, [&]() { return tally->unsettled == 0 || !tally->retries.empty(); });
+        continue;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      auto due = std::partition(tally->retries.begin(), tally->retries.end(),
+                                [&](auto& r) { return r.at > now; });
+      std::vector<retry_t> sending{due, tally->retries.end()};
+      tally->retries.erase(due, tally->retries.end());
+      if (sending.empty()) {
+        auto next = std::min_element(tally->retries.begin(), tally->retries.end(),
+                                     [](auto& a, auto& b) { return a.at < b.at; })->at;
+        auto waiting = tally->retries.size();
+        tally->tally_condvar.wait_until(lock, next, [&]() {
+          return tally->unsettled == 0 || tally->retries.size() != waiting;
+        });
+        continue;
+      }
+
+      lock.unlock();
+      for (auto& r : sending)
+        send(r.item, r.c, r.attempt);
+      lock.lock();
+    }
+
+    // Whoever we'd still have retried only goes towards replication, which can do without them
+    tally->returned = true;
+    for (auto& r : tally->retries)
+      if (--tally->items[r.item].outstanding == 0)
+        service->store_replicated_latency.record(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - started));
+    tally->retries.clear();
+
+    size_t short_of_quorum = 0;
+    for (auto& i : tally->items)
+      if (i.stored < i.needed)
+        ++short_of_quorum;
+    if (short_of_quorum) {
+      service->failed_stores += short_of_quorum;
+      throw std::runtime_error("Could not store value on enough nodes");
     }
   }
 
   void node::store(nid_t key, span<const uint8_t> data, age_t age) {
-    iterative_store(key, data, age);
+    store_item_t item{key, data, age};
+    iterative_store({&item, 1}, write_quorum);
+  }
+
+  std::vector<nid_t> node::store_all(span<const span<const uint8_t>> values, age_t age) {
+    auto nids = compute_nids(values);
+
+    std::vector<store_item_t> items;
+    for (size_t i = 0; i < nids.size(); ++i)
+      items.push_back({nids[i], values[fix_gsl_bs(i)], age});
+    iterative_store(items, write_quorum);
+
+    return nids;
+  }
+
+  remote_node::batcher::stats_t node::get_batch_stats() const {
+    return service->batcher.get_stats();
+  }
+
+  datagram_transport* node::get_datagrams() const {
+    return service->datagram.get();
+  }
+
+  datagram_transport::stats_t node::get_datagram_stats() const {
+    if (service->datagram)
+      return service->datagram->get_stats();
+    return {};
+  }
+
+  server_queues::stats_t node::get_server_stats() const {
+    if (service->async)
+      return service->async->get_stats();
+    return { 0, 0, service->served, 0 };
   }
 
   std::shared_ptr<backing_store> node::back() const {
@@ -398,7 +1393,10 @@ namespace c3::kademlia {
   void node::ping_all() {
     for (auto i : service->buckets.get_all()) {
       try { connect(i).ping(); }
-      catch (...) { service->buckets.drop(i.nid); }
+      catch (...) {
+        if (!is_overloaded(std::current_exception()))
+          service->buckets.drop(i.nid);
+      }
     }
   }
 }
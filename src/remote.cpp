@@ -12,6 +12,7 @@
 #include <grpcpp/create_channel.h>
 #include <grpcpp/security/credentials.h>
 
+#include <optional>
 #include <variant>
 #include <gsl/span>
 
@@ -26,6 +27,8 @@ namespace c3::kademlia {
         throw timed_out{};
       case grpc::StatusCode::UNAVAILABLE:
         throw std::runtime_error("Could not connect");
+      case grpc::StatusCode::RESOURCE_EXHAUSTED:
+        throw overloaded{};
       case grpc::StatusCode::UNKNOWN:
         throw std::runtime_error("Remote RPC encountered issue");
       default:
@@ -34,18 +37,34 @@ namespace c3::kademlia {
   }
 
   void remote_node::ping() {
-    proto::PingRequest req;
-    proto::PingResponse res;
+    if (auto via = parent->get_datagrams(); via && via->reachable(details.location)) {
+      try {
+        ping(*via);
+        return;
+      }
+      // They may well only speak gRPC, so we'll give that a go before giving up on them
+      catch (const timed_out&) {
+        via->mark_unreachable(details.location);
+      }
+    }
+
+    inline_arena<256> arena;
+    auto& req = *arena.make<proto::PingRequest>();
+    auto& res = *arena.make<proto::PingResponse>();
     grpc::ClientContext ctx;
     init_ctx(ctx);
 
     auto status = stub->ping(&ctx, req, &res);
-    check_ctx(ctx);
-    handle_status(status);
+    finish(ctx, status);
   }
   bool remote_node::store(span<const uint8_t> data, age_t age) {
-    proto::StoreRequest req;
-    proto::StoreResponse res;
+    if (static_cast<size_t>(data.size()) > stream_threshold)
+      return store_stream(data, age);
+
+    // The data is copied straight into the request, so there's no point giving it a big block
+    inline_arena<256> arena;
+    auto& req = *arena.make<proto::StoreRequest>();
+    auto& res = *arena.make<proto::StoreResponse>();
     grpc::ClientContext ctx;
     init_ctx(ctx);
 
@@ -53,78 +72,327 @@ namespace c3::kademlia {
     req.set_age(age.count());
 
     auto status = stub->store(&ctx, req, &res);
-    check_ctx(ctx);
-    handle_status(status);
+    finish(ctx, status);
 
     return res.success();
   }
 
   std::vector<contact> remote_node::find_node(nid_t nid) {
-    proto::FindNodeRequest req;
-    proto::FindNodeResponse res;
+    inline_arena<> arena;
+    auto& req = *arena.make<proto::FindNodeRequest>();
+    auto& res = *arena.make<proto::FindNodeResponse>();
     grpc::ClientContext ctx;
     init_ctx(ctx);
 
     req.set_nid(nid.data(), nid.size());
 
     auto status = stub->find_node(&ctx, req, &res);
-    check_ctx(ctx);
-    handle_status(status);
+    finish(ctx, status);
 
-    if (static_cast<size_t>(res.contacts().size()) > k)
-      throw std::invalid_argument("Too many found nodes");
+    return parse_contacts(res, parent->get_nid());
+  }
 
-    std::vector<contact> ret;
-    for (auto& i : res.contacts()) {
-      auto nid = deserialise_nid(i.nid());
-      if (nid == parent->get_nid())
-        throw std::invalid_argument("Was given own nid");
-      ret.emplace_back(contact{nid, i.location()});
-    }
+  std::variant<buffer, std::vector<contact>> remote_node::find_value(nid_t nid) {
+    inline_arena<> arena;
+    auto& req = *arena.make<proto::FindValueRequest>();
+    auto& res = *arena.make<proto::FindValueResponse>();
+    grpc::ClientContext ctx;
+    init_ctx(ctx);
 
-    return ret;
+    req.set_nid(nid.data(), nid.size());
+
+    auto status = stub->find_value(&ctx, req, &res);
+    finish(ctx, status);
+
+    return std::visit([&](auto val) -> std::variant<buffer, std::vector<contact>> {
+      if constexpr (std::is_same_v<decltype(val), large_value_t>)
+        return find_value_stream(nid, val.size);
+      else
+        return val;
+    }, parse_value(res, parent->get_nid()));
   }
 
-  std::variant<std::vector<uint8_t>, std::vector<contact>> remote_node::find_value(nid_t nid) {
-    proto::FindValueRequest req;
-    proto::FindValueResponse res;
+  bool remote_node::store_stream(span<const uint8_t> data, age_t age) {
+    proto::StoreChunk chunk;
+    proto::StoreResponse res;
     grpc::ClientContext ctx;
-    init_ctx(ctx);
+    size_t size = static_cast<size_t>(data.size());
+    init_ctx(ctx, size);
+
+    auto writer = stub->store_stream(&ctx, &res);
+
+    chunk.set_size(size);
+    chunk.set_age(age.count());
+
+    // Each write waits for the last to go, so only a chunk or so is ever in flight from us
+    nid_hasher hasher;
+    size_t off = 0;
+    do {
+      auto piece = data.subspan(fix_gsl_bs(off), fix_gsl_bs(std::min(chunk_size, size - off)));
+      hasher.update(piece);
+      chunk.set_data(piece.data(), static_cast<size_t>(piece.size()));
+      off += static_cast<size_t>(piece.size());
+
+      if (off == size) {
+        auto nid = hasher.finish();
+        chunk.set_nid(nid.data(), nid.size());
+      }
 
-    ctx.peer();
+      // They've hung up, so Finish will tell us why
+      if (!writer->Write(chunk))
+        break;
+
+      chunk.clear_size();
+      chunk.clear_age();
+    } while (off < size);
+
+    writer->WritesDone();
+    auto status = writer->Finish();
+    finish(ctx, status);
+
+    return res.success();
+  }
+
+  std::variant<buffer, std::vector<contact>> remote_node::find_value_stream(nid_t nid, size_t size) {
+    proto::FindValueRequest req;
+    proto::FindValueChunk chunk;
+    grpc::ClientContext ctx;
+    init_ctx(ctx, size);
 
     req.set_nid(nid.data(), nid.size());
 
-    auto status = stub->find_value(&ctx, req, &res);
-    check_ctx(ctx);
-    handle_status(status);
+    auto reader = stub->find_value_stream(&ctx, req);
 
-    switch (res.value_case()) {
-      case (proto::FindValueResponse::ValueCase::kFound): {
-        auto b = string_to_data(res.found());
-        return std::vector<uint8_t>{b.begin(), b.end()};
+    std::optional<std::vector<contact>> contacts;
+    std::optional<size_t> declared;
+    std::vector<uint8_t> data;
+    nid_hasher hasher;
+
+    if (reader->Read(&chunk)) {
+      switch (chunk.value_case()) {
+        case (proto::FindValueChunk::ValueCase::kSize):
+          declared = chunk.size();
+          // find_value already told us how big it is, and the value can't have changed since
+          if (*declared != size) {
+            ctx.TryCancel();
+            reader->Finish();
+            throw std::invalid_argument("find_value_stream size does not match find_value");
+          }
+          // Nor do we allocate on their word, only for what has actually come in
+          while (reader->Read(&chunk)) {
+            if (chunk.value_case() != proto::FindValueChunk::ValueCase::kData ||
+                chunk.data().size() > *declared - data.size()) {
+              ctx.TryCancel();
+              reader->Finish();
+              throw std::invalid_argument("Bad chunk in find_value_stream");
+            }
+            hasher.update(string_to_data(chunk.data()));
+            data.insert(data.end(), chunk.data().begin(), chunk.data().end());
+          }
+          break;
+        case (proto::FindValueChunk::ValueCase::kNotFound):
+          contacts = parse_contacts(chunk.not_found(), parent->get_nid());
+          break;
+        default:
+          break;
       }
-      case (proto::FindValueResponse::ValueCase::kNotFound): {
-        if (static_cast<size_t>(res.not_found().contacts().size()) > k)
-          throw std::invalid_argument("Too many found nodes");
+    }
+
+    auto status = reader->Finish();
+    finish(ctx, status);
+
+    if (contacts)
+      return std::move(*contacts);
+    if (!declared)
+      throw std::invalid_argument("Unknown find_value_stream response");
+    if (data.size() != *declared || hasher.finish() != nid)
+      throw std::invalid_argument("Streamed value does not match its nid");
+
+    return buffer::adopt(std::move(data));
+  }
+
+  void remote_node::find_node(rpc_engine& engine, nid_t nid, callback_t<std::vector<contact>> cb) {
+    proto::FindNodeRequest req;
+    req.set_nid(nid.data(), nid.size());
 
+    engine.unary<proto::FindNodeResponse>(
+      [&](grpc::ClientContext& ctx, grpc::CompletionQueue* queue) {
+        init_ctx(ctx);
+        return stub->PrepareAsyncfind_node(&ctx, req, queue);
+      },
+      [stub = stub, pool = &parent->get_channels(), our_nid = parent->get_nid(), details = details,
+       cb = std::move(cb)]
+      (grpc::Status& status, grpc::ClientContext& ctx, proto::FindNodeResponse& res) {
         std::vector<contact> ret;
-        for (auto& i : res.not_found().contacts()) {
-          auto nid = deserialise_nid(i.nid());
-          if (nid == parent->get_nid())
-            throw std::invalid_argument("Was given own nid");
-          ret.emplace_back(contact{nid, i.location()});
+        try {
+          // Unlike the synchronous version, a failed call shouldn't look like a missing nid
+          handle_status(status);
+          check_server_nid(ctx, details.nid);
+          ret = parse_contacts(res, our_nid);
         }
+        catch (...) {
+          pool->failed(details.location);
+          cb(std::current_exception(), {});
+          return;
+        }
+        pool->succeeded(details.location);
+        cb(nullptr, std::move(ret));
+      });
+  }
+
+  void remote_node::find_value(rpc_engine& engine, nid_t nid, callback_t<value_result_t> cb) {
+    proto::FindValueRequest req;
+    req.set_nid(nid.data(), nid.size());
+
+    engine.unary<proto::FindValueResponse>(
+      [&](grpc::ClientContext& ctx, grpc::CompletionQueue* queue) {
+        init_ctx(ctx);
+        return stub->PrepareAsyncfind_value(&ctx, req, queue);
+      },
+      [stub = stub, pool = &parent->get_channels(), our_nid = parent->get_nid(), details = details,
+       cb = std::move(cb)]
+      (grpc::Status& status, grpc::ClientContext& ctx, proto::FindValueResponse& res) {
+        value_result_t ret;
+        try {
+          handle_status(status);
+          check_server_nid(ctx, details.nid);
+          ret = parse_value(res, our_nid);
+        }
+        catch (...) {
+          pool->failed(details.location);
+          cb(std::current_exception(), {});
+          return;
+        }
+        pool->succeeded(details.location);
+        cb(nullptr, std::move(ret));
+      });
+  }
+
+  void remote_node::ping(datagram_transport& via) {
+    datagram_transport::message_t req;
+    req.kind = datagram_transport::kind_t::ping;
+    try {
+      check_datagram(via.request(details.location, std::move(req), timeout), details.nid,
+                     datagram_transport::kind_t::pong);
+    }
+    catch (...) {
+      parent->get_channels().failed(details.location);
+      throw;
+    }
+    parent->get_channels().succeeded(details.location);
+  }
+
+  void remote_node::find_node(datagram_transport& via, nid_t nid, callback_t<std::vector<contact>> cb) {
+    datagram_transport::message_t req;
+    req.kind = datagram_transport::kind_t::find_node;
+    req.target = nid;
 
-        return ret;
+    via.request(details.location, std::move(req), timeout,
+      [pool = &parent->get_channels(), our_nid = parent->get_nid(), details = details, cb = std::move(cb)]
+      (std::exception_ptr error, datagram_transport::message_t res) {
+        try {
+          if (error)
+            std::rethrow_exception(error);
+          check_datagram(res, details.nid, datagram_transport::kind_t::nodes);
+          for (auto& i : res.contacts)
+            if (i.nid == our_nid)
+              throw std::invalid_argument("Was given own nid");
+        }
+        catch (...) {
+          pool->failed(details.location);
+          cb(std::current_exception(), {});
+          return;
+        }
+        pool->succeeded(details.location);
+        cb(nullptr, std::move(res.contacts));
+      });
+  }
+
+  void remote_node::find_value(datagram_transport& via, nid_t nid, callback_t<value_result_t> cb) {
+    datagram_transport::message_t req;
+    req.kind = datagram_transport::kind_t::find_value;
+    req.target = nid;
+
+    via.request(details.location, std::move(req), timeout,
+      [pool = &parent->get_channels(), our_nid = parent->get_nid(), details = details, cb = std::move(cb)]
+      (std::exception_ptr error, datagram_transport::message_t res) {
+        value_result_t ret;
+        try {
+          if (error)
+            std::rethrow_exception(error);
+          switch (res.kind) {
+            case datagram_transport::kind_t::value:
+              check_datagram(res, details.nid, res.kind);
+              ret = std::move(res.value);
+              break;
+            case datagram_transport::kind_t::large_value:
+              check_datagram(res, details.nid, res.kind);
+              ret = large_value_t{static_cast<size_t>(res.size)};
+              break;
+            default:
+              check_datagram(res, details.nid, datagram_transport::kind_t::nodes);
+              for (auto& i : res.contacts)
+                if (i.nid == our_nid)
+                  throw std::invalid_argument("Was given own nid");
+              ret = std::move(res.contacts);
+              break;
+          }
+        }
+        catch (...) {
+          pool->failed(details.location);
+          cb(std::current_exception(), {});
+          return;
+        }
+        pool->succeeded(details.location);
+        cb(nullptr, std::move(ret));
+      });
+  }
+
+  void remote_node::check_datagram(const datagram_transport::message_t& reply, const nid_t& expected,
+                                   datagram_transport::kind_t kind) {
+    if (reply.sender != expected)
+      throw std::runtime_error("Remote nid is inconsistent");
+    if (reply.kind != kind)
+      throw std::invalid_argument("Unexpected datagram reply");
+  }
+
+  std::vector<contact> remote_node::parse_contacts(const proto::FindNodeResponse& res, const nid_t& our_nid) {
+    if (static_cast<size_t>(res.contacts().size()) > k)
+      throw std::invalid_argument("Too many found nodes");
+
+    std::vector<contact> ret;
+    ret.reserve(static_cast<size_t>(res.contacts().size()));
+    for (auto& i : res.contacts()) {
+      auto nid = deserialise_nid(i.nid());
+      if (nid == our_nid)
+        throw std::invalid_argument("Was given own nid");
+      ret.emplace_back(contact{nid, i.location()});
+    }
+
+    return ret;
+  }
+
+  remote_node::value_result_t remote_node::parse_value(proto::FindValueResponse& res, const nid_t& our_nid) {
+    switch (res.value_case()) {
+      case (proto::FindValueResponse::ValueCase::kFound): {
+        // release_found may copy the bytes when res is on an arena, which it usually is, as that
+        // saves a lot on replies full of contacts. A swap never copies, whatever res is on
+        auto found = std::make_unique<std::string>();
+        found->swap(*res.mutable_found());
+        return buffer::adopt(std::move(found));
       }
+      case (proto::FindValueResponse::ValueCase::kNotFound):
+        return parse_contacts(res.not_found(), our_nid);
+      case (proto::FindValueResponse::ValueCase::kFoundSize):
+        return large_value_t{static_cast<size_t>(res.found_size())};
       default:
         throw std::invalid_argument("Unknown find_value response");
     }
   }
 
-  void remote_node::init_ctx(grpc::ClientContext& ctx) {
-    ctx.set_deadline(std::chrono::system_clock::now() + timeout);
+  void remote_node::init_ctx(grpc::ClientContext& ctx, size_t transfer) {
+    auto allowance = std::chrono::milliseconds{transfer * 1000 / min_stream_rate};
+    ctx.set_deadline(std::chrono::system_clock::now() + timeout + allowance);
     nid_t our_nid = parent->get_nid();
     ctx.AddMetadata(metadata_nid_key,
                     {reinterpret_cast<const char*>(our_nid.data()), our_nid.size()});
@@ -132,21 +400,35 @@ namespace c3::kademlia {
   }
 
   void remote_node::check_ctx(grpc::ClientContext& ctx) {
-    std::string str = ctx.peer();
-    std::cout << str << std::endl;
+    check_server_nid(ctx, get_nid());
+  }
+
+  void remote_node::finish(grpc::ClientContext& ctx, const grpc::Status& status) {
+    try {
+      // A call that failed may not have got as far as sending their nid
+      handle_status(status);
+      check_ctx(ctx);
+    }
+    catch (...) {
+      parent->get_channels().failed(details.location);
+      throw;
+    }
+    parent->get_channels().succeeded(details.location);
+  }
+
+  void remote_node::check_server_nid(grpc::ClientContext& ctx, const nid_t& expected) {
     auto& meta = ctx.GetServerInitialMetadata();
     auto iter = meta.find(metadata_nid_key);
     if (iter == meta.end())
       throw std::runtime_error("Server did not give a nid");
-    else if (deserialise_nid(iter->second) != get_nid())
+    else if (deserialise_nid(iter->second) != expected)
       throw std::runtime_error("Remote nid is inconsistent");
-
-    details.nid = deserialise_nid(iter->second);
   }
 
   void remote_node::first_ping() {
-    proto::PingRequest req;
-    proto::PingResponse res;
+    inline_arena<256> arena;
+    auto& req = *arena.make<proto::PingRequest>();
+    auto& res = *arena.make<proto::PingResponse>();
     grpc::ClientContext ctx;
     init_ctx(ctx);
 
@@ -159,5 +441,28 @@ namespace c3::kademlia {
       throw std::runtime_error("Server did not give a nid");
 
     details.nid = deserialise_nid(iter->second);
+    parent->get_channels().succeeded(details.location);
+  }
+
+  remote_node::remote_node(node* parent, contact c, std::chrono::milliseconds net_timeout, unchecked_t) :
+    parent{parent},
+    details{std::move(c)},
+    timeout{net_timeout} {
+    auto entry = parent->get_channels().get(details.location);
+    channel = std::move(entry.channel);
+    stub = std::move(entry.stub);
+  }
+
+  remote_node::remote_node(node* parent, contact c, std::chrono::milliseconds net_timeout) :
+    remote_node{parent, std::move(c), net_timeout, unchecked_t{}} {
+    // Whatever they last answered was checked against their nid, so it's as good as a ping
+    if (!parent->get_channels().alive(details.location))
+      ping();
+  }
+
+  remote_node::remote_node(node* parent, std::string location, std::chrono::milliseconds net_timeout) :
+    // We set the nid in first_ping()
+    remote_node{parent, contact{{}, std::move(location)}, net_timeout, unchecked_t{}} {
+    first_ping();
   }
 }
@@ -0,0 +1,37 @@
+#include "rpc_engine.hpp"
+
+#include <algorithm>
+
+namespace c3::kademlia {
+  void rpc_engine::queue_body(grpc::CompletionQueue* queue) {
+    void* tag;
+    bool ok;
+    while (queue->Next(&tag, &ok)) {
+      std::unique_ptr<pending_call> call{static_cast<pending_call*>(tag)};
+      try { call->complete(ok); }
+      catch (...) {}
+    }
+  }
+
+  rpc_engine::rpc_engine(size_t thread_count) {
+    if (thread_count == 0)
+      // Each thread only ever parses replies, so there's no point having lots
+      thread_count = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, 4);
+
+    for (size_t i = 0; i < thread_count; ++i)
+      queues.push_back(std::make_unique<grpc::CompletionQueue>());
+    for (auto& i : queues)
+      threads.emplace_back(&rpc_engine::queue_body, this, i.get());
+  }
+
+  rpc_engine::~rpc_engine() {
+    {
+      std::unique_lock lock{closing_mutex};
+      closing = true;
+    }
+    for (auto& i : queues)
+      i->Shutdown();
+    for (auto& i : threads)
+      i.join();
+  }
+}
@@ -0,0 +1,78 @@
+// Storing and finding across clusters serving through either the callback API or our own queues,
+// and a server too busy to answer being backed off from rather than dropped
+#include "remote.hpp"
+#include "test.hpp"
+
+#include <atomic>
+
+using namespace c3::kademlia;
+
+namespace {
+  void check_cluster(node::server_options_t options) {
+    constexpr size_t nodes = 8;
+    auto net = test::cluster(nodes, options);
+    for (auto& i : net)
+      CHECK(i->count_peers());
+
+    std::vector<nid_t> keys;
+    for (size_t i = 0; i < 20; ++i)
+      keys.push_back(net[i % nodes]->store(string_to_data("value " + std::to_string(i))));
+    // Big enough to go by stream
+    std::string big(3 << 20, 'z');
+    keys.push_back(net[3]->store(string_to_data(big)));
+
+    for (size_t i = 0; i < keys.size(); ++i)
+      CHECK(net[(i + 5) % nodes]->find(keys[i]));
+    CHECK(net[0]->get_server_stats().served);
+  }
+
+  void check_shedding() {
+    node::server_options_t options;
+    options.mode = node::server_options_t::mode_t::async;
+    options.queues = 1;
+    options.max_backlog = 1;
+    node server{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>(), options};
+    node client{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()};
+    client.add_peer("127.0.0.1:" + server.get_port());
+    CHECK(client.count_peers() == 1);
+
+    std::atomic<bool> going = true;
+    std::atomic<size_t> turned_away = 0;
+    std::vector<std::thread> flood;
+    std::string heavy(200000, 'q');
+    for (size_t t = 0; t < 16; ++t)
+      flood.emplace_back([&]() {
+        auto remote = remote_node::unchecked(&client, {server.get_nid(), "127.0.0.1:" + server.get_port()});
+        while (going) {
+          try { remote.store(string_to_data(heavy)); }
+          catch (const overloaded&) { ++turned_away; }
+          catch (...) {}
+        }
+      });
+
+    // Whatever these make of it, being turned away mustn't cost the server its place
+    for (size_t i = 0; i < 50; ++i) {
+      try { client.store(string_to_data("busy " + std::to_string(i))); }
+      catch (...) {}
+      try { client.find(generate_nid()); }
+      catch (...) {}
+    }
+    going = false;
+    for (auto& i : flood)
+      i.join();
+
+    std::cout << "shedding: " << turned_away << " turned away, " << server.get_server_stats().shed << " shed" << std::endl;
+    CHECK(client.count_peers() == 1);
+  }
+}
+
+int main() {
+  check_cluster({});
+
+  node::server_options_t async;
+  async.mode = node::server_options_t::mode_t::async;
+  async.queues = 2;
+  check_cluster(async);
+
+  check_shedding();
+}
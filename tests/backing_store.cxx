@@ -0,0 +1,185 @@
+// Every store answers size_of and read without the whole value, turns away streamed values it
+// could never hold before taking any of them in, and can be walked with a cursor while it changes
+#include "backing_store.hpp"
+#include "backing_store_log.hpp"
+#include "backing_store_sharded.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <set>
+#include <thread>
+
+using namespace c3::kademlia;
+
+namespace {
+  void check_reads(backing_store& store) {
+    std::vector<uint8_t> value(3 * chunk_size + 17);
+    for (size_t i = 0; i < value.size(); ++i)
+      value[i] = static_cast<uint8_t>(i * 7);
+    span<const uint8_t> data{value.data(), fix_gsl_bs(value.size())};
+    auto nid = compute_nid(data);
+    CHECK(store.store(data));
+
+    CHECK(store.size_of(nid) == value.size());
+    CHECK(!store.size_of(generate_nid()));
+
+    std::vector<uint8_t> back;
+    for (size_t off = 0; off < value.size();) {
+      auto piece = store.read(nid, off, chunk_size);
+      CHECK(piece && !piece->empty() && piece->size() <= chunk_size);
+      back.insert(back.end(), piece->begin(), piece->end());
+      off += piece->size();
+    }
+    CHECK(back == value);
+
+    auto end = store.read(nid, value.size(), chunk_size);
+    CHECK(end && end->empty());
+    CHECK(!store.read(nid, value.size() + 1, chunk_size));
+    CHECK(!store.read(generate_nid(), 0, chunk_size));
+  }
+
+  void check_limit(backing_store& store, size_t max_size) {
+    CHECK(!store.begin_store(max_size + 1));
+    CHECK(!store.begin_store(SIZE_MAX));
+
+    std::vector<uint8_t> value(1024, 3);
+    span<const uint8_t> data{value.data(), fix_gsl_bs(value.size())};
+    auto writer = store.begin_store(value.size());
+    CHECK(writer);
+    CHECK(writer->write(data));
+    CHECK(writer->commit(compute_nid(data)));
+    CHECK(store.size_of(compute_nid(data)) == value.size());
+  }
+
+  std::vector<uint8_t> value_of(size_t i) {
+    auto s = "value " + std::to_string(i);
+    return {s.begin(), s.end()};
+  }
+
+  /// Walks all of store, a few at a time, while churn runs alongside, and checks every key in
+  /// stable turns up, and nothing turns up that was never stored
+  template<typename Churn>
+  void check_scan(backing_store& store, const std::set<nid_t>& stable, Churn&& churn) {
+    std::atomic<bool> going = true;
+    std::atomic<size_t> churned = 0;
+    std::thread churner{[&]() {
+      for (; going; ++churned)
+        churn(store, churned);
+    }};
+
+    // Until enough has changed underneath us that some of it must have been mid-scan
+    for (size_t pass = 0; pass < 5 || churned < 1000; ++pass) {
+      std::set<nid_t> seen;
+      backing_store::cursor_t cursor;
+      while (!cursor.done) {
+        auto batch = store.scan(cursor, 7);
+        CHECK(batch.items.size() <= 7);
+        for (auto& [nid, val] : batch.items) {
+          CHECK(compute_nid(val.dat.get()) == nid);
+          seen.insert(nid);
+        }
+        cursor = batch.next;
+      }
+      CHECK(std::includes(seen.begin(), seen.end(), stable.begin(), stable.end()));
+    }
+
+    going = false;
+    churner.join();
+  }
+
+  std::set<nid_t> fill(backing_store& store, size_t count) {
+    std::set<nid_t> ret;
+    for (size_t i = 0; i < count; ++i) {
+      auto v = value_of(i);
+      span<const uint8_t> data{v.data(), fix_gsl_bs(v.size())};
+      CHECK(store.store(data));
+      ret.insert(compute_nid(data));
+    }
+    return ret;
+  }
+
+  void check_scans() {
+    constexpr size_t stable_count = 200;
+
+    // Nothing else going on, so each key comes back exactly once, and a batch of zero means
+    // default_scan_batch
+    {
+      backing_store::simple store;
+      auto stable = fill(store, stable_count);
+      CHECK(store.scan({}, 0).items.size() == backing_store::default_scan_batch);
+      size_t returned = 0;
+      std::set<nid_t> seen;
+      for (backing_store::cursor_t cursor; !cursor.done;) {
+        auto batch = store.scan(cursor, 7);
+        returned += batch.items.size();
+        for (auto& i : batch.items)
+          seen.insert(i.first);
+        cursor = batch.next;
+      }
+      CHECK(returned == stable_count && seen == stable);
+    }
+
+    // Stores evict as they go, and the stable keys are always hit since the last churned one, so
+    // what goes is always churn
+    {
+      backing_store::simple store{16 * 1024 * 1024, 2 * stable_count, std::make_unique<eviction_policy::lru>()};
+      auto stable = fill(store, stable_count);
+      check_scan(store, stable, [&](backing_store& store, size_t i) {
+        auto v = value_of(stable_count + i);
+        CHECK(store.store(span<const uint8_t>{v.data(), fix_gsl_bs(v.size())}));
+        for (auto& nid : stable)
+          CHECK(store.retrieve(nid));
+      });
+    }
+
+    // Inserts that grow the tables underneath the cursor
+    {
+      backing_store::sharded store{64 * 1024 * 1024, 1 << 20};
+      auto stable = fill(store, stable_count);
+      check_scan(store, stable, [&](backing_store& store, size_t i) {
+        auto v = value_of(stable_count + i);
+        store.store(span<const uint8_t>{v.data(), fix_gsl_bs(v.size())});
+      });
+    }
+
+    char dir[] = "/tmp/kademlia-test-XXXXXX";
+    CHECK(::mkdtemp(dir));
+    {
+      backing_store::log store{dir};
+      auto stable = fill(store, stable_count);
+      check_scan(store, stable, [&](backing_store& store, size_t i) {
+        auto v = value_of(stable_count + i);
+        store.store(span<const uint8_t>{v.data(), fix_gsl_bs(v.size())});
+      });
+    }
+    std::filesystem::remove_all(dir);
+  }
+}
+
+int main() {
+  constexpr size_t max_size = 4 * 1024 * 1024;
+
+  backing_store::simple simple{max_size};
+  check_reads(simple);
+  check_limit(simple, max_size);
+
+  backing_store::sharded sharded{max_size};
+  check_reads(sharded);
+  check_limit(sharded, max_size);
+
+  char dir[] = "/tmp/kademlia-test-XXXXXX";
+  CHECK(::mkdtemp(dir));
+  {
+    backing_store::log::options opts;
+    opts.max_size = max_size;
+    backing_store::log log{dir, opts};
+    check_reads(log);
+    check_limit(log, max_size);
+  }
+  std::filesystem::remove_all(dir);
+
+  check_scans();
+}
@@ -0,0 +1,150 @@
+// The log store keeps everything over a restart, clean or not, drops a record torn by a crash
+// without losing those before it, and compacts segments once enough of them has expired
+#include "backing_store_log.hpp"
+#include "test.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <filesystem>
+
+using namespace c3::kademlia;
+
+namespace {
+  std::vector<uint8_t> value_of(size_t i, size_t size) {
+    std::vector<uint8_t> ret(size);
+    for (size_t j = 0; j < size; ++j)
+      ret[j] = static_cast<uint8_t>(i * 31 + j);
+    return ret;
+  }
+
+  nid_t store(backing_store& s, const std::vector<uint8_t>& v) {
+    span<const uint8_t> data{v.data(), fix_gsl_bs(v.size())};
+    CHECK(s.store(data));
+    return compute_nid(data);
+  }
+
+  bool holds(backing_store& s, const nid_t& nid, const std::vector<uint8_t>& v) {
+    auto got = s.retrieve(nid);
+    return got && std::equal(got->dat.begin(), got->dat.end(), v.begin(), v.end());
+  }
+
+  /// As if we'd crashed without closing, so the next open has to read every segment back
+  void mark_dirty(const std::string& dir) {
+    int fd = ::open((dir + "/index").c_str(), O_RDWR);
+    CHECK(fd >= 0);
+    // The clean flag follows the magic and version
+    uint32_t clean = 0;
+    CHECK(::pwrite(fd, &clean, sizeof(clean), 12) == sizeof(clean));
+    ::close(fd);
+  }
+
+  void check_reopen(const std::string& dir) {
+    std::vector<std::vector<uint8_t>> values;
+    std::vector<nid_t> nids;
+    {
+      backing_store::log log{dir};
+      for (size_t i = 0; i < 100; ++i) {
+        values.push_back(value_of(i, 100 + i * 13));
+        nids.push_back(store(log, values.back()));
+      }
+    }
+
+    {
+      backing_store::log log{dir};
+      CHECK(log.get_all_keys().size() == values.size());
+      for (size_t i = 0; i < values.size(); ++i)
+        CHECK(holds(log, nids[i], values[i]));
+    }
+
+    // Without a clean index, the same again from the segments alone
+    mark_dirty(dir);
+    backing_store::log log{dir};
+    CHECK(log.get_all_keys().size() == values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+      CHECK(holds(log, nids[i], values[i]));
+  }
+
+  void check_torn(const std::string& dir) {
+    auto first = value_of(1, 500), second = value_of(2, 500), last = value_of(3, 500);
+    nid_t first_nid, second_nid, last_nid;
+    {
+      backing_store::log log{dir};
+      first_nid = store(log, first);
+      second_nid = store(log, second);
+      last_nid = store(log, last);
+    }
+
+    // Cut the last record short, as a crash halfway through writing it would
+    auto segment = dir + "/00000001.seg";
+    auto full = std::filesystem::file_size(segment);
+    std::filesystem::resize_file(segment, full - 100);
+    mark_dirty(dir);
+
+    {
+      backing_store::log log{dir};
+      CHECK(holds(log, first_nid, first));
+      CHECK(holds(log, second_nid, second));
+      CHECK(!log.retrieve(last_nid));
+      CHECK(log.get_all_keys().size() == 2);
+      // What was left of it is gone, so whatever comes next is readable after it
+      CHECK(std::filesystem::file_size(segment) < full - 500);
+      last_nid = store(log, last);
+    }
+
+    mark_dirty(dir);
+    backing_store::log log{dir};
+    CHECK(holds(log, first_nid, first));
+    CHECK(holds(log, second_nid, second));
+    CHECK(holds(log, last_nid, last));
+  }
+
+  void check_compaction(const std::string& dir) {
+    backing_store::log::options opts;
+    opts.segment_size = 16 * 1024;
+    opts.compact_interval = std::chrono::seconds{1};
+    opts.lifetime = std::chrono::seconds{6};
+    backing_store::log log{dir, opts};
+
+    // The first segment gets the early values and most of the late ones, so once the early ones
+    // expire it's over half dead, but still holds values that have to be kept
+    std::vector<nid_t> early, late;
+    std::vector<std::vector<uint8_t>> late_values;
+    for (size_t i = 0; i < 8; ++i)
+      early.push_back(store(log, value_of(100 + i, 1024)));
+    std::this_thread::sleep_for(std::chrono::seconds{3});
+    for (size_t i = 0; i < 8; ++i) {
+      late_values.push_back(value_of(200 + i, 1024));
+      late.push_back(store(log, late_values.back()));
+    }
+    auto first = dir + "/00000001.seg";
+    CHECK(std::filesystem::exists(first));
+    CHECK(std::filesystem::exists(dir + "/00000002.seg"));
+
+    // The early ones go at 6 or 7 s, and the late ones not before 9
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds{5500};
+    while (std::filesystem::exists(first) && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds{100});
+    CHECK(!std::filesystem::exists(first));
+
+    for (auto& i : early)
+      CHECK(!log.retrieve(i));
+    for (size_t i = 0; i < late.size(); ++i)
+      CHECK(holds(log, late[i], late_values[i]));
+  }
+
+  template<typename Func>
+  void in_temp_dir(Func&& func) {
+    char dir[] = "/tmp/kademlia-test-XXXXXX";
+    CHECK(::mkdtemp(dir));
+    func(std::string{dir});
+    std::filesystem::remove_all(dir);
+  }
+}
+
+int main() {
+  in_temp_dir(check_reopen);
+  in_temp_dir(check_torn);
+  in_temp_dir(check_compaction);
+}
@@ -0,0 +1,84 @@
+// Allocations, and bytes allocated, per RPC, counting both ends, as every node runs in here. Only
+// operator new is counted, which is what protobuf and we use, but not gRPC's core
+#include "remote.hpp"
+#include "../test.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <future>
+#include <new>
+
+namespace {
+  std::atomic<size_t> allocations = 0;
+  std::atomic<size_t> allocated = 0;
+}
+
+// Out of line, as are the deletes, or GCC sees malloc and free inlined into the same caller as
+// a new expression and warns that they don't match
+[[gnu::noinline]] void* operator new(size_t size) {
+  ++allocations;
+  allocated += size;
+  if (auto ret = std::malloc(size ? size : 1))
+    return ret;
+  throw std::bad_alloc{};
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+using namespace c3::kademlia;
+
+namespace {
+  template<typename Func>
+  void measure(const char* name, Func&& func) {
+    constexpr size_t warmup = 100, count = 1000;
+    for (size_t i = 0; i < warmup; ++i)
+      func();
+
+    size_t before = allocations, before_bytes = allocated;
+    for (size_t i = 0; i < count; ++i)
+      func();
+    std::printf("%-24s %7.1f allocations, %8.1f KiB per RPC\n", name,
+                static_cast<double>(allocations - before) / count,
+                static_cast<double>(allocated - before_bytes) / count / 1024);
+  }
+}
+
+int main() {
+  auto net = test::cluster(8);
+  auto& client = *net[0];
+  auto& server = *net[1];
+  contact them{server.get_nid(), "127.0.0.1:" + server.get_port()};
+  auto remote = remote_node::unchecked(&client, them);
+
+  std::vector<uint8_t> small(100, 1), large(64 * 1024, 2);
+  span<const uint8_t> small_data{small.data(), fix_gsl_bs(small.size())};
+  span<const uint8_t> large_data{large.data(), fix_gsl_bs(large.size())};
+  CHECK(server.back()->store(small_data));
+  CHECK(server.back()->store(large_data));
+  auto small_nid = compute_nid(small_data), large_nid = compute_nid(large_data);
+
+  rpc_engine engine{1};
+  auto find_async = [&](const nid_t& nid) {
+    std::promise<remote_node::value_result_t> done;
+    remote.find_value(engine, nid, [&](std::exception_ptr error, remote_node::value_result_t res) {
+      if (error)
+        done.set_exception(error);
+      else
+        done.set_value(std::move(res));
+    });
+    return done.get_future().get();
+  };
+
+  measure("ping", [&]() { remote.ping(); });
+  measure("store 100 B", [&]() { CHECK(remote.store(small_data)); });
+  measure("find_node", [&]() { remote.find_node(generate_nid()); });
+  measure("find_value 100 B", [&]() {
+    CHECK(std::get<buffer>(remote.find_value(small_nid)).size() == small.size());
+  });
+  measure("find_value 64 KiB", [&]() {
+    CHECK(std::get<buffer>(remote.find_value(large_nid)).size() == large.size());
+  });
+  measure("find_value miss", [&]() { CHECK(std::holds_alternative<std::vector<contact>>(remote.find_value(generate_nid()))); });
+  measure("async find_value 100 B", [&]() { CHECK(std::get<buffer>(find_async(small_nid)).size() == small.size()); });
+  measure("async find_value 64 KiB", [&]() { CHECK(std::get<buffer>(find_async(large_nid)).size() == large.size()); });
+}
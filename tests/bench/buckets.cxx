@@ -0,0 +1,191 @@
+// Bytes per contact and find_node time for the routing table's fixed size buckets, against the
+// std::list<contact> per bucket that they replaced, each holding the same contacts. The lists were
+// walked out from the target's bucket without ranking anything, so they also answered wrongly
+#include "k_buckets.hpp"
+#include "backing_store.hpp"
+#include "../test.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <new>
+#include <set>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace {
+  // Bytes currently held through operator new
+  std::atomic<std::ptrdiff_t> live = 0;
+  // Where we keep each allocation's size, for delete to take off, without misaligning the rest
+  constexpr size_t header = alignof(std::max_align_t);
+}
+
+// Out of line, as are the deletes, or GCC sees malloc and free inlined into the same caller as
+// a new expression and warns that they don't match
+[[gnu::noinline]] void* operator new(size_t size) {
+  if (auto ret = static_cast<char*>(std::malloc(size + header))) {
+    *reinterpret_cast<size_t*>(ret) = size;
+    live += static_cast<std::ptrdiff_t>(size);
+    return ret + header;
+  }
+  throw std::bad_alloc{};
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept {
+  if (!p)
+    return;
+  auto base = static_cast<char*>(p) - header;
+  live -= static_cast<std::ptrdiff_t>(*reinterpret_cast<size_t*>(base));
+  std::free(base);
+}
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+using namespace c3::kademlia;
+
+namespace {
+  /// The routing table as it was before the fixed size buckets
+  class list_table {
+  private:
+    nid_t ours;
+    mutable std::array<std::pair<std::shared_mutex, std::list<contact>>, B> base;
+
+  public:
+    void update(const contact& c) {
+      auto& [mutex, bucket] = base[distance(ours, c.nid)];
+      std::unique_lock lock{mutex};
+      auto pos = std::find_if(bucket.begin(), bucket.end(), [&](auto& a) { return a.nid == c.nid; });
+      if (pos != bucket.end())
+        bucket.erase(pos);
+      bucket.push_front(c);
+    }
+
+    std::vector<contact> find_node(const nid_t& sender, const nid_t& nid) const {
+      std::vector<contact> ret;
+      auto take = [&](size_t offset) {
+        auto& [mutex, bucket] = base[offset];
+        std::shared_lock lock{mutex};
+        for (auto& i : bucket) {
+          if (ret.size() == k)
+            return;
+          if (i.nid != sender)
+            ret.push_back(i);
+        }
+      };
+
+      size_t nid_distance = distance(ours, nid);
+      take(nid_distance);
+      for (size_t i = 1; ret.size() < k && (nid_distance + i < B || i <= nid_distance); ++i) {
+        if (nid_distance + i < B)
+          take(nid_distance + i);
+        if (i <= nid_distance)
+          take(nid_distance - i);
+      }
+      return ret;
+    }
+
+  public:
+    list_table(nid_t ours) : ours{ours} {}
+  };
+
+  nid_t random_nid(std::mt19937_64& rng) {
+    nid_t ret;
+    for (auto& i : ret)
+      i = static_cast<uint8_t>(rng());
+    return ret;
+  }
+
+  template<typename Func>
+  size_t bytes_held(Func&& func) {
+    auto before = live.load();
+    func();
+    return static_cast<size_t>(live.load() - before);
+  }
+
+  void compare(const char* name, node& parent, const std::vector<contact>& contacts, std::vector<nid_t> targets,
+               std::mt19937_64& rng) {
+    std::unique_ptr<list_table> old;
+    std::unique_ptr<k_buckets> table;
+    // What k_buckets keeps alongside the buckets for each contact's round trip times, which the
+    // lists had no equivalent of
+    std::unordered_map<nid_t, std::pair<rtt_estimate, latency_histogram>, nid_hash> timings;
+
+    auto old_bytes = bytes_held([&]() {
+      old = std::make_unique<list_table>(parent.get_nid());
+      for (auto& i : contacts)
+        old->update(i);
+    });
+    auto table_bytes = bytes_held([&]() {
+      table = std::make_unique<k_buckets>(&parent, [](const contact&) { return true; });
+      for (auto& i : contacts)
+        CHECK(table->update(i));
+      table->publish();
+    });
+    auto timing_bytes = bytes_held([&]() {
+      for (auto& i : contacts)
+        timings.try_emplace(i.nid);
+    });
+    CHECK(table->count() == contacts.size());
+
+    std::vector<nid_t> senders;
+    for (size_t i = 0; i < targets.size(); ++i)
+      senders.push_back(contacts[rng() % contacts.size()].nid);
+
+    constexpr size_t rounds = 50000;
+    size_t found = 0;
+    auto t_old = test::time_s([&]() {
+      for (size_t i = 0; i < rounds; ++i)
+        found += old->find_node(senders[i % senders.size()], targets[i % targets.size()]).size();
+    });
+    auto t_new = test::time_s([&]() {
+      for (size_t i = 0; i < rounds; ++i)
+        found += table->find_node(senders[i % senders.size()], targets[i % targets.size()]).size();
+    });
+    CHECK(found);
+
+    auto per_contact = [&](size_t bytes) { return static_cast<double>(bytes) / static_cast<double>(contacts.size()); };
+    std::printf("%s, %zu contacts:\n", name, contacts.size());
+    std::printf("  lists   %7.1f bytes per contact, find_node %6.2f us\n", per_contact(old_bytes), t_old * 1e6 / rounds);
+    std::printf("  buckets %7.1f bytes per contact, find_node %6.2f us (and %.1f bytes per contact for RTT timings)\n",
+                per_contact(table_bytes - timing_bytes), t_new * 1e6 / rounds, per_contact(timing_bytes));
+  }
+}
+
+int main() {
+  node parent{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()};
+  auto ours = parent.get_nid();
+  std::mt19937_64 rng{1};
+
+  // What a node would keep from hearing of 100k others, which is a dozen or so full buckets at the
+  // far end and nothing much nearer
+  {
+    std::vector<contact> contacts;
+    std::array<size_t, B> used = {};
+    for (size_t i = 0; i < 100000; ++i) {
+      auto nid = random_nid(rng);
+      if (nid == ours || used[distance(ours, nid)]++ >= k)
+        continue;
+      contacts.push_back({nid, "ipv4:10.0.0.1:" + std::to_string(contacts.size() + 1024)});
+    }
+    std::vector<nid_t> targets;
+    for (size_t i = 0; i < 4096; ++i)
+      targets.push_back(random_nid(rng));
+    compare("Heard of 100k nodes", parent, contacts, targets, rng);
+  }
+
+  // Every bucket as full as it can be, which is as good as it gets for the fixed size ones
+  {
+    std::vector<contact> contacts;
+    std::set<nid_t> seen;
+    for (size_t d = 0; d < B; ++d)
+      for (size_t i = 0; i < k; ++i) {
+        auto nid = test::at_distance(ours, d, rng);
+        if (nid != ours && seen.insert(nid).second)
+          contacts.push_back({nid, "ipv4:10.0.0.1:" + std::to_string(contacts.size() + 1024)});
+      }
+    std::vector<nid_t> targets;
+    for (size_t i = 0; i < 4096; ++i)
+      targets.push_back(test::at_distance(ours, rng() % B, rng));
+    compare("Every bucket full", parent, contacts, targets, rng);
+  }
+}
@@ -0,0 +1,78 @@
+// Per RPC latency on loopback through the channel pool, against opening a channel for every call
+// as we did before the pool
+#include "remote.hpp"
+#include "../test.hpp"
+#include "../../src/internal.hpp"
+
+#include <cstdio>
+
+using namespace c3::kademlia;
+
+namespace {
+  // What remote_node says of us on every call, which the far end wants before it will answer
+  void sign(grpc::ClientContext& ctx, const node& us) {
+    auto nid = us.get_nid();
+    ctx.AddMetadata(metadata_nid_key, {reinterpret_cast<const char*>(nid.data()), nid.size()});
+    ctx.AddMetadata(metadata_port_key, us.get_port());
+  }
+
+  template<typename Func>
+  latency_histogram measure(size_t count, Func&& func) {
+    latency_histogram ret;
+    for (size_t i = 0; i < count; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      func();
+      ret.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start));
+    }
+    return ret;
+  }
+
+  void print(const char* name, const latency_histogram& h) {
+    std::printf("%-28s p50 %6lld us, p99 %6lld us\n", name,
+                static_cast<long long>(h.percentile(0.5).count()), static_cast<long long>(h.percentile(0.99).count()));
+  }
+}
+
+int main() {
+  auto net = test::cluster(8);
+  auto& client = *net[0];
+  auto& server = *net[1];
+  contact them{server.get_nid(), "127.0.0.1:" + server.get_port()};
+  constexpr size_t count = 500;
+
+  auto fresh_ping = measure(count, [&]() {
+    auto channel = grpc::CreateChannel(them.location, grpc::InsecureChannelCredentials());
+    auto stub = proto::Kademlia::NewStub(channel);
+    proto::PingRequest req;
+    proto::PingResponse res;
+    grpc::ClientContext ctx;
+    sign(ctx, client);
+    CHECK(stub->ping(&ctx, req, &res).ok());
+  });
+  auto fresh_find = measure(count, [&]() {
+    auto channel = grpc::CreateChannel(them.location, grpc::InsecureChannelCredentials());
+    auto stub = proto::Kademlia::NewStub(channel);
+    proto::FindNodeRequest req;
+    proto::FindNodeResponse res;
+    auto target = generate_nid();
+    req.set_nid(target.data(), target.size());
+    grpc::ClientContext ctx;
+    sign(ctx, client);
+    CHECK(stub->find_node(&ctx, req, &res).ok());
+    CHECK(res.contacts_size());
+  });
+
+  auto pooled_ping = measure(count, [&]() { remote_node::unchecked(&client, them).ping(); });
+  auto pooled_find = measure(count, [&]() {
+    CHECK(!remote_node::unchecked(&client, them).find_node(generate_nid()).empty());
+  });
+
+  print("ping, new channel", fresh_ping);
+  print("ping, pooled channel", pooled_ping);
+  print("find_node, new channel", fresh_find);
+  print("find_node, pooled channel", pooled_find);
+
+  auto stats = client.get_channel_stats();
+  std::printf("pool: %zu open, %zu hits, %zu misses\n", stats.open, stats.hits, stats.misses);
+  CHECK(stats.hits >= 2 * count);
+}
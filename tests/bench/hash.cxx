@@ -0,0 +1,43 @@
+// Hashing throughput: one ::SHA256 call per value, as compute_nid used to be, against compute_nid
+// and compute_nids, for a few value sizes
+#include "base.hpp"
+#include "../test.hpp"
+
+#include <openssl/sha.h>
+
+#include <cstdio>
+#include <vector>
+
+using namespace c3::kademlia;
+
+int main() {
+  for (size_t size : {64, 1024, 64 * 1024, 1024 * 1024}) {
+    // About 64 MiB a round, and never fewer than a batch's worth
+    size_t count = std::max<size_t>(64 * 1024 * 1024 / size, 64);
+    std::vector<std::vector<uint8_t>> values(count, std::vector<uint8_t>(size));
+    for (size_t i = 0; i < count; ++i)
+      for (size_t j = 0; j < size; j += 64)
+        values[i][j] = static_cast<uint8_t>(i + j);
+    std::vector<span<const uint8_t>> spans;
+    for (auto& i : values)
+      spans.emplace_back(i.data(), static_cast<std::ptrdiff_t>(i.size()));
+
+    std::vector<nid_t> single(count), each(count), batched;
+    auto t_single = test::time_s([&]() {
+      for (size_t i = 0; i < count; ++i)
+        ::SHA256(values[i].data(), size, single[i].data());
+    });
+    auto t_each = test::time_s([&]() {
+      for (size_t i = 0; i < count; ++i)
+        each[i] = compute_nid(spans[i]);
+    });
+    auto t_batched = test::time_s([&]() { batched = compute_nids(spans); });
+
+    CHECK(single == each);
+    CHECK(single == batched);
+
+    double mb = static_cast<double>(count * size) / (1024 * 1024);
+    std::printf("%8zu B x %6zu: SHA256 %7.0f MiB/s, compute_nid %7.0f MiB/s, compute_nids %7.0f MiB/s\n",
+                size, count, mb / t_single, mb / t_each, mb / t_batched);
+  }
+}
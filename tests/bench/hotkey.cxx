@@ -0,0 +1,176 @@
+// One hot key looked up over and over from all over a loopback cluster many times bigger than k,
+// first with nobody taking the copies that lookups leave behind them, then with them, and how much
+// of the load of answering it stays on the k closest each time
+//
+// Finders keep a copy of what they find, which would spread the load without any path caching at
+// all, so once the value is in place no store takes it again and only the stored copies and the
+// path cache can answer
+#include "../test.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+
+using namespace c3::kademlia;
+
+namespace {
+  /// Counts how often it hands out the hot key, from what it stores and from what it cached
+  class counting : public backing_store {
+  private:
+    backing_store::simple inner;
+
+  public:
+    nid_t hot = {};
+    std::atomic<bool> frozen = false;
+    std::atomic<bool> caching = false;
+    std::atomic<size_t> stored_answers = 0;
+    std::atomic<size_t> cached_answers = 0;
+
+  public:
+    using backing_store::store;
+
+    bool store(buffer b, age_t age) noexcept override {
+      if (frozen && compute_nid(b) == hot)
+        return false;
+      return inner.store(std::move(b), age);
+    }
+    bool cache(buffer b, std::chrono::seconds ttl) noexcept override {
+      return caching && backing_store::cache(std::move(b), ttl);
+    }
+    std::optional<value_t> retrieve(nid_t nid) noexcept override {
+      auto ret = inner.retrieve(nid);
+      if (ret && nid == hot)
+        ++stored_answers;
+      return ret;
+    }
+    std::optional<size_t> size_of(nid_t nid) noexcept override { return inner.size_of(nid); }
+    std::optional<buffer> read(nid_t nid, size_t offset, size_t length) noexcept override {
+      auto ret = inner.read(nid, offset, length);
+      if (ret && nid == hot && offset == 0)
+        ++stored_answers;
+      return ret;
+    }
+    std::vector<std::optional<value_t>> retrieve_batch(span<const nid_t> nids) noexcept override {
+      auto ret = inner.retrieve_batch(nids);
+      for (size_t i = 0; i < ret.size(); ++i)
+        if (ret[i] && nids[fix_gsl_bs(i)] == hot)
+          ++stored_answers;
+      return ret;
+    }
+    std::optional<value_t> retrieve_cached(nid_t nid) noexcept override {
+      auto ret = backing_store::retrieve_cached(nid);
+      if (ret && nid == hot)
+        ++cached_answers;
+      return ret;
+    }
+    std::vector<nid_t> get_all_keys() noexcept override { return inner.get_all_keys(); }
+    scan_t scan(cursor_t from, size_t max_items) noexcept override { return inner.scan(from, max_items); }
+    stats_t get_stats() noexcept override { return inner.get_stats(); }
+  };
+
+  struct load_t {
+    size_t from_stored = 0;
+    size_t from_cached = 0;
+    size_t on_closest = 0;
+    size_t busiest = 0;
+    size_t answering = 0;
+    size_t path_caches = 0;
+    size_t cached_copies = 0;
+    double wall = 0;
+
+    inline double closest_share() const {
+      return static_cast<double>(on_closest) / static_cast<double>(from_stored + from_cached);
+    }
+  };
+}
+
+int main() {
+  constexpr size_t nodes = 200;
+  constexpr size_t lookups = 1000;
+
+  std::vector<std::shared_ptr<counting>> stores;
+  std::vector<std::unique_ptr<node>> net;
+  for (size_t i = 0; i < nodes; ++i) {
+    stores.push_back(std::make_shared<counting>());
+    net.push_back(std::make_unique<node>("127.0.0.1:0", generate_nid(), stores.back()));
+  }
+  test::join_all(net);
+
+  std::string value(500, 'h');
+  auto key = net[0]->store(string_to_data(value));
+  // Past the write quorum, the rest of the replicas get theirs in the background
+  std::this_thread::sleep_for(std::chrono::milliseconds{500});
+  std::vector<size_t> by_distance(nodes);
+  for (size_t i = 0; i < nodes; ++i)
+    by_distance[i] = i;
+  std::sort(by_distance.begin(), by_distance.end(), [&](size_t a, size_t b) {
+    return xor_distance(net[a]->get_nid(), key) < xor_distance(net[b]->get_nid(), key);
+  });
+  std::vector<bool> closest(nodes);
+  for (size_t i = 0; i < k; ++i)
+    closest[by_distance[i]] = true;
+
+  size_t holders = 0, closest_holders = 0;
+  for (size_t i = 0; i < nodes; ++i) {
+    if (stores[i]->get_all_keys().size()) {
+      ++holders;
+      closest_holders += closest[i];
+    }
+    stores[i]->hot = key;
+    stores[i]->frozen = true;
+  }
+
+  std::mt19937 rng{42};
+  auto run = [&](bool caching) {
+    std::vector<size_t> path_caches_before;
+    for (size_t i = 0; i < nodes; ++i) {
+      stores[i]->caching = caching;
+      stores[i]->stored_answers = 0;
+      stores[i]->cached_answers = 0;
+      path_caches_before.push_back(net[i]->get_lookup_stats().path_caches);
+    }
+
+    load_t ret;
+    size_t found = 0;
+    ret.wall = test::time_s([&]() {
+      for (size_t i = 0; i < lookups; ++i)
+        if (net[rng() % nodes]->find(key))
+          ++found;
+    });
+    CHECK(found == lookups);
+
+    for (size_t i = 0; i < nodes; ++i) {
+      size_t answers = stores[i]->stored_answers + stores[i]->cached_answers;
+      ret.from_stored += stores[i]->stored_answers;
+      ret.from_cached += stores[i]->cached_answers;
+      if (closest[i])
+        ret.on_closest += answers;
+      ret.busiest = std::max(ret.busiest, answers);
+      ret.answering += answers != 0;
+      ret.path_caches += net[i]->get_lookup_stats().path_caches - path_caches_before[i];
+      ret.cached_copies += stores[i]->get_cache_stats().keys;
+    }
+    return ret;
+  };
+  auto without = run(false);
+  auto with = run(true);
+
+  std::printf("%zu nodes, k = %zu, %zu holding the key, %zu of them among the k closest\n", nodes, k, holders,
+              closest_holders);
+  for (auto [name, load] : { std::pair{"without path caching", without}, std::pair{"with path caching", with} }) {
+    size_t total = load.from_stored + load.from_cached;
+    std::printf("%s: %zu lookups in %.2f s, %zu answers, %zu of them from cached copies\n", name, lookups, load.wall,
+                total, load.from_cached);
+    std::printf("  %zu copies offered, %zu nodes holding one at the end\n", load.path_caches, load.cached_copies);
+    std::printf("  %zu nodes answered, the k closest %.1f%% of it, the busiest %.1f%%\n", load.answering,
+                100.0 * load.closest_share(), 100.0 * static_cast<double>(load.busiest) / static_cast<double>(total));
+  }
+
+  // Nobody but the holders could have answered without path caching. With it, the copies were kept
+  // long enough to answer some of what came after, and took a share of the load off the k closest.
+  // Not necessarily all that much of it, as one of the k closest that missed out on the store is
+  // whoever is closest without it for nearly every lookup, and so is left the most copies
+  CHECK(without.from_cached == 0);
+  CHECK(with.from_cached > 0 && with.cached_copies > 0);
+  CHECK(with.closest_share() < without.closest_share());
+}
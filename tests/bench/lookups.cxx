@@ -0,0 +1,46 @@
+// Iterative lookups a second over a loopback cluster, and per core, which is lookups over the CPU
+// time the whole process took for them; every node runs in here, so that counts both ends
+#include "../test.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+
+using namespace c3::kademlia;
+
+int main() {
+  constexpr size_t nodes = 64;
+  auto net = test::cluster(nodes);
+  for (auto& i : net)
+    CHECK(i->count_peers());
+
+  std::printf("%zu nodes, %u hardware threads\n", nodes, std::thread::hardware_concurrency());
+  for (size_t callers : {1, 4}) {
+    constexpr size_t per_caller = 200;
+    std::atomic<size_t> missing = 0;
+
+    auto cpu_start = std::clock();
+    auto wall = test::time_s([&]() {
+      std::vector<std::thread> threads;
+      for (size_t c = 0; c < callers; ++c)
+        threads.emplace_back([&, c]() {
+          // Nobody has these, so every lookup goes all the way to the k closest
+          for (size_t i = 0; i < per_caller; ++i)
+            if (!net[(c + i) % nodes]->find(generate_nid()))
+              ++missing;
+        });
+      for (auto& i : threads)
+        i.join();
+    });
+    double cpu = static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    size_t lookups = callers * per_caller;
+    CHECK(missing == lookups);
+    std::printf("%zu callers: %6.0f lookups/s, %6.0f lookups/s per core (%.2f s wall, %.2f s CPU)\n",
+                callers, lookups / wall, lookups / cpu, wall, cpu);
+  }
+
+  auto stats = net[0]->get_lookup_stats();
+  std::printf("node 0: %zu lookups, mean %.1f hops, p50 %lld us, p99 %lld us\n", stats.lookups, stats.mean_hops,
+              static_cast<long long>(stats.p50_latency.count()), static_cast<long long>(stats.p99_latency.count()));
+}
@@ -0,0 +1,85 @@
+// Routing table reads per second as readers are added, with a writer churning the table all the
+// while. Against that, the same reads and writes all taking one lock, as they did before snapshots
+#include "k_buckets.hpp"
+#include "backing_store.hpp"
+#include "../test.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+using namespace c3::kademlia;
+
+namespace {
+  struct no_lock {
+    inline void lock() {}
+    inline void unlock() {}
+  };
+
+  template<typename Lock>
+  size_t reads_per_s(k_buckets& table, const std::vector<contact>& churn, size_t readers, Lock& mutex) {
+    std::atomic<bool> stop = false;
+    std::atomic<size_t> reads = 0;
+
+    std::thread writer{[&]() {
+      for (size_t i = 0; !stop; ++i) {
+        auto& c = churn[i % churn.size()];
+        std::unique_lock lock{mutex};
+        if (i % 2)
+          table.update(c);
+        else
+          table.drop(c.nid);
+      }
+    }};
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < readers; ++r)
+      threads.emplace_back([&, r]() {
+        std::mt19937_64 rng{r};
+        size_t done = 0;
+        while (!stop) {
+          nid_t target;
+          for (auto& i : target)
+            i = static_cast<uint8_t>(rng());
+          std::unique_lock lock{mutex};
+          CHECK(table.find_node(churn[rng() % churn.size()].nid, target).size());
+          ++done;
+        }
+        reads += done;
+      });
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{500});
+    stop = true;
+    writer.join();
+    for (auto& i : threads)
+      i.join();
+    return reads * 2;
+  }
+}
+
+int main() {
+  node parent{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()};
+  k_buckets table{&parent, [](const contact&) { return true; }};
+  std::mt19937_64 rng{1};
+
+  // The top dozen buckets full, with as many again coming and going
+  std::vector<contact> churn;
+  for (size_t d = B - 12; d < B; ++d)
+    for (size_t i = 0; i < 2 * k; ++i) {
+      churn.push_back({test::at_distance(parent.get_nid(), d, rng), "ipv4:10.0.0.1:" + std::to_string(churn.size())});
+      if (i < k)
+        table.update(churn.back());
+    }
+  table.publish();
+
+  std::printf("%u hardware threads\n", std::thread::hardware_concurrency());
+  for (size_t readers : {1, 2, 4, 8}) {
+    no_lock none;
+    std::mutex one;
+    auto snapshot = reads_per_s(table, churn, readers, none);
+    auto locked = reads_per_s(table, churn, readers, one);
+    CHECK(snapshot && locked);
+    std::printf("%zu readers: %9zu reads/s from snapshots, %9zu reads/s under one lock\n", readers, snapshot, locked);
+  }
+  auto stats = table.get_stats();
+  std::printf("%zu contacts left in the table\n", stats.contacts);
+}
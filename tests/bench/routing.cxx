@@ -0,0 +1,131 @@
+// Routing table reads and writes with every bucket full and every replacement cache full behind
+// it, against sorting the whole table for each lookup. Only B * k of those contacts can be in the
+// table, and so be routed to, so ranking 16k nids the way the table does is timed on its own, with
+// the distance kernel this CPU picks against the scalar one
+#include "k_buckets.hpp"
+#include "backing_store.hpp"
+#include "../test.hpp"
+
+#include <cstdio>
+
+using namespace c3::kademlia;
+
+int main() {
+  node parent{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()};
+  // Everyone stays, so the replacements just sit in their caches
+  k_buckets table{&parent, [](const contact&) { return true; }};
+  std::mt19937_64 rng{1};
+
+  std::vector<contact> known;
+  auto t_fill = test::time_s([&]() {
+    for (size_t d = 0; d < B; ++d)
+      for (size_t i = 0; i < 2 * k; ++i) {
+        contact c{test::at_distance(parent.get_nid(), d, rng), "ipv4:10.0.0.1:" + std::to_string(known.size())};
+        CHECK(distance(parent.get_nid(), c.nid) == d);
+        table.update(c);
+        known.push_back(std::move(c));
+      }
+  });
+  table.publish();
+  auto stats = table.get_stats();
+  std::printf("%zu contacts in the table, %zu in replacement caches, %.2f us per update\n",
+              stats.contacts, stats.replacements_cached, t_fill * 1e6 / static_cast<double>(known.size()));
+  CHECK(stats.contacts + stats.replacements_cached >= 10000);
+  CHECK(stats.contacts <= B * k);
+
+  auto in_table = table.get_all();
+  std::vector<nid_t> targets, senders;
+  for (size_t i = 0; i < 4096; ++i) {
+    targets.push_back(test::at_distance(parent.get_nid(), rng() % B, rng));
+    senders.push_back(in_table[rng() % in_table.size()].nid);
+  }
+
+  // What find_node must give: the k closest by the full metric, not counting the sender
+  auto sorted = [&](size_t i) {
+    std::vector<contact> all = in_table;
+    all.erase(std::remove_if(all.begin(), all.end(), [&](const contact& c) { return c.nid == senders[i]; }), all.end());
+    std::partial_sort(all.begin(), all.begin() + k, all.end(), [&](const contact& a, const contact& b) {
+      return xor_distance(a.nid, targets[i]) < xor_distance(b.nid, targets[i]);
+    });
+    all.resize(k);
+    return all;
+  };
+  for (size_t i = 0; i < 256; ++i) {
+    auto got = table.find_node(senders[i], targets[i]);
+    auto want = sorted(i);
+    CHECK(got.size() == want.size());
+    for (size_t j = 0; j < got.size(); ++j)
+      CHECK(got[j].nid == want[j].nid);
+  }
+
+  constexpr size_t rounds = 50000;
+  size_t found = 0;
+  auto t_find = test::time_s([&]() {
+    for (size_t i = 0; i < rounds; ++i)
+      found += table.find_node(senders[i % senders.size()], targets[i % targets.size()]).size();
+  });
+  auto t_alpha = test::time_s([&]() {
+    for (size_t i = 0; i < rounds; ++i)
+      found += table.get_alpha(targets[i % targets.size()]).size();
+  });
+  auto t_sort = test::time_s([&]() {
+    for (size_t i = 0; i < 1000; ++i)
+      found += sorted(i % targets.size()).size();
+  });
+  auto t_touch = test::time_s([&]() {
+    for (size_t i = 0; i < rounds; ++i)
+      table.touch(senders[i % senders.size()]);
+  });
+  auto t_observe = test::time_s([&]() {
+    for (size_t i = 0; i < rounds; ++i)
+      table.observe_rtt(senders[i % senders.size()], std::chrono::microseconds{500 + i % 100});
+  });
+  CHECK(found);
+
+  std::printf("find_node %.2f us, get_alpha %.2f us, sorting the table %.2f us, touch %.2f us, observe_rtt %.2f us\n",
+              t_find * 1e6 / rounds, t_alpha * 1e6 / rounds, t_sort * 1e6 / 1000, t_touch * 1e6 / rounds,
+              t_observe * 1e6 / rounds);
+
+  // closest() computes a key for everyone in the buckets it takes and partially sorts by those
+  std::vector<nid_t> many;
+  for (size_t i = 0; i < 16384; ++i)
+    many.push_back(test::at_distance(parent.get_nid(), rng() % B, rng));
+  span<const nid_t> many_span{many.data(), fix_gsl_bs(many.size())};
+  std::vector<distance_key> keys(many.size()), scalar_keys(many.size());
+  distance_keys(targets[0], many_span, keys.data());
+  distance_keys_scalar(targets[0], many_span, scalar_keys.data());
+  CHECK(keys == scalar_keys);
+
+  constexpr size_t rank_rounds = 200;
+  auto t_keys = test::time_s([&]() {
+    for (size_t i = 0; i < rank_rounds; ++i)
+      distance_keys(targets[i % targets.size()], many_span, keys.data());
+  });
+  auto t_scalar = test::time_s([&]() {
+    for (size_t i = 0; i < rank_rounds; ++i)
+      distance_keys_scalar(targets[i % targets.size()], many_span, scalar_keys.data());
+  });
+  std::vector<size_t> order(many.size());
+  auto t_rank = test::time_s([&]() {
+    for (size_t i = 0; i < rank_rounds; ++i) {
+      distance_keys(targets[i % targets.size()], many_span, keys.data());
+      for (size_t j = 0; j < order.size(); ++j)
+        order[j] = j;
+      std::partial_sort(order.begin(), order.begin() + k, order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+    }
+  });
+  auto t_rank_bytes = test::time_s([&]() {
+    for (size_t i = 0; i < rank_rounds; ++i) {
+      auto& target = targets[i % targets.size()];
+      for (size_t j = 0; j < order.size(); ++j)
+        order[j] = j;
+      std::partial_sort(order.begin(), order.begin() + k, order.end(), [&](size_t a, size_t b) {
+        return xor_distance(many[a], target) < xor_distance(many[b], target);
+      });
+    }
+  });
+
+  std::printf("%zu nids: keys with %s %.2f us, with scalar %.2f us; k closest by keys %.2f us, by xor_distance %.2f us\n",
+              many.size(), distance_keys_kernel(), t_keys * 1e6 / rank_rounds, t_scalar * 1e6 / rank_rounds,
+              t_rank * 1e6 / rank_rounds, t_rank_bytes * 1e6 / rank_rounds);
+}
@@ -0,0 +1,51 @@
+// find_node calls a second against one server on its own queues, from one queue up to four, so
+// the scaling from one core to several shows (or doesn't, on a machine with only the one)
+#include "remote.hpp"
+#include "../test.hpp"
+
+#include <atomic>
+#include <cstdio>
+
+using namespace c3::kademlia;
+
+int main() {
+  constexpr size_t callers = 16;
+  constexpr std::chrono::seconds duration{2};
+  std::printf("%u hardware threads, %zu callers\n", std::thread::hardware_concurrency(), callers);
+
+  for (size_t queues : {1, 2, 4}) {
+    node::server_options_t options;
+    options.mode = node::server_options_t::mode_t::async;
+    options.queues = queues;
+    options.max_backlog = 100000;
+    node server{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>(), options};
+
+    // Each caller is a node of its own, and the server knows them all, so it has contacts to give
+    std::vector<std::unique_ptr<node>> clients;
+    for (size_t i = 0; i < callers; ++i) {
+      clients.push_back(std::make_unique<node>("127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()));
+      server.add_peer("127.0.0.1:" + clients.back()->get_port());
+    }
+
+    std::atomic<bool> going = true;
+    std::atomic<size_t> done = 0, failed = 0;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < callers; ++i)
+      threads.emplace_back([&, i]() {
+        auto remote = remote_node::unchecked(clients[i].get(), {server.get_nid(), "127.0.0.1:" + server.get_port()});
+        while (going) {
+          try { remote.find_node(generate_nid()); ++done; }
+          catch (...) { ++failed; }
+        }
+      });
+    std::this_thread::sleep_for(duration);
+    going = false;
+    for (auto& i : threads)
+      i.join();
+
+    CHECK(done);
+    auto stats = server.get_server_stats();
+    std::printf("%zu queues: %8.0f rpc/s, %zu failed, %zu shed\n", queues,
+                static_cast<double>(done) / duration.count(), static_cast<size_t>(failed), stats.shed);
+  }
+}
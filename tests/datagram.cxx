@@ -0,0 +1,222 @@
+// Ping, find_node and small find_value over UDP between nodes on loopback, falling back to gRPC for
+// those who don't take datagrams, and nobody being believed about where they are until they've
+// shown it
+#include "datagram.hpp"
+#include "remote.hpp"
+#include "test.hpp"
+
+#include <future>
+
+using namespace c3::kademlia;
+
+namespace {
+  using message_t = datagram_transport::message_t;
+  using kind_t = datagram_transport::kind_t;
+
+  template<typename T, typename Func>
+  T wait_for(Func&& func) {
+    std::promise<T> done;
+    func([&](std::exception_ptr error, T res) {
+      if (error)
+        done.set_exception(error);
+      else
+        done.set_value(std::move(res));
+    });
+    return done.get_future().get();
+  }
+
+  /// A bare socket on some free port, for playing the part of a peer by hand
+  std::pair<std::unique_ptr<udp_socket>, uint16_t> open_socket() {
+    std::mt19937 rng{std::random_device{}()};
+    for (;;) {
+      auto port = static_cast<uint16_t>(20000 + rng() % 20000);
+      try { return { std::make_unique<udp_socket>("127.0.0.1", port), port }; }
+      catch (...) {}
+    }
+  }
+
+  std::string local(uint16_t port) { return "127.0.0.1:" + std::to_string(port); }
+
+  message_t exchange(udp_socket& sock, const std::string& to, const message_t& req, size_t* sent = nullptr) {
+    auto packet = datagram_transport::encode(req);
+    if (sent)
+      *sent = packet.size();
+    sock.send(udp_socket::resolve(to), {packet.data(), fix_gsl_bs(packet.size())});
+
+    std::vector<uint8_t> buf(datagram_transport::max_datagram);
+    udp_socket::address_t from;
+    auto got = sock.receive({buf.data(), fix_gsl_bs(buf.size())}, from, std::chrono::seconds{2});
+    CHECK(got);
+    return datagram_transport::decode({buf.data(), fix_gsl_bs(*got)});
+  }
+
+  void check_cluster() {
+    node::server_options_t options;
+    options.datagrams = true;
+    auto net = test::cluster(6, options);
+    auto& us = *net[0];
+    auto& via = *us.get_datagrams();
+    contact them{net[1]->get_nid(), "127.0.0.1:" + net[1]->get_port()};
+    auto remote = remote_node::unchecked(&us, them);
+
+    remote.ping(via);
+
+    auto target = generate_nid();
+    auto found = wait_for<std::vector<contact>>([&](auto cb) { remote.find_node(via, target, cb); });
+    CHECK(!found.empty());
+
+    std::string small = "over udp";
+    CHECK(net[1]->back()->store(string_to_data(small)));
+    auto small_nid = compute_nid(string_to_data(small));
+    auto value = wait_for<remote_node::value_result_t>([&](auto cb) { remote.find_value(via, small_nid, cb); });
+    CHECK(std::holds_alternative<buffer>(value));
+    CHECK(std::string(std::get<buffer>(value).begin(), std::get<buffer>(value).end()) == small);
+
+    std::string big(4 * datagram_transport::max_datagram, 'b');
+    CHECK(net[1]->back()->store(string_to_data(big)));
+    value = wait_for<remote_node::value_result_t>([&](auto cb) {
+      remote.find_value(via, compute_nid(string_to_data(big)), cb);
+    });
+    CHECK(std::holds_alternative<remote_node::large_value_t>(value));
+    CHECK(std::get<remote_node::large_value_t>(value).size == big.size());
+
+    auto missing = wait_for<remote_node::value_result_t>([&](auto cb) { remote.find_value(via, generate_nid(), cb); });
+    CHECK(std::holds_alternative<std::vector<contact>>(missing));
+
+    CHECK(via.get_stats().requests);
+    CHECK(!via.get_stats().timeouts);
+  }
+
+  void check_fallback() {
+    // Only every other node takes datagrams, so the rest have to be found over gRPC
+    std::vector<std::unique_ptr<node>> net;
+    for (size_t i = 0; i < 8; ++i) {
+      node::server_options_t options;
+      options.datagrams = i % 2 == 0;
+      net.push_back(std::make_unique<node>("127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>(), options));
+    }
+    for (size_t i = 1; i < net.size(); ++i) {
+      net[i]->add_peer("127.0.0.1:" + net[0]->get_port());
+      net[i]->join();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    for (auto& i : net)
+      i->join();
+
+    std::vector<nid_t> keys;
+    for (size_t i = 0; i < 16; ++i)
+      keys.push_back(net[i % net.size()]->store(string_to_data("fallback " + std::to_string(i))));
+    for (size_t i = 0; i < keys.size(); ++i)
+      CHECK(net[(i + 3) % net.size()]->find(keys[i]));
+
+    auto stats = net[0]->get_datagram_stats();
+    CHECK(stats.requests);
+  }
+
+  void check_wrong_source() {
+    auto peer = open_socket();
+    auto impostor = open_socket();
+    uint16_t our_port = 0;
+    std::unique_ptr<datagram_transport> us;
+    while (!us) {
+      // Free a moment ago, so very likely still
+      our_port = open_socket().second;
+      try { us = std::make_unique<datagram_transport>("127.0.0.1", our_port, generate_nid(), [](auto&, auto&) { return false; }); }
+      catch (...) {}
+    }
+
+    auto peer_nid = generate_nid();
+    auto ask = [&](bool answer) {
+      auto done = std::make_shared<std::promise<message_t>>();
+      auto ret = done->get_future();
+      message_t req;
+      req.kind = kind_t::ping;
+      us->request(local(peer.second), req, std::chrono::milliseconds{600}, [done](std::exception_ptr error, message_t res) {
+        if (error)
+          done->set_exception(error);
+        else
+          done->set_value(std::move(res));
+      });
+
+      std::vector<uint8_t> buf(datagram_transport::max_datagram);
+      udp_socket::address_t from;
+      auto got = peer.first->receive({buf.data(), fix_gsl_bs(buf.size())}, from, std::chrono::seconds{2});
+      CHECK(got);
+      auto sent = datagram_transport::decode({buf.data(), fix_gsl_bs(*got)});
+
+      // Right id, right nid, wrong address
+      message_t reply;
+      reply.kind = kind_t::pong;
+      reply.id = sent.id;
+      reply.sender = peer_nid;
+      auto packet = datagram_transport::encode(reply);
+      impostor.first->send(udp_socket::resolve(local(our_port)), {packet.data(), fix_gsl_bs(packet.size())});
+      std::this_thread::sleep_for(std::chrono::milliseconds{50});
+      if (answer)
+        peer.first->send(from, {packet.data(), fix_gsl_bs(packet.size())});
+      return ret;
+    };
+
+    auto answered = ask(true).get();
+    CHECK(answered.kind == kind_t::pong && answered.sender == peer_nid);
+
+    auto ignored = ask(false);
+    try {
+      ignored.get();
+      CHECK(false);
+    }
+    catch (const timed_out&) {}
+  }
+
+  void check_unverified() {
+    node::server_options_t options;
+    options.datagrams = true;
+    node server{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>(), options};
+    // Someone for find_node to give out, as if the table were full
+    node other{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()};
+    server.add_peer("127.0.0.1:" + other.get_port());
+    CHECK(server.count_peers() == 1);
+
+    auto sock = open_socket().first;
+    auto to = "127.0.0.1:" + server.get_port();
+    message_t req;
+    req.sender = generate_nid();
+    req.port = 1;
+
+    // A ping is answered, but says nothing about who sent it
+    req.kind = kind_t::ping;
+    size_t sent = 0;
+    auto pong = exchange(*sock, to, req, &sent);
+    CHECK(pong.kind == kind_t::pong && pong.cookie);
+    CHECK(datagram_transport::encode(pong).size() <= sent);
+
+    // Anything bigger waits for a cookie, and what comes back is no bigger than what went
+    req.kind = kind_t::find_node;
+    req.target = generate_nid();
+    req.id = 1;
+    auto retry = exchange(*sock, to, req, &sent);
+    CHECK(retry.kind == kind_t::retry && retry.id == 1 && retry.cookie);
+    CHECK(datagram_transport::encode(retry).size() <= sent);
+
+    // A made up cookie is no better than none
+    req.cookie = retry.cookie ^ 1;
+    CHECK(exchange(*sock, to, req, &sent).kind == kind_t::retry);
+
+    // The table is only published every so often, so give it the chance
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    CHECK(server.count_peers() == 1);
+
+    req.cookie = retry.cookie;
+    auto nodes = exchange(*sock, to, req);
+    CHECK(nodes.kind == kind_t::nodes && !nodes.contacts.empty());
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    CHECK(server.count_peers() == 2);
+  }
+}
+
+int main() {
+  check_cluster();
+  check_fallback();
+  check_wrong_source();
+  check_unverified();
+}
@@ -0,0 +1,70 @@
+// Expiry on a wheel driven by a clock of our own, so that cascading from levels that take minutes
+// or days to roll over can be checked without waiting for them
+#include "expiry_wheel.hpp"
+#include "test.hpp"
+
+using namespace c3::kademlia;
+
+namespace {
+  nid_t nid_of(uint8_t n) {
+    nid_t ret = {};
+    ret[0] = n;
+    return ret;
+  }
+}
+
+int main() {
+  auto now = expiry_wheel::clock::now();
+  std::vector<nid_t> expired;
+  expiry_wheel wheel{[&](auto& nids) { expired.insert(expired.end(), nids.begin(), nids.end()); },
+                     [&]() { return now; }};
+
+  // Everything comes out in deadline order, and none of it early
+  wheel.schedule(nid_of(1), std::chrono::seconds{5});
+  wheel.schedule(nid_of(2), std::chrono::seconds{2});
+  wheel.schedule(nid_of(3), std::chrono::milliseconds{2500});
+  CHECK(wheel.pending() == 3);
+  for (size_t s = 1; s <= 5; ++s) {
+    now += std::chrono::seconds{1};
+    wheel.poll();
+  }
+  CHECK((expired == std::vector<nid_t>{nid_of(2), nid_of(3), nid_of(1)}));
+  CHECK(wheel.pending() == 0);
+
+  // Past level 0, and past level 1, so both have to cascade down before they come out
+  expired.clear();
+  auto start = now;
+  constexpr std::chrono::seconds minutes{64 * 3 + 5}, hours{64 * 64 * 2 + 10};
+  wheel.schedule(nid_of(4), minutes);
+  wheel.schedule(nid_of(5), hours);
+  // Big steps, so each poll goes over many ticks at once
+  now = start + minutes - std::chrono::seconds{1};
+  wheel.poll();
+  CHECK(expired.empty());
+  now = start + minutes;
+  wheel.poll();
+  CHECK((expired == std::vector<nid_t>{nid_of(4)}));
+  now = start + hours - std::chrono::seconds{1};
+  wheel.poll();
+  CHECK(expired.size() == 1);
+  now = start + hours;
+  wheel.poll();
+  CHECK((expired == std::vector<nid_t>{nid_of(4), nid_of(5)}));
+
+  // Scheduling the same nid again doesn't take back the first, so the owner gets both, and keeps
+  // its own expiry to tell whether to act on the first
+  expired.clear();
+  start = now;
+  wheel.schedule(nid_of(6), std::chrono::seconds{10});
+  wheel.schedule(nid_of(6), std::chrono::seconds{100});
+  CHECK(wheel.pending() == 2);
+  now = start + std::chrono::seconds{10};
+  wheel.poll();
+  CHECK((expired == std::vector<nid_t>{nid_of(6)}));
+  now = start + std::chrono::seconds{99};
+  wheel.poll();
+  CHECK(expired.size() == 1);
+  now = start + std::chrono::seconds{100};
+  wheel.poll();
+  CHECK(expired.size() == 2 && wheel.pending() == 0);
+}
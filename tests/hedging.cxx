@@ -0,0 +1,72 @@
+// A value lookup whose k closest are all slower than they usually are asks on past them, but still
+// waits for them rather than taking everyone further out not having the value as its answer
+#include "test.hpp"
+
+#include <atomic>
+
+using namespace c3::kademlia;
+using namespace std::chrono_literals;
+
+namespace {
+  /// Takes its time over anything it holds, once told to
+  class slow : public backing_store {
+  private:
+    backing_store::simple inner;
+
+  public:
+    std::atomic<bool> slowed = false;
+
+  public:
+    using backing_store::store;
+
+    bool store(buffer b, age_t age) noexcept override { return inner.store(std::move(b), age); }
+    std::optional<value_t> retrieve(nid_t nid) noexcept override { return inner.retrieve(nid); }
+    std::optional<size_t> size_of(nid_t nid) noexcept override {
+      auto ret = inner.size_of(nid);
+      // Well past anyone's p95 on loopback, but well short of giving up on them
+      if (ret && slowed)
+        std::this_thread::sleep_for(150ms);
+      return ret;
+    }
+    std::vector<nid_t> get_all_keys() noexcept override { return inner.get_all_keys(); }
+    scan_t scan(cursor_t from, size_t max_items) noexcept override { return inner.scan(from, max_items); }
+    stats_t get_stats() noexcept override { return inner.get_stats(); }
+  };
+}
+
+int main() {
+  // Enough that those without the value could make up the k closest several times over
+  constexpr size_t nodes = 120;
+  // Enough threads that those sleeping never hold up anything else
+  node::server_options_t options;
+  options.mode = node::server_options_t::mode_t::async;
+  options.queues = 1;
+  options.threads_per_queue = 8;
+
+  std::vector<std::shared_ptr<slow>> stores;
+  std::vector<std::unique_ptr<node>> net;
+  for (size_t i = 0; i < nodes; ++i) {
+    stores.push_back(std::make_shared<slow>());
+    net.push_back(std::make_unique<node>("127.0.0.1:0", generate_nid(), stores.back(), options));
+  }
+  test::join_all(net);
+
+  auto key = net[0]->store(string_to_data("slow to come by"));
+  std::this_thread::sleep_for(500ms);
+
+  std::vector<size_t> finders;
+  for (size_t i = 0; i < nodes; ++i)
+    if (stores[i]->get_all_keys().empty())
+      finders.push_back(i);
+  CHECK(finders.size() >= k);
+  for (auto& i : stores)
+    i->slowed = true;
+
+  size_t hedges = 0;
+  for (auto i : finders) {
+    CHECK(net[i]->find(key));
+    hedges += net[i]->get_lookup_stats().hedges;
+  }
+  // Or the holders weren't slow enough to have been passed over
+  CHECK(hedges);
+}
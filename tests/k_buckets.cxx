@@ -0,0 +1,103 @@
+// Round trip times follow contacts in and out of the table, and timing someone never touches the
+// buckets themselves. Someone new to a full bucket only gets in if its oldest contact fails a ping
+#include "k_buckets.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+using namespace c3::kademlia;
+using namespace std::chrono_literals;
+
+namespace {
+  bool holds(const k_buckets& table, const nid_t& nid) {
+    auto all = table.get_all();
+    return std::any_of(all.begin(), all.end(), [&](auto& c) { return c.nid == nid; });
+  }
+
+  /// Fills the furthest bucket, then has someone new turn up to find it full, with the oldest
+  /// answering the ping that follows or not
+  void check_probe(node& parent, bool alive, std::mt19937_64& rng) {
+    std::atomic<bool> pinged = false;
+    nid_t pinged_nid = {};
+    k_buckets table{&parent, [&](const contact& c) {
+      pinged_nid = c.nid;
+      pinged = true;
+      return alive;
+    }};
+
+    std::vector<contact> in;
+    for (size_t i = 0; i < k; ++i) {
+      in.push_back({test::at_distance(parent.get_nid(), B - 1, rng), "ipv4:10.0.0.1:" + std::to_string(i + 1)});
+      CHECK(table.update(in.back()));
+    }
+    auto& oldest = in.front();
+    contact newcomer{test::at_distance(parent.get_nid(), B - 1, rng), "ipv4:10.0.0.2:1"};
+    CHECK(!table.update(newcomer));
+    CHECK(table.get_stats().replacements_cached == 1);
+
+    // The probe thread gets to it in its own time, and then whatever it did has to be published
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    auto settled = [&]() {
+      table.publish();
+      auto all = table.get_all();
+      return alive ? !all.empty() && all.front().nid == oldest.nid : table.get_stats().evictions == 1;
+    };
+    while (!(pinged && settled()) && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(10ms);
+    CHECK(pinged && pinged_nid == oldest.nid);
+
+    auto stats = table.get_stats();
+    CHECK(stats.contacts == k);
+    if (alive) {
+      // Everyone stays, the oldest now the most recently seen, and the newcomer waits its turn
+      for (auto& i : in)
+        CHECK(holds(table, i.nid));
+      CHECK(!holds(table, newcomer.nid));
+      CHECK(table.get_all().front().nid == oldest.nid);
+      CHECK(stats.evictions == 0 && stats.replacements_cached == 1 && stats.replacements_used == 0);
+    }
+    else {
+      CHECK(!holds(table, oldest.nid));
+      CHECK(holds(table, newcomer.nid));
+      CHECK(table.get_all().front().nid == newcomer.nid);
+      CHECK(stats.evictions == 1 && stats.replacements_cached == 0 && stats.replacements_used == 1);
+    }
+  }
+}
+
+int main() {
+  node parent{"127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>()};
+  k_buckets table{&parent, [](const contact&) { return true; }};
+  std::mt19937_64 rng{1};
+
+  check_probe(parent, false, rng);
+  check_probe(parent, true, rng);
+
+  contact in{test::at_distance(parent.get_nid(), B - 1, rng), "ipv4:10.0.0.1:1"};
+  contact out{test::at_distance(parent.get_nid(), B - 1, rng), "ipv4:10.0.0.1:2"};
+  table.add(in);
+
+  CHECK(!table.rtt_of(in.nid).known());
+  CHECK(table.rpc_timeout(in.nid) == rtt_estimate::max_timeout);
+  for (size_t i = 0; i < 10; ++i)
+    table.observe_rtt(in.nid, 20ms);
+  CHECK(table.rtt_of(in.nid).known());
+  CHECK(table.rtt_of(in.nid).expected() == 20ms);
+  CHECK(table.rpc_timeout(in.nid) == rtt_estimate::min_timeout);
+
+  // Only those in the table are kept
+  table.observe_rtt(out.nid, 20ms);
+  CHECK(!table.rtt_of(out.nid).known());
+
+  auto peers = table.get_peer_latencies();
+  CHECK(peers.size() == 1);
+  CHECK(peers[0].srtt == 20ms);
+  CHECK(peers[0].histogram.count() == 10);
+
+  // Whoever comes back starts over
+  table.drop(in.nid);
+  CHECK(!table.rtt_of(in.nid).known());
+  table.add(in);
+  CHECK(!table.rtt_of(in.nid).known());
+}
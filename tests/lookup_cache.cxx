@@ -0,0 +1,77 @@
+// A kept lookup answers its own key, and nearby keys only when all but its furthest lie in the
+// region they share, and goes as soon as anyone in it is dropped
+#include "lookup_cache.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+
+using namespace c3::kademlia;
+
+namespace {
+  constexpr size_t region = 100;
+
+  /// What a lookup of key might find, with inside of them sharing a longer prefix with it than
+  /// region does, and the rest at region
+  std::vector<contact> result(const nid_t& key, size_t inside, std::mt19937_64& rng) {
+    std::vector<contact> ret;
+    for (size_t i = 0; i < k; ++i) {
+      auto d = i < inside ? rng() % (region - 10) : region;
+      ret.push_back({test::at_distance(key, d, rng), "127.0.0.1:" + std::to_string(i + 1)});
+    }
+    std::sort(ret.begin(), ret.end(), [&](auto& a, auto& b) {
+      return xor_distance(key, a.nid) < xor_distance(key, b.nid);
+    });
+    return ret;
+  }
+
+  bool same(std::vector<contact> a, std::vector<contact> b) {
+    auto by_nid = [](auto& x, auto& y) { return x.nid < y.nid; };
+    std::sort(a.begin(), a.end(), by_nid);
+    std::sort(b.begin(), b.end(), by_nid);
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](auto& x, auto& y) { return x.nid == y.nid; });
+  }
+}
+
+int main() {
+  std::mt19937_64 rng{std::random_device{}()};
+  lookup_cache cache;
+
+  // All but the furthest inside, so a nearby key gets them, closest to it first
+  auto key = generate_nid();
+  auto found = result(key, k - 1, rng);
+  cache.put(key, found, 10);
+  auto exact = cache.get(key);
+  CHECK(exact && same(*exact, found));
+  CHECK(std::equal(exact->begin(), exact->end(), found.begin(), [](auto& a, auto& b) { return a.nid == b.nid; }));
+
+  auto near = test::at_distance(key, region - 5, rng);
+  auto served = cache.get(near);
+  CHECK(served && same(*served, found));
+  CHECK(std::is_sorted(served->begin(), served->end(), [&](auto& a, auto& b) {
+    return xor_distance(near, a.nid) < xor_distance(near, b.nid);
+  }));
+  // Nobody outside could be closer to near than anyone inside
+  for (size_t i = 0; i + 1 < k; ++i)
+    CHECK(distance(key, (*served)[i].nid) < region);
+
+  // Only half inside, so it's only good for its own key
+  auto sparse_key = generate_nid();
+  auto sparse = result(sparse_key, k / 2, rng);
+  cache.put(sparse_key, sparse, 10);
+  CHECK(cache.get(sparse_key));
+  CHECK(!cache.get(test::at_distance(sparse_key, region - 5, rng)));
+
+  // Anyone in it going takes it with them
+  cache.dropped(found[3].nid);
+  CHECK(!cache.get(key));
+  CHECK(!cache.get(near));
+  CHECK(cache.get(sparse_key));
+
+  // As does hearing of someone closer than its furthest
+  cache.learned(test::at_distance(sparse_key, 0, rng));
+  CHECK(!cache.get(sparse_key));
+
+  auto stats = cache.get_stats();
+  CHECK(stats.invalidations == 2);
+  CHECK(stats.entries == 0);
+}
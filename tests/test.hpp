@@ -0,0 +1,76 @@
+#pragma once
+
+#include "base.hpp"
+#include "node.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Stays on in release builds, unlike assert
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+      std::exit(1); \
+    } \
+  } while (false)
+
+namespace c3::kademlia::test {
+  /// How long func takes to run, in seconds
+  template<typename Func>
+  inline double time_s(Func&& func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  /// Someone random at the given distance from ours, which is to say in that bucket of our table
+  inline nid_t at_distance(const nid_t& ours, size_t d, std::mt19937_64& rng) {
+    nid_t ret = ours;
+    size_t byte = ret.size() - 1 - d / 8;
+    uint8_t bit = static_cast<uint8_t>(1u << (d % 8));
+    ret[byte] = static_cast<uint8_t>(((ours[byte] ^ bit) & ~(bit - 1)) | (rng() & (bit - 1)));
+    for (size_t i = byte + 1; i < ret.size(); ++i)
+      ret[i] = static_cast<uint8_t>(rng());
+    return ret;
+  }
+
+  /// Joins each of net through the first
+  ///
+  /// Joining only looks for ourselves, so nobody hears of the far half of the network unless
+  /// someone from there happens to ask them something. Looking for the nid furthest from each of
+  /// them fills in the other side, or lookups for keys over there can end without ever reaching it
+  inline void join_all(std::vector<std::unique_ptr<node>>& net) {
+    for (size_t i = 1; i < net.size(); ++i) {
+      net[i]->add_peer("127.0.0.1:" + net[0]->get_port());
+      net[i]->join();
+    }
+    // Whoever joined early only found those before them, and nobody could see anyone until their
+    // routing table published, so look again once it has
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    for (auto& i : net)
+      i->join();
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+    for (auto& i : net) {
+      auto far = i->get_nid();
+      for (auto& j : far)
+        j = static_cast<uint8_t>(~j);
+      i->find(far);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds{300});
+  }
+
+  /// Some nodes on loopback, each joined through the first
+  inline std::vector<std::unique_ptr<node>> cluster(size_t count, node::server_options_t options = {}) {
+    std::vector<std::unique_ptr<node>> ret;
+    for (size_t i = 0; i < count; ++i)
+      ret.push_back(std::make_unique<node>("127.0.0.1:0", generate_nid(), std::make_shared<backing_store::simple>(), options));
+    join_all(ret);
+    return ret;
+  }
+}